@@ -0,0 +1,265 @@
+/*
+ * rsgain_bench: generate a deterministic synthetic library and measure the
+ * throughput and multithreaded scaling of Easy Mode and Custom Mode
+ */
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <filesystem>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "corpus.hpp"
+#include "output.hpp"
+
+#define MATCH(x,y) !strcmp(x,y)
+
+// The report is the only output on stdout, so it can be redirected to a file
+#define bench_status(format, ...) rsgain::print(stderr, OK_PREFIX format "\n" __VA_OPT__(,) __VA_ARGS__)
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+#define BENCH_HELP(CMDL, CMDS, MSG) rsgain::print("  {}{:<8} {:<20}{}  {}.\n", COLOR_YELLOW, CMDS ",", CMDL, COLOR_OFF, MSG);
+
+struct Run {
+    std::string mode;
+    unsigned int threads;
+    double seconds;
+};
+
+static std::vector<std::string> split(const char *list)
+{
+    std::vector<std::string> items;
+    std::string_view view(list);
+    while (!view.empty()) {
+        size_t pos = view.find(',');
+        std::string_view item = view.substr(0, pos);
+        if (!item.empty())
+            items.emplace_back(item);
+        view = pos == std::string_view::npos ? std::string_view() : view.substr(pos + 1);
+    }
+    return items;
+}
+
+template <typename T>
+static std::vector<T> split_numbers(const char *list)
+{
+    std::vector<T> numbers;
+    for (const std::string &item : split(list)) {
+        T n = (T) strtol(item.c_str(), nullptr, 10);
+        if (n <= 0) {
+            output_fail("Invalid number '{}'", item);
+            exit(EXIT_FAILURE);
+        }
+        numbers.push_back(n);
+    }
+    return numbers;
+}
+
+static std::string quote(const std::string &arg)
+{
+#ifdef _WIN32
+    return rsgain::format("\"{}\"", arg);
+#else
+    std::string ret = "'";
+    for (char c : arg) {
+        if (c == '\'')
+            ret += "'\\''";
+        else
+            ret += c;
+    }
+    return ret + "'";
+#endif
+}
+
+// Run a command and return its wall-clock time in seconds, or a negative value on failure.
+// Its output is discarded, only its errors are shown
+static double run(const std::string &command)
+{
+    const auto start = std::chrono::steady_clock::now();
+    int rc = std::system((command + " >" NULL_DEVICE).c_str());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (rc) {
+        output_error("Command failed: {}", command);
+        return -1.0;
+    }
+    return seconds;
+}
+
+static double best_of(const std::string &command, unsigned int repeat)
+{
+    double best = -1.0;
+    for (unsigned int i = 0; i < repeat; i++) {
+        double seconds = run(command);
+        if (seconds < 0.0)
+            return seconds;
+        if (best < 0.0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+static std::string custom_command(const std::string &executable, const CorpusAlbum &album, unsigned int threads)
+{
+    std::string command = rsgain::format("{} custom -a -s i -q -M {}", quote(executable), threads);
+    for (const auto &track : album.tracks)
+        command += " " + quote(track.string());
+    return command;
+}
+
+static void help()
+{
+    rsgain::print(COLOR_RED "Usage: " COLOR_OFF "rsgain_bench [OPTIONS] DIRECTORY\n");
+    rsgain::print("  Generate a synthetic library in DIRECTORY, scan it with rsgain, and print\n");
+    rsgain::print("  the results as JSON to stdout. Progress is printed to stderr.\n\n");
+    rsgain::print(COLOR_RED "Options:\n" COLOR_OFF);
+    BENCH_HELP("--help", "-h", "Show this help");
+    BENCH_HELP("--albums=n", "-a n", "Generate n albums per format (default 2)");
+    BENCH_HELP("--tracks=n", "-t n", "Generate n tracks per album (default 8)");
+    BENCH_HELP("--length=n", "-l n", "Average track length of n seconds (default 30)");
+    BENCH_HELP("--channels=list", "-c list", "Comma-separated channel counts, cycled per format and album (default 2)");
+    BENCH_HELP("--formats=list", "-f list", "Comma-separated formats to generate (default all available)");
+    BENCH_HELP("--seed=n", "-s n", "Random seed for the corpus (default 1)");
+    BENCH_HELP("--threads=list", "-m list", "Comma-separated thread counts to scan with (default 1, 2, 4 ... cores)");
+    BENCH_HELP("--repeat=n", "-r n", "Run each scan n times and keep the fastest (default 1)");
+    BENCH_HELP("--executable=f", "-e f", "Path to the rsgain executable");
+    rsgain::print("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int rc, i;
+    CorpusOptions options;
+    std::vector<unsigned int> threads;
+    unsigned int repeat = 1;
+    std::string executable = RSGAIN_EXECUTABLE;
+    const char *short_opts = "+ha:t:l:c:f:s:m:r:e:";
+    static struct option long_opts[] = {
+        { "help",       no_argument,       nullptr, 'h' },
+        { "albums",     required_argument, nullptr, 'a' },
+        { "tracks",     required_argument, nullptr, 't' },
+        { "length",     required_argument, nullptr, 'l' },
+        { "channels",   required_argument, nullptr, 'c' },
+        { "formats",    required_argument, nullptr, 'f' },
+        { "seed",       required_argument, nullptr, 's' },
+        { "threads",    required_argument, nullptr, 'm' },
+        { "repeat",     required_argument, nullptr, 'r' },
+        { "executable", required_argument, nullptr, 'e' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((rc = getopt_long(argc, argv, short_opts, long_opts, &i)) != -1) {
+        switch (rc) {
+            case 'h':
+                help();
+                return EXIT_SUCCESS;
+            case 'a':
+                options.albums = split_numbers<size_t>(optarg).front();
+                break;
+            case 't':
+                options.tracks = split_numbers<size_t>(optarg).front();
+                break;
+            case 'l':
+                options.length = strtod(optarg, nullptr);
+                break;
+            case 'c':
+                options.channels = split_numbers<int>(optarg);
+                break;
+            case 'f':
+                options.formats = split(optarg);
+                break;
+            case 's':
+                options.seed = (uint32_t) strtoul(optarg, nullptr, 10);
+                break;
+            case 'm':
+                threads = split_numbers<unsigned int>(optarg);
+                break;
+            case 'r':
+                repeat = split_numbers<unsigned int>(optarg).front();
+                break;
+            case 'e':
+                executable = optarg;
+                break;
+            default:
+                help();
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc == optind || options.length <= 0.0 || options.channels.empty()) {
+        help();
+        return EXIT_FAILURE;
+    }
+    if (threads.empty()) {
+        unsigned int max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+        for (unsigned int n = 1; n < max_threads; n *= 2)
+            threads.push_back(n);
+        threads.push_back(max_threads);
+    }
+
+    // Generate the corpus
+    std::filesystem::path directory(argv[optind]);
+    std::vector<CorpusAlbum> albums;
+    bench_status("Generating corpus in '{}'...", directory.string());
+    if (!generate_corpus(directory, options, albums)) {
+        output_fail("Failed to generate corpus");
+        return EXIT_FAILURE;
+    }
+    size_t nb_tracks = 0;
+    double duration = 0.0;
+    uintmax_t bytes = 0;
+    for (const CorpusAlbum &album : albums) {
+        nb_tracks += album.tracks.size();
+        duration += album.duration;
+        for (const auto &track : album.tracks)
+            bytes += std::filesystem::file_size(track);
+    }
+
+    // Easy Mode scans the whole tree, Custom Mode is invoked once per album like a tagger would
+    std::vector<Run> runs;
+    for (unsigned int n : threads) {
+        bench_status("Easy Mode with {} thread{}...", n, n > 1 ? "s" : "");
+        double seconds = best_of(rsgain::format("{} easy -q -m {} {}", quote(executable), n, quote(directory.string())), repeat);
+        if (seconds < 0.0)
+            return EXIT_FAILURE;
+        runs.push_back({"easy", n, seconds});
+    }
+    for (unsigned int n : threads) {
+        bench_status("Custom Mode with {} thread{}...", n, n > 1 ? "s" : "");
+        double seconds = 0.0;
+        for (const CorpusAlbum &album : albums) {
+            double s = best_of(custom_command(executable, album, n), repeat);
+            if (s < 0.0)
+                return EXIT_FAILURE;
+            seconds += s;
+        }
+        runs.push_back({"custom", n, seconds});
+    }
+
+    // Report
+    rsgain::print("{{\n  \"corpus\": {{\"albums\": {}, \"tracks\": {}, \"audio_seconds\": {:.3f}, \"bytes\": {}, \"seed\": {}}},\n  \"runs\": [\n",
+        albums.size(), nb_tracks, duration, bytes, options.seed);
+    for (const Run &r : runs) {
+        auto base = std::find_if(runs.begin(), runs.end(), [&](const Run &b) { return b.mode == r.mode && b.threads == 1; });
+        double speedup = base != runs.end() ? base->seconds / r.seconds : 0.0;
+        rsgain::print("    {{\"mode\": \"{}\", \"threads\": {}, \"seconds\": {:.3f}, \"files_per_second\": {:.2f}, "
+            "\"audio_seconds_per_second\": {:.2f}, \"mb_per_second\": {:.2f}, \"speedup\": {:.3f}, \"efficiency\": {:.3f}}}{}\n",
+            r.mode,
+            r.threads,
+            r.seconds,
+            (double) nb_tracks / r.seconds,
+            duration / r.seconds,
+            (double) bytes / 1e6 / r.seconds,
+            speedup,
+            speedup / r.threads,
+            &r == &runs.back() ? "" : ","
+        );
+    }
+    rsgain::print("  ]\n}}\n");
+    return EXIT_SUCCESS;
+}
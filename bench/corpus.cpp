@@ -0,0 +1,308 @@
+/*
+ * Deterministic synthetic music library generator
+ *
+ * Every track is generated from a seeded PRNG, so the same options always
+ * produce the same audio, and is encoded with the FFmpeg encoders that
+ * rsgain is linked against
+ */
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <numbers>
+#include <algorithm>
+#include <filesystem>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+#include <libavutil/avutil.h>
+#include <libavutil/channel_layout.h>
+}
+
+#include "corpus.hpp"
+#include "output.hpp"
+
+#define OLD_CHANNEL_LAYOUT LIBAVUTIL_VERSION_MAJOR < 57 || (LIBAVUTIL_VERSION_MAJOR == 57 && LIBAVUTIL_VERSION_MINOR < 18)
+#if OLD_CHANNEL_LAYOUT
+#error "The corpus generator requires FFmpeg 5.1 or later"
+#endif
+#define DEFAULT_FRAME_SIZE 1024
+
+// Small, fast PRNG with a fixed algorithm so the corpus is identical on every platform
+class Random {
+    private:
+        uint32_t state;
+
+    public:
+        Random(uint32_t seed) : state(seed ? seed : 1) {}
+        uint32_t next()
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+        double uniform() { return (double) next() / 4294967296.0; }
+        double uniform(double min, double max) { return min + (max - min) * uniform(); }
+};
+
+// A few detuned partials with slow amplitude modulation and a little noise.
+// The level varies between tracks so gains and clipping adjustments differ
+class Signal {
+    private:
+        struct Partial {
+            double frequency;
+            double amplitude;
+            double phase;
+        };
+        std::vector<Partial> partials;
+        double level;
+        double modulation;
+        double noise;
+        int sample_rate;
+        int64_t position = 0;
+        Random &random;
+
+    public:
+        Signal(Random &random, int sample_rate) : sample_rate(sample_rate), random(random)
+        {
+            for (int i = 0; i < 4; i++)
+                partials.push_back({random.uniform(55.0, 5000.0), random.uniform(0.1, 1.0), random.uniform(0.0, 2.0 * std::numbers::pi)});
+            level = std::pow(10.0, random.uniform(-30.0, 0.0) / 20.0);
+            modulation = random.uniform(0.05, 2.0);
+            noise = random.uniform(0.0, 0.05);
+        }
+
+        void fill(float *buffer, int nb_samples, int channels)
+        {
+            double sum = 0.0;
+            for (const Partial &p : partials)
+                sum += p.amplitude;
+            for (int i = 0; i < nb_samples; i++, position++) {
+                double t = (double) position / (double) sample_rate;
+                double env = 0.6 + 0.4 * std::sin(2.0 * std::numbers::pi * modulation * t);
+                double value = 0.0;
+                for (const Partial &p : partials)
+                    value += p.amplitude * std::sin(2.0 * std::numbers::pi * p.frequency * t + p.phase);
+                value = level * env * value / sum;
+                for (int c = 0; c < channels; c++)
+                    buffer[i * channels + c] = (float) std::clamp(value * (1.0 - 0.1 * c) + noise * (random.uniform() - 0.5), -1.0, 1.0);
+            }
+        }
+};
+
+const std::vector<CorpusFormat>& corpus_formats()
+{
+    static const std::vector<CorpusFormat> formats = {
+        {"mp2",     "mp2",  {"mp2", "mp2fixed"},       "mp2",  192000},
+        {"mp3",     "mp3",  {"libmp3lame"},            "mp3",  192000},
+        {"flac",    "flac", {"flac"},                  "flac", 0},
+        {"ogg",     "ogg",  {"libvorbis", "vorbis"},   "ogg",  160000},
+        {"opus",    "opus", {"libopus", "opus"},       "opus", 128000},
+        {"m4a",     "m4a",  {"libfdk_aac", "aac"},     "ipod", 192000},
+        {"wma",     "wma",  {"wmav2"},                 "asf",  192000},
+        {"wav",     "wav",  {"pcm_s16le"},             "wav",  0},
+        {"aiff",    "aiff", {"pcm_s16be"},             "aiff", 0},
+        {"wavpack", "wv",   {"wavpack"},               "wv",   0}
+    };
+    return formats;
+}
+
+static bool write_packets(AVCodecContext *codec_ctx, const AVFrame *frame, AVPacket *packet, AVFormatContext *format_ctx, AVStream *stream)
+{
+    int rc = avcodec_send_frame(codec_ctx, frame);
+    if (rc < 0)
+        return false;
+    while ((rc = avcodec_receive_packet(codec_ctx, packet)) == 0) {
+        av_packet_rescale_ts(packet, codec_ctx->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+        if (av_interleaved_write_frame(format_ctx, packet) < 0)
+            return false;
+    }
+    return rc == AVERROR(EAGAIN) || rc == AVERROR_EOF;
+}
+
+static int choose_sample_rate(const AVCodec *codec, int sample_rate)
+{
+    if (!codec->supported_samplerates)
+        return sample_rate;
+    int best = 0;
+    for (const int *rate = codec->supported_samplerates; *rate; rate++) {
+        if (*rate == sample_rate)
+            return sample_rate;
+        if (*rate == 48000 || !best)
+            best = *rate;
+    }
+    return best;
+}
+
+// An encoder set up for the format, or nullptr if it can't encode that many channels
+static AVCodecContext* open_encoder(const CorpusFormat &format, const AVCodec *codec, int channels, int sample_rate, bool global_header)
+{
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx)
+        return nullptr;
+    codec_ctx->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+    codec_ctx->sample_rate = choose_sample_rate(codec, sample_rate);
+    av_channel_layout_default(&codec_ctx->ch_layout, channels);
+    codec_ctx->time_base = {1, codec_ctx->sample_rate};
+    codec_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+    if (format.bit_rate)
+        codec_ctx->bit_rate = format.bit_rate * channels / 2;
+    if (global_header)
+        codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (avcodec_open2(codec_ctx, codec, nullptr) < 0)
+        avcodec_free_context(&codec_ctx);
+    return codec_ctx;
+}
+
+static bool supports_channels(const CorpusFormat &format, const AVCodec *codec, int channels, int sample_rate)
+{
+    AVCodecContext *codec_ctx = open_encoder(format, codec, channels, sample_rate, false);
+    avcodec_free_context(&codec_ctx);
+    return codec_ctx != nullptr;
+}
+
+static bool encode_track(const std::filesystem::path &file, const CorpusFormat &format, const AVCodec *codec, int channels, int sample_rate, double length, Random &random)
+{
+    bool ret = false;
+    AVFormatContext *format_ctx = nullptr;
+    AVCodecContext *codec_ctx = nullptr;
+    AVStream *stream = nullptr;
+    AVFrame *frame = nullptr;
+    AVPacket *packet = nullptr;
+    SwrContext *swr = nullptr;
+    std::vector<float> buffer;
+    const uint8_t *in[1];
+    int frame_size;
+    int64_t nb_samples, pts = 0;
+    Signal signal(random, sample_rate);
+
+    if (avformat_alloc_output_context2(&format_ctx, nullptr, format.muxer, file.string().c_str()) < 0)
+        goto end;
+    stream = avformat_new_stream(format_ctx, nullptr);
+    codec_ctx = open_encoder(format, codec, channels, sample_rate, format_ctx->oformat->flags & AVFMT_GLOBALHEADER);
+    if (!stream || !codec_ctx
+    || avcodec_parameters_from_context(stream->codecpar, codec_ctx) < 0)
+        goto end;
+    stream->time_base = codec_ctx->time_base;
+
+    if (avio_open(&format_ctx->pb, file.string().c_str(), AVIO_FLAG_WRITE) < 0
+    || avformat_write_header(format_ctx, nullptr) < 0)
+        goto end;
+
+    swr_alloc_set_opts2(&swr,
+        &codec_ctx->ch_layout,
+        codec_ctx->sample_fmt,
+        codec_ctx->sample_rate,
+        &codec_ctx->ch_layout,
+        AV_SAMPLE_FMT_FLT,
+        codec_ctx->sample_rate,
+        0,
+        nullptr
+    );
+    frame = av_frame_alloc();
+    packet = av_packet_alloc();
+    if (!swr || swr_init(swr) < 0 || !frame || !packet)
+        goto end;
+
+    // Always send whole frames, padding the end of the track with silence
+    frame_size = codec_ctx->frame_size ? codec_ctx->frame_size : DEFAULT_FRAME_SIZE;
+    frame->nb_samples = frame_size;
+    frame->format = codec_ctx->sample_fmt;
+    frame->sample_rate = codec_ctx->sample_rate;
+    av_channel_layout_copy(&frame->ch_layout, &codec_ctx->ch_layout);
+    if (av_frame_get_buffer(frame, 0) < 0)
+        goto end;
+    buffer.resize((size_t) (frame_size * channels));
+    in[0] = (const uint8_t*) buffer.data();
+    nb_samples = (int64_t) (length * codec_ctx->sample_rate);
+    while (pts < nb_samples) {
+        int n = (int) std::min<int64_t>(frame_size, nb_samples - pts);
+        std::fill(buffer.begin(), buffer.end(), 0.0f);
+        signal.fill(buffer.data(), n, channels);
+        if (av_frame_make_writable(frame) < 0
+        || swr_convert(swr, frame->data, frame_size, in, frame_size) < 0)
+            goto end;
+        frame->pts = pts;
+        pts += frame_size;
+        if (!write_packets(codec_ctx, frame, packet, format_ctx, stream))
+            goto end;
+    }
+    if (!write_packets(codec_ctx, nullptr, packet, format_ctx, stream)
+    || av_write_trailer(format_ctx) < 0)
+        goto end;
+    ret = true;
+
+end:
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    swr_free(&swr);
+    avcodec_free_context(&codec_ctx);
+    if (format_ctx) {
+        if (format_ctx->pb)
+            avio_closep(&format_ctx->pb);
+        avformat_free_context(format_ctx);
+    }
+    if (!ret)
+        output_error("Failed to generate '{}'", file.string());
+    return ret;
+}
+
+static const AVCodec* find_encoder(const CorpusFormat &format)
+{
+    for (const char *name : format.encoders) {
+        const AVCodec *codec = avcodec_find_encoder_by_name(name);
+        if (codec)
+            return codec;
+    }
+    return nullptr;
+}
+
+// Generate <directory>/<format>/album NN/track NN.<ext> for every requested format with an available encoder.
+// The channel counts are cycled over the formats and albums together, so every count is used even
+// with one album per format. A count that the encoder doesn't support moves on to the next one
+bool generate_corpus(const std::filesystem::path &directory, const CorpusOptions &options, std::vector<CorpusAlbum> &albums)
+{
+    for (const CorpusFormat &format : corpus_formats()) {
+        if (!options.formats.empty() && std::find(options.formats.begin(), options.formats.end(), format.name) == options.formats.end())
+            continue;
+        const AVCodec *codec = find_encoder(format);
+        if (!codec) {
+            corpus_warn("No encoder available for {}, skipping", format.name);
+            continue;
+        }
+        size_t index = (size_t) (&format - corpus_formats().data());
+        for (size_t a = 0; a < options.albums; a++) {
+            int channels = 0;
+            for (size_t c = 0; c < options.channels.size() && !channels; c++) {
+                int n = options.channels[(index + a + c) % options.channels.size()];
+                if (supports_channels(format, codec, n, options.sample_rate))
+                    channels = n;
+            }
+            if (!channels) {
+                corpus_warn("The {} encoder supports none of the channel counts, skipping", format.name);
+                break;
+            }
+
+            // Seed each album separately so it doesn't depend on which other encoders are available
+            Random random(options.seed * 0x9E3779B1u + (uint32_t) (index << 12) + (uint32_t) a);
+            CorpusAlbum &album = albums.emplace_back();
+            album.format = format.name;
+            album.channels = channels;
+            album.path = directory / format.name / rsgain::format("album {:02}", a + 1);
+            std::filesystem::create_directories(album.path);
+            for (size_t t = 0; t < options.tracks; t++) {
+                double length = options.length * random.uniform(0.5, 1.5);
+                std::filesystem::path file = album.path / rsgain::format("track {:02}.{}", t + 1, format.extension);
+                if (!encode_track(file, format, codec, album.channels, options.sample_rate, length, random))
+                    return false;
+                album.tracks.push_back(file);
+                album.duration += length;
+            }
+        }
+    }
+    return !albums.empty();
+}
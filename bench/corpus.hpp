@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <filesystem>
+
+// Warnings go to stderr, so they don't end up in the report that rsgain_bench writes to stdout
+#define corpus_warn(format, ...) rsgain::print(stderr, WARN_PREFIX format "\n" __VA_OPT__(,) __VA_ARGS__)
+
+// A file format that the synthetic corpus can be generated in. The encoders
+// are tried in order and the format is skipped if none of them are available
+struct CorpusFormat {
+    const char *name;
+    const char *extension;
+    std::vector<const char*> encoders;
+    const char *muxer;
+    int64_t bit_rate;
+};
+
+struct CorpusOptions {
+    size_t albums = 2;
+    size_t tracks = 8;
+    double length = 30.0;           // Average track length in seconds
+    std::vector<int> channels = {2}; // Cycled over the formats and albums
+    int sample_rate = 44100;
+    uint32_t seed = 1;
+    std::vector<std::string> formats; // Empty means every available format
+};
+
+struct CorpusAlbum {
+    std::filesystem::path path;
+    std::string format;
+    int channels;
+    std::vector<std::filesystem::path> tracks;
+    double duration = 0.0;
+};
+
+const std::vector<CorpusFormat>& corpus_formats();
+bool generate_corpus(const std::filesystem::path &directory, const CorpusOptions &options, std::vector<CorpusAlbum> &albums);
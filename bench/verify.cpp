@@ -0,0 +1,529 @@
+/*
+ * rsgain_verify: accuracy-regression harness
+ *
+ * Scans a generated corpus with a self-contained copy of the reference
+ * pipeline (decode, convert to S16, libebur128) and compares the loudness,
+ * gain and peak values that rsgain reports for each variant of its command
+ * line against it. Exits with a non-zero status if any value drifts beyond
+ * the configured tolerances.
+ *
+ * A variant that starts with "easy" runs Easy Mode on the whole corpus instead,
+ * with a generated preset that matches the Custom Mode settings
+ */
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+#include <libavutil/avutil.h>
+}
+#include <ebur128.h>
+
+#include "corpus.hpp"
+#include "output.hpp"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+#define TARGET_LOUDNESS -18.0
+#define PRESET_NAME "verify.ini"
+#define VERIFY_HELP(CMDL, CMDS, MSG) rsgain::print("  {}{:<8} {:<24}{}  {}.\n", COLOR_YELLOW, CMDS ",", CMDL, COLOR_OFF, MSG);
+
+// Both peaks are measured, since a variant may add -t
+struct Values {
+    double loudness = 0.0;
+    double gain = 0.0;
+    double peak = 0.0;
+    double true_peak = 0.0;
+    double album_loudness = 0.0;
+    double album_gain = 0.0;
+    double album_peak = 0.0;
+    double album_true_peak = 0.0;
+};
+
+struct Tolerances {
+    double loudness = 0.01;
+    double gain = 0.01;
+    double peak = 0.01;
+};
+
+struct Variant {
+    std::string args;
+    double min_tolerance = 0.0; // Loudness and gain drift that is always allowed, in LU
+};
+
+struct Deviation {
+    double loudness = 0.0;
+    double gain = 0.0;
+    double peak = 0.0;
+    size_t failures = 0;
+};
+
+struct EburDeleter {
+    void operator()(ebur128_state *ebur128) { ebur128_destroy(&ebur128); }
+};
+
+// The reference path, kept in step with the scalar pipeline in Track::scan.
+// It must not share code with rsgain so that changes there can't affect it
+static bool reference_scan(const std::filesystem::path &path, std::unique_ptr<ebur128_state, EburDeleter> &ebur128, Values &values)
+{
+    bool ret = false;
+    int rc, stream_id;
+    uint8_t *out_data[1];
+    const AVCodec *codec = nullptr;
+    AVFormatContext *format_ctx = nullptr;
+    AVCodecContext *codec_ctx = nullptr;
+    SwrContext *swr = nullptr;
+    AVPacket *packet = nullptr;
+    AVFrame *frame = nullptr;
+    int nb_channels;
+
+    if (avformat_open_input(&format_ctx, rsgain::format("file:{}", path.string()).c_str(), nullptr, nullptr) < 0
+    || avformat_find_stream_info(format_ctx, nullptr) < 0) {
+        output_error("Could not open '{}'", path.string());
+        goto end;
+    }
+    stream_id = av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+    if (stream_id < 0) {
+        output_error("Could not find audio stream in '{}'", path.string());
+        goto end;
+    }
+    codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx
+    || avcodec_parameters_to_context(codec_ctx, format_ctx->streams[stream_id]->codecpar) < 0
+    || avcodec_open2(codec_ctx, codec, nullptr) < 0) {
+        output_error("Could not open decoder for '{}'", path.string());
+        goto end;
+    }
+    nb_channels = codec_ctx->ch_layout.nb_channels;
+    if (codec_ctx->sample_fmt != AV_SAMPLE_FMT_S16) {
+        swr_alloc_set_opts2(&swr,
+            &codec_ctx->ch_layout,
+            AV_SAMPLE_FMT_S16,
+            codec_ctx->sample_rate,
+            &codec_ctx->ch_layout,
+            codec_ctx->sample_fmt,
+            codec_ctx->sample_rate,
+            0,
+            nullptr
+        );
+        if (!swr || swr_init(swr) < 0) {
+            output_error("Could not initialize libswresample");
+            goto end;
+        }
+    }
+    ebur128.reset(ebur128_init((unsigned int) nb_channels,
+        (unsigned long) codec_ctx->sample_rate,
+        EBUR128_MODE_I | EBUR128_MODE_SAMPLE_PEAK | EBUR128_MODE_TRUE_PEAK
+    ));
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!ebur128 || !packet || !frame) {
+        output_error("Out of memory");
+        goto end;
+    }
+
+    while (av_read_frame(format_ctx, packet) == 0) {
+        if (packet->stream_index == stream_id && avcodec_send_packet(codec_ctx, packet) == 0) {
+            while (avcodec_receive_frame(codec_ctx, frame) >= 0) {
+                if (frame->ch_layout.nb_channels == nb_channels) {
+                    if (swr) {
+                        out_data[0] = (uint8_t*) av_malloc((size_t) av_samples_get_buffer_size(nullptr, nb_channels, frame->nb_samples, AV_SAMPLE_FMT_S16, 0));
+                        rc = swr_convert(swr, out_data, frame->nb_samples, (const uint8_t**) frame->data, frame->nb_samples);
+                        if (rc >= 0)
+                            ebur128_add_frames_short(ebur128.get(), (short*) out_data[0], (size_t) frame->nb_samples);
+                        av_free(out_data[0]);
+                        if (rc < 0) {
+                            output_error("Could not convert audio frame");
+                            goto end;
+                        }
+                    }
+                    else
+                        ebur128_add_frames_short(ebur128.get(), (short*) frame->data[0], (size_t) frame->nb_samples);
+                }
+                av_frame_unref(frame);
+            }
+        }
+        av_packet_unref(packet);
+    }
+
+    if (ebur128_loudness_global(ebur128.get(), &values.loudness) != EBUR128_SUCCESS)
+        values.loudness = TARGET_LOUDNESS;
+    values.peak = 0.0;
+    values.true_peak = 0.0;
+    for (unsigned int ch = 0; ch < (unsigned int) nb_channels; ch++) {
+        double peak;
+        ebur128_sample_peak(ebur128.get(), ch, &peak);
+        values.peak = std::max(values.peak, peak);
+        ebur128_true_peak(ebur128.get(), ch, &peak);
+        values.true_peak = std::max(values.true_peak, peak);
+    }
+    values.gain = TARGET_LOUDNESS - values.loudness;
+
+    // Silent tracks are reported without gain or peak
+    if (values.loudness == -HUGE_VAL) {
+        values.gain = 0.0;
+        values.peak = 0.0;
+        values.true_peak = 0.0;
+    }
+    ret = true;
+
+end:
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&format_ctx);
+    swr_free(&swr);
+    return ret;
+}
+
+static bool reference_album(const CorpusAlbum &album, std::unordered_map<std::string, Values> &reference)
+{
+    std::vector<std::unique_ptr<ebur128_state, EburDeleter>> states(album.tracks.size());
+    std::vector<Values> values(album.tracks.size());
+    for (size_t i = 0; i < album.tracks.size(); i++) {
+        if (!reference_scan(album.tracks[i], states[i], values[i]))
+            return false;
+    }
+
+    std::vector<ebur128_state*> ptrs;
+    double album_loudness, album_peak = 0.0, album_true_peak = 0.0;
+    for (size_t i = 0; i < states.size(); i++) {
+        if (values[i].loudness != -HUGE_VAL)
+            ptrs.push_back(states[i].get());
+        album_peak = std::max(album_peak, values[i].peak);
+        album_true_peak = std::max(album_true_peak, values[i].true_peak);
+    }
+    if (ebur128_loudness_global_multiple(ptrs.data(), ptrs.size(), &album_loudness) != EBUR128_SUCCESS)
+        album_loudness = TARGET_LOUDNESS;
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i].album_loudness = album_loudness;
+        values[i].album_gain = TARGET_LOUDNESS - album_loudness;
+        values[i].album_peak = album_peak;
+        values[i].album_true_peak = album_true_peak;
+        reference.emplace(album.tracks[i].lexically_normal().string(), values[i]);
+    }
+    return true;
+}
+
+// Minimal readers for the flat JSON Lines objects that rsgain writes
+static std::string json_get_string(const std::string &line, std::string_view key)
+{
+    std::string ret;
+    size_t pos = line.find(rsgain::format("\"{}\":\"", key));
+    if (pos == std::string::npos)
+        return ret;
+    for (pos += key.size() + 4; pos < line.size() && line[pos] != '"'; pos++) {
+        if (line[pos] == '\\' && pos + 1 < line.size())
+            pos++;
+        ret += line[pos];
+    }
+    return ret;
+}
+
+static double json_get_number(const std::string &line, std::string_view key)
+{
+    size_t pos = line.find(rsgain::format("\"{}\":", key));
+    if (pos == std::string::npos || line.compare(pos + key.size() + 3, 4, "null") == 0)
+        return -HUGE_VAL;
+    return strtod(line.c_str() + pos + key.size() + 3, nullptr);
+}
+
+static std::string quote(const std::string &arg)
+{
+#ifdef _WIN32
+    return rsgain::format("\"{}\"", arg);
+#else
+    std::string ret = "'";
+    for (char c : arg)
+        ret += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    return ret + "'";
+#endif
+}
+
+static double peak_db(double peak)
+{
+    return peak > 0.0 ? 20.0 * log10(peak) : -HUGE_VAL;
+}
+
+// Difference between two values, treating matching infinities (silence) as equal
+static double difference(double a, double b)
+{
+    if (a == b)
+        return 0.0;
+    return std::fabs(a - b);
+}
+
+static void compare(const std::string &path, const char *name, double value, double expected, double tolerance, double &max, size_t &failures)
+{
+    double diff = difference(value, expected);
+    if (std::isnan(diff) || diff > tolerance) {
+        output_error("{}: {} {:.6f} differs from reference {:.6f}", path, name, value, expected);
+        failures++;
+    }
+    if (!std::isnan(diff))
+        max = std::max(max, diff);
+}
+
+// Easy Mode scans with the same settings as the Custom Mode command line of run_variant
+static bool write_preset(const std::filesystem::path &file, bool true_peak)
+{
+    FILE *stream = fopen(file.string().c_str(), "wb");
+    if (!stream) {
+        output_error("Could not write preset '{}'", file.string());
+        return false;
+    }
+    rsgain::print(stream, "[Global]\nTagMode=s\nAlbum=true\nTargetLoudness={}\nClipMode=n\nTruePeak={}\n", TARGET_LOUDNESS, true_peak);
+    fclose(stream);
+    return true;
+}
+
+static bool has_option(const std::string &args, std::string_view option)
+{
+    size_t start = 0;
+    while (start < args.size()) {
+        size_t end = std::min(args.find(' ', start), args.size());
+        if (std::string_view(args).substr(start, end - start) == option)
+            return true;
+        start = end + 1;
+    }
+    return false;
+}
+
+static bool run_variant(const std::string &executable,
+    const std::string &args,
+    const std::filesystem::path &directory,
+    const std::vector<CorpusAlbum> &albums,
+    bool true_peak,
+    const std::unordered_map<std::string, Values> &reference,
+    const Tolerances &tolerances,
+    Deviation &deviation)
+{
+    size_t seen = 0;
+    std::vector<std::string> commands;
+    bool variant_true_peak = true_peak || has_option(args, "-t");
+    if (args == "easy" || args.starts_with("easy ")) {
+        commands.push_back(rsgain::format("{} {} -j -p {} {}",
+            quote(executable),
+            args,
+            quote((directory / PRESET_NAME).string()),
+            quote(directory.string())
+        ));
+    }
+    else {
+        for (const CorpusAlbum &album : albums) {
+            std::string &command = commands.emplace_back(rsgain::format("{} custom -a -s s -j{}{} {}", quote(executable), true_peak ? " -t" : "", args.empty() ? "" : " ", args));
+            for (const auto &track : album.tracks)
+                command += " " + quote(track.string());
+        }
+    }
+
+    for (const std::string &command : commands) {
+        FILE *pipe = popen(command.c_str(), "r");
+        if (!pipe) {
+            output_error("Could not run '{}'", command);
+            return false;
+        }
+        std::string line;
+        char buffer[4096];
+        while (fgets(buffer, sizeof(buffer), pipe)) {
+            line += buffer;
+            if (line.back() != '\n')
+                continue;
+            if (json_get_string(line, "type") != "track") {
+                line.clear();
+                continue;
+            }
+            std::string path = std::filesystem::path(json_get_string(line, "path")).lexically_normal().string();
+            auto it = reference.find(path);
+            if (it == reference.end()) {
+                output_error("Unexpected output: {}", line);
+                deviation.failures++;
+            }
+            else {
+                const Values &ref = it->second;
+                compare(path, "track loudness", json_get_number(line, "track_loudness"), ref.loudness, tolerances.loudness, deviation.loudness, deviation.failures);
+                compare(path, "track gain", json_get_number(line, "track_gain"), ref.gain, tolerances.gain, deviation.gain, deviation.failures);
+                compare(path, "track peak (dB)", peak_db(json_get_number(line, "track_peak")), peak_db(variant_true_peak ? ref.true_peak : ref.peak), tolerances.peak, deviation.peak, deviation.failures);
+                compare(path, "album loudness", json_get_number(line, "album_loudness"), ref.album_loudness, tolerances.loudness, deviation.loudness, deviation.failures);
+                compare(path, "album gain", json_get_number(line, "album_gain"), ref.album_gain, tolerances.gain, deviation.gain, deviation.failures);
+                compare(path, "album peak (dB)", peak_db(json_get_number(line, "album_peak")), peak_db(variant_true_peak ? ref.album_true_peak : ref.album_peak), tolerances.peak, deviation.peak, deviation.failures);
+                seen++;
+            }
+            line.clear();
+        }
+        if (pclose(pipe)) {
+            output_error("Command failed: {}", command);
+            return false;
+        }
+    }
+    if (seen != reference.size()) {
+        output_error("rsgain reported {} of {} tracks", seen, reference.size());
+        return false;
+    }
+    return true;
+}
+
+static void help()
+{
+    rsgain::print(COLOR_RED "Usage: " COLOR_OFF "rsgain_verify [OPTIONS] DIRECTORY\n");
+    rsgain::print("  Generate a synthetic library in DIRECTORY and check that rsgain's results\n");
+    rsgain::print("  match the reference scanner within the given tolerances.\n\n");
+    rsgain::print(COLOR_RED "Options:\n" COLOR_OFF);
+    VERIFY_HELP("--help", "-h", "Show this help");
+    VERIFY_HELP("--albums=n", "-a n", "Generate n albums per format (default 1)");
+    VERIFY_HELP("--tracks=n", "-t n", "Generate n tracks per album (default 4)");
+    VERIFY_HELP("--length=n", "-l n", "Average track length of n seconds (default 20)");
+    VERIFY_HELP("--seed=n", "-s n", "Random seed for the corpus (default 1)");
+    VERIFY_HELP("--true-peak", "-T", "Compare true peaks instead of sample peaks");
+    VERIFY_HELP("--variant=args", "-x args", "Also check rsgain run with extra Custom Mode arguments, or Easy Mode ones after 'easy' (repeatable)");
+    VERIFY_HELP("--loudness-tolerance=n", "-L n", "Allow n LU of loudness drift (default 0.01)");
+    VERIFY_HELP("--gain-tolerance=n", "-G n", "Allow n dB of gain drift (default 0.01)");
+    VERIFY_HELP("--peak-tolerance=n", "-P n", "Allow n dB of peak drift (default 0.01)");
+    VERIFY_HELP("--executable=f", "-e f", "Path to the rsgain executable");
+    rsgain::print("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int rc, i;
+    CorpusOptions options;
+    Tolerances tolerances;
+    bool true_peak = false;
+
+    // Multithreading, the channel workers (which only run with true peak) and the constant
+    // memory histograms that a tiny memory limit forces, whose 0.1 LU bins need a looser
+    // tolerance. Last, the files are tagged with their loudness stored, then retagged from
+    // the tags alone. Opus mode r has no ReplayGain peak tags, so the peaks must be stored
+    // with the loudness
+    std::vector<Variant> variants = {
+        {""},
+        {"-M 4"},
+        {"-X 3 -t"},
+        {"easy -m 2 -b 1K", 0.1},
+        {"-s i -k -o r"},
+        {"-s r -o r"}
+    };
+    std::string executable = RSGAIN_EXECUTABLE;
+    const char *short_opts = "+ha:t:l:s:Tx:L:G:P:e:";
+    static struct option long_opts[] = {
+        { "help",               no_argument,       nullptr, 'h' },
+        { "albums",             required_argument, nullptr, 'a' },
+        { "tracks",             required_argument, nullptr, 't' },
+        { "length",             required_argument, nullptr, 'l' },
+        { "seed",               required_argument, nullptr, 's' },
+        { "true-peak",          no_argument,       nullptr, 'T' },
+        { "variant",            required_argument, nullptr, 'x' },
+        { "loudness-tolerance", required_argument, nullptr, 'L' },
+        { "gain-tolerance",     required_argument, nullptr, 'G' },
+        { "peak-tolerance",     required_argument, nullptr, 'P' },
+        { "executable",         required_argument, nullptr, 'e' },
+        { 0, 0, 0, 0 }
+    };
+    options.albums = 1;
+    options.tracks = 4;
+    options.length = 20.0;
+    options.channels = {2, 1, 6};
+
+    while ((rc = getopt_long(argc, argv, short_opts, long_opts, &i)) != -1) {
+        switch (rc) {
+            case 'h':
+                help();
+                return EXIT_SUCCESS;
+            case 'a':
+                options.albums = strtoul(optarg, nullptr, 10);
+                break;
+            case 't':
+                options.tracks = strtoul(optarg, nullptr, 10);
+                break;
+            case 'l':
+                options.length = strtod(optarg, nullptr);
+                break;
+            case 's':
+                options.seed = (uint32_t) strtoul(optarg, nullptr, 10);
+                break;
+            case 'T':
+                true_peak = true;
+                break;
+            case 'x':
+                variants.push_back({optarg});
+                break;
+            case 'L':
+                tolerances.loudness = strtod(optarg, nullptr);
+                break;
+            case 'G':
+                tolerances.gain = strtod(optarg, nullptr);
+                break;
+            case 'P':
+                tolerances.peak = strtod(optarg, nullptr);
+                break;
+            case 'e':
+                executable = optarg;
+                break;
+            default:
+                help();
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc == optind || !options.albums || !options.tracks || options.length <= 0.0) {
+        help();
+        return EXIT_FAILURE;
+    }
+
+    std::filesystem::path directory(argv[optind]);
+    std::vector<CorpusAlbum> albums;
+    output_ok("Generating corpus in '{}'...", directory.string());
+    if (!generate_corpus(directory, options, albums)) {
+        output_fail("Failed to generate corpus");
+        return EXIT_FAILURE;
+    }
+
+    if (!write_preset(directory / PRESET_NAME, true_peak))
+        return EXIT_FAILURE;
+
+    output_ok("Scanning corpus with the reference pipeline...");
+    std::unordered_map<std::string, Values> reference;
+    for (const CorpusAlbum &album : albums) {
+        if (!reference_album(album, reference))
+            return EXIT_FAILURE;
+    }
+
+    bool ok = true;
+    for (const Variant &variant : variants) {
+        Deviation deviation;
+        const std::string &args = variant.args;
+        Tolerances variant_tolerances = tolerances;
+        variant_tolerances.loudness = std::max(tolerances.loudness, variant.min_tolerance);
+        variant_tolerances.gain = std::max(tolerances.gain, variant.min_tolerance);
+        bool easy = args == "easy" || args.starts_with("easy ");
+        output_ok("Checking rsgain {}{}{}...", easy ? "" : "custom", easy || args.empty() ? "" : " ", args);
+        if (!run_variant(executable, args, directory, albums, true_peak, reference, variant_tolerances, deviation)) {
+            ok = false;
+            continue;
+        }
+        rsgain::print("  Max deviation: loudness {:.6f} LU, gain {:.6f} dB, peak {:.6f} dB\n",
+            deviation.loudness, deviation.gain, deviation.peak);
+        if (deviation.failures) {
+            output_fail("{} value{} out of tolerance", deviation.failures, deviation.failures > 1 ? "s" : "");
+            ok = false;
+        }
+    }
+
+    if (ok)
+        output_ok("All {} tracks match the reference", reference.size());
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,269 @@
+#include <string>
+#include <vector>
+#include <optional>
+#include <string_view>
+#include <algorithm>
+#include <filesystem>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "cue.hpp"
+#include "output.hpp"
+
+#define MAX_SHEET_SIZE (1 << 20)
+#define TRACK_INDENT "    "
+#define UTF8_BOM "\xEF\xBB\xBF"
+
+static bool read_file(const std::filesystem::path &path, std::string &contents)
+{
+    std::FILE *file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return false;
+    char buffer[4096];
+    size_t n;
+    contents.clear();
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0 && contents.size() <= MAX_SHEET_SIZE)
+        contents.append(buffer, n);
+    bool ok = !ferror(file) && contents.size() <= MAX_SHEET_SIZE;
+    fclose(file);
+    return ok;
+}
+
+// Split a line into its keyword and the rest, without leading whitespace or the line ending
+static std::string_view split_keyword(std::string_view line, std::string &keyword)
+{
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n'))
+        line.remove_suffix(1);
+    size_t start = line.find_first_not_of(" \t");
+    if (start == std::string_view::npos) {
+        keyword.clear();
+        return {};
+    }
+    line.remove_prefix(start);
+    size_t end = line.find_first_of(" \t");
+    keyword = line.substr(0, end);
+    std::transform(keyword.begin(), keyword.end(), keyword.begin(), ::toupper);
+    if (end == std::string_view::npos)
+        return {};
+    line.remove_prefix(end);
+    return line.substr(std::min(line.find_first_not_of(" \t"), line.size()));
+}
+
+// The file name of a FILE command, which is quoted if it contains spaces
+static std::string file_name(std::string_view args)
+{
+    if (args.starts_with('"')) {
+        size_t end = args.find('"', 1);
+        return std::string(args.substr(1, end == std::string_view::npos ? end : end - 1));
+    }
+    return std::string(args.substr(0, args.find_last_of(" \t")));
+}
+
+// Parse mm:ss:ff
+static bool parse_time(std::string_view args, int64_t &frames)
+{
+    std::string time(args);
+    int mm, ss, ff;
+    char c;
+    if (sscanf(time.c_str(), "%d:%d:%d%c", &mm, &ss, &ff, &c) != 3 || mm < 0 || ss < 0 || ss > 59 || ff < 0 || ff >= CUE_FRAMES_PER_SECOND)
+        return false;
+    frames = ((int64_t) mm * 60 + ss) * CUE_FRAMES_PER_SECOND + ff;
+    return true;
+}
+
+static bool starts_with_nocase(std::string_view s, std::string_view prefix)
+{
+    return s.size() >= prefix.size() && std::equal(prefix.begin(), prefix.end(), s.begin(), [](char a, char b) {
+        return toupper((unsigned char) a) == toupper((unsigned char) b);
+    });
+}
+
+static bool is_rg_comment(const std::string &keyword, std::string_view args)
+{
+    return keyword == "REM" && starts_with_nocase(args, "REPLAYGAIN_");
+}
+
+bool parse_cue_sheet(const std::filesystem::path &sheet, std::vector<CueFile> &files)
+{
+    std::string contents;
+    if (!read_file(sheet, contents))
+        return false;
+    std::string_view view(contents);
+    if (view.starts_with(UTF8_BOM))
+        view.remove_prefix(3);
+
+    files.clear();
+    std::string keyword;
+    CueTrack *track = nullptr;
+    while (!view.empty()) {
+        size_t end = view.find('\n');
+        std::string_view line = view.substr(0, end);
+        view.remove_prefix(end == std::string_view::npos ? view.size() : end + 1);
+        std::string_view args = split_keyword(line, keyword);
+
+        if (keyword == "FILE") {
+            std::string name = file_name(args);
+            if (name.empty())
+                return false;
+            files.push_back({(sheet.parent_path() / name).lexically_normal(), {}});
+            track = nullptr;
+        }
+        else if (keyword == "TRACK") {
+            if (files.empty())
+                return false;
+            std::string number(args);
+            char *end;
+            long n = strtol(number.c_str(), &end, 10);
+            if (end == number.c_str() || n < 1 || n > 99)
+                return false;
+            track = &files.back().tracks.emplace_back(CueTrack{.number = (int) n, .start = -1, .has_gain = false});
+        }
+        else if (keyword == "INDEX" && track) {
+            std::string index;
+            std::string_view time = split_keyword(args, index);
+            if (index == "01" && !parse_time(time, track->start))
+                return false;
+        }
+        else if (track && is_rg_comment(keyword, args) && starts_with_nocase(args, "REPLAYGAIN_TRACK_GAIN"))
+            track->has_gain = true;
+    }
+
+    // Every track needs a start, and the tracks of a file must be in order
+    for (const CueFile &file : files) {
+        for (const CueTrack &t : file.tracks) {
+            if (t.start < 0 || (&t != &file.tracks[0] && t.start <= (&t - 1)->start))
+                return false;
+        }
+    }
+    return !files.empty();
+}
+
+bool add_cue_tracks(const std::filesystem::path &sheet, std::vector<ScanJob::Track> &tracks, std::string &error)
+{
+    std::vector<CueFile> files;
+    if (!parse_cue_sheet(sheet, files)) {
+        error = rsgain::format("Could not parse CUE sheet '{}'", sheet.string());
+        return false;
+    }
+    for (const CueFile &file : files) {
+        if (!std::filesystem::exists(file.path)) {
+            error = rsgain::format("File '{}' referenced by '{}' does not exist", file.path.string(), sheet.string());
+            return false;
+        }
+        if (determine_filetype(file.path.extension().string()) == FileType::INVALID) {
+            error = rsgain::format("File '{}' referenced by '{}' is not of a supported type", file.path.string(), sheet.string());
+            return false;
+        }
+    }
+
+    // The sheet takes the place of its files if they were also listed
+    for (const CueFile &file : files) {
+        std::erase_if(tracks, [&](const ScanJob::Track &track) { return track.path.lexically_normal() == file.path; });
+        FileType type = determine_filetype(file.path.extension().string());
+        if (file.tracks.size() < 2) {
+            tracks.emplace_back(file.path, type);
+            continue;
+        }
+        for (const CueTrack &t : file.tracks) {
+            ScanJob::Track &track = tracks.emplace_back(file.path, type);
+            track.cue_sheet = sheet;
+            track.cue_number = t.number;
+            track.cue_start = t.start;
+            track.cue_end = &t == &file.tracks.back() ? -1 : (&t + 1)->start;
+        }
+    }
+    return true;
+}
+
+bool cue_gain_exists(const ScanJob::Track &track)
+{
+    std::vector<CueFile> files;
+    if (!parse_cue_sheet(track.cue_sheet, files))
+        return false;
+    for (const CueFile &file : files) {
+        if (file.path != track.path.lexically_normal())
+            continue;
+        for (const CueTrack &t : file.tracks) {
+            if (t.number == track.cue_number)
+                return t.has_gain;
+        }
+    }
+    return false;
+}
+
+bool tag_cue_sheet(const std::filesystem::path &sheet, const std::vector<const ScanJob::Track*> &tracks, const Config &config)
+{
+    std::string contents;
+    if (!read_file(sheet, contents))
+        return false;
+    const char *newline = contents.find("\r\n") == std::string::npos ? "\n" : "\r\n";
+    bool write = config.tag_mode == 'i' || config.tag_mode == 'r';
+    std::optional<std::filesystem::file_time_type> mtime;
+    if (config.preserve_mtimes)
+        mtime = std::filesystem::last_write_time(sheet);
+
+    // Drop the old comments and add the new ones: album values before the first FILE,
+    // track values right after each TRACK
+    std::string out;
+    std::string_view view(contents);
+    if (view.starts_with(UTF8_BOM)) {
+        out = UTF8_BOM;
+        view.remove_prefix(3);
+    }
+    std::string keyword;
+    std::filesystem::path file;
+    bool album_written = !write || !config.do_album || tracks.empty();
+    while (!view.empty()) {
+        size_t end = view.find('\n');
+        std::string_view line = view.substr(0, end == std::string_view::npos ? end : end + 1);
+        view.remove_prefix(line.size());
+        std::string_view args = split_keyword(line, keyword);
+        if (is_rg_comment(keyword, args))
+            continue;
+
+        if (keyword == "FILE") {
+            file = (sheet.parent_path() / file_name(args)).lexically_normal();
+            if (!album_written) {
+                const ScanResult &result = tracks[0]->result;
+                out += rsgain::format("REM REPLAYGAIN_ALBUM_GAIN {:.2f} dB{}", result.album_gain, newline);
+                out += rsgain::format("REM REPLAYGAIN_ALBUM_PEAK {:.6f}{}", result.album_peak, newline);
+                album_written = true;
+            }
+        }
+        out += line;
+        if (!line.ends_with('\n'))
+            out += newline;
+        if (keyword == "TRACK" && write) {
+            int number = atoi(std::string(args).c_str());
+            auto it = std::find_if(tracks.begin(), tracks.end(), [&](const ScanJob::Track *track) {
+                return track->cue_number == number && track->path.lexically_normal() == file;
+            });
+            if (it != tracks.end()) {
+                out += rsgain::format(TRACK_INDENT "REM REPLAYGAIN_TRACK_GAIN {:.2f} dB{}", (*it)->result.track_gain, newline);
+                out += rsgain::format(TRACK_INDENT "REM REPLAYGAIN_TRACK_PEAK {:.6f}{}", (*it)->result.track_peak, newline);
+            }
+        }
+    }
+
+    // Write next to the sheet and rename over it, so that a failed write leaves the sheet intact
+    std::filesystem::path temp = sheet;
+    temp += ".rsgain.tmp";
+    std::FILE *stream = fopen(temp.string().c_str(), "wb");
+    if (!stream)
+        return false;
+    bool ok = fwrite(out.data(), 1, out.size(), stream) == out.size();
+    ok = !fclose(stream) && ok;
+    std::error_code ec;
+    if (ok)
+        std::filesystem::permissions(temp, std::filesystem::status(sheet, ec).permissions(), ec);
+    if (ok)
+        std::filesystem::rename(temp, sheet, ec);
+    if (!ok || ec) {
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    if (mtime)
+        std::filesystem::last_write_time(sheet, *mtime, ec);
+    return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+/*
+ * CUE sheet support
+ *
+ * A single-file album rip is one audio image plus a CUE sheet giving the start of
+ * each track. The image is decoded once and the audio between each track's
+ * INDEX 01 and the next one's is analyzed as a separate track. The gains can't be
+ * written to the image's tags, so they are written to the sheet as the
+ * REM REPLAYGAIN_* comments that CUE-aware players read
+ */
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include "scan.hpp"
+
+#define CUE_FRAMES_PER_SECOND 75
+
+struct CueTrack {
+    int number;
+    int64_t start;   // INDEX 01 in CD frames
+    bool has_gain;   // Has a REM REPLAYGAIN_TRACK_GAIN comment
+};
+
+struct CueFile {
+    std::filesystem::path path; // Resolved against the directory of the sheet
+    std::vector<CueTrack> tracks;
+};
+
+// Returns false if the sheet can't be read or is malformed
+bool parse_cue_sheet(const std::filesystem::path &sheet, std::vector<CueFile> &files);
+
+// Add the tracks of a sheet whose image has more than one track. Files with a single
+// track are added as regular tracks. Returns false if the sheet can't be used
+bool add_cue_tracks(const std::filesystem::path &sheet, std::vector<ScanJob::Track> &tracks, std::string &error);
+
+// Whether the sheet has track gain for the track
+bool cue_gain_exists(const ScanJob::Track &track);
+
+// Rewrite the REM REPLAYGAIN_* comments of a sheet for the given tracks, or just
+// remove them for tag mode 'd'
+bool tag_cue_sheet(const std::filesystem::path &sheet, const std::vector<const ScanJob::Track*> &tracks, const Config &config);
@@ -1,8 +1,8 @@
 #include <filesystem>
 #include <vector>
-#include <queue>
 #include <chrono>
 #include <set>
+#include <optional>
 #include <string>
 #include <thread>
 #include <algorithm>
@@ -16,6 +16,15 @@
 #include <stdlib.h>
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 #endif
 #include <ini.h>
 #include <getopt.h>
@@ -25,9 +34,12 @@
 #include "easymode.hpp"
 #include "output.hpp"
 #include "scan.hpp"
+#include "trace.hpp"
+#include "resources.hpp"
 
 #define MAX_THREAD_SLEEP 30
 #define HELP_STATS(title, format, ...) rsgain::print(COLOR_YELLOW "{:<18} " COLOR_OFF format "\n", title ":" __VA_OPT__(,) __VA_ARGS__)
+#define HELP_STAGE(title, seconds, total) HELP_STATS(title, "{:10.2f} s ({:4.1f}%)", seconds, 100.0 * (seconds) / (total))
 
 extern "C" {
     int format_handler(void *user, const char *section, const char *name, const char *value);
@@ -35,9 +47,11 @@ extern "C" {
 }
 
 static inline void help_easy();
+static void print_performance(const ScanData &data, double elapsed);
+static bool parse_device_limits(const char *value, DeviceLimits &limits);
 bool multithread = false;
 
-static Config configs[] = {
+static const ConfigTable default_configs = {{
 
     // Default config
     {
@@ -56,7 +70,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // MP2 config
@@ -76,7 +96,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // MP3 config
@@ -96,7 +122,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // FLAC config
@@ -116,7 +148,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // OGG config
@@ -136,7 +174,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // OPUS config
@@ -156,7 +200,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // M4A config
@@ -176,7 +226,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // WMA config
@@ -196,7 +252,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // WAV config
@@ -216,7 +278,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // AIFF config
@@ -236,7 +304,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // Wavpack config
@@ -256,7 +330,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // APE config
@@ -276,7 +356,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
 
     // TAK config
@@ -296,7 +382,13 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     },
     
     // Musepack config
@@ -316,13 +408,26 @@ static Config configs[] = {
         .opus_mode = 'd',
         .skip_mp4 = false,
         .preserve_mtimes = false,
-        .dual_mono = false
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
     }
-};
+}};
+static ConfigTable configs = default_configs;
+static bool retag = false;
 
 const Config& get_config(FileType type)
 {
-    return configs[static_cast<int>(type)];
+    return configs[static_cast<size_t>(type)];
+}
+
+const ConfigTable& get_default_configs()
+{
+    return default_configs;
 }
 
 // Parse Easy Mode command line arguments
@@ -330,8 +435,13 @@ void easy_mode(int argc, char *argv[])
 {
     int rc, i;
     char *preset = nullptr;
-    const char *short_opts = "+hqSl:m:p:O::";
+    const char *short_opts = "+hqSrsl:m:b:R:D:p:O::j::T:";
     unsigned int threads = 1;
+    size_t memory_limit = 0;
+    std::optional<ReadOrder> order;
+    DeviceLimits device_limits;
+    std::optional<std::filesystem::path> json;
+    bool stats = false;
     opterr = 0;
 
     static struct option long_opts[] = {
@@ -339,9 +449,16 @@ void easy_mode(int argc, char *argv[])
         { "quiet",         no_argument,       nullptr, 'q' },
 
         { "skip-existing", no_argument,       nullptr, 'S' },
+        { "retag",         no_argument,       nullptr, 'r' },
         { "multithread",   required_argument, nullptr, 'm' },
+        { "memory-limit",  required_argument, nullptr, 'b' },
+        { "read-order",    required_argument, nullptr, 'R' },
+        { "device-limit",  required_argument, nullptr, 'D' },
         { "preset",        required_argument, nullptr, 'p' },
         { "output",        optional_argument, nullptr, 'O' },
+        { "json",          optional_argument, nullptr, 'j' },
+        { "stats",         no_argument,       nullptr, 's' },
+        { "trace",         required_argument, nullptr, 'T' },
         { 0, 0, 0, 0 }
     };
     while ((rc = getopt_long(argc, argv, short_opts, long_opts, &i)) != -1) {
@@ -359,45 +476,71 @@ void easy_mode(int argc, char *argv[])
                 for (Config &config : configs)
                     config.skip_existing = true;
                 break;
+
+            case 'r':
+                retag = true;
+                break;
             
             case 'm':
-                {
-                    unsigned int max_threads = std::thread::hardware_concurrency();
-                    if (!max_threads)
-                        max_threads = 1;
-                    if (MATCH(optarg, "MAX") || MATCH(optarg, "max")) {
-                        threads = max_threads;
-                    }
-                    else {
-                        threads = (unsigned int) (strtoul(optarg, nullptr, 10));
-                        if (threads < 1) {
-                            output_fail("Invalid multithread argument '{}'", optarg);
-                            quit(EXIT_FAILURE);
-                        }
-                        else if (threads > max_threads) {
-                            output_warn("{} threads were requested, but only {} are available", threads, max_threads);
-                            threads = max_threads;
-                        }
-                    }
-                    multithread = (threads > 1);
+                if (!parse_multithread(optarg, threads))
+                    quit(EXIT_FAILURE);
+                multithread = (threads > 1);
+                break;
+
+            case 'b':
+                if (!parse_memory_limit(optarg, memory_limit))
+                    quit(EXIT_FAILURE);
+                break;
+
+            case 'R':
+                if (MATCH(optarg, "cost"))
+                    order = ReadOrder::COST;
+                else if (MATCH(optarg, "directory"))
+                    order = ReadOrder::DIRECTORY;
+                else if (MATCH(optarg, "inode"))
+                    order = ReadOrder::INODE;
+                else if (MATCH(optarg, "extent"))
+                    order = ReadOrder::EXTENT;
+                else {
+                    output_fail("Invalid read order '{}'", optarg);
+                    quit(EXIT_FAILURE);
                 }
                 break;
+
+            case 'D':
+                if (!parse_device_limits(optarg, device_limits))
+                    quit(EXIT_FAILURE);
+                break;
             
             case 'p':
                 if (preset == nullptr)
                     preset = optarg;
                 break;
 
-            case 'O':
-                if (optarg) {
-                    const auto& [sep_header, sort_alphanum] = parse_output_mode(optarg);
-                    for (Config &config : configs) {
-                        config.sep_header = sep_header;
-                        config.sort_alphanum = sort_alphanum;
-                    }
+            case 'O': {
+                OutputMode mode;
+                if (optarg)
+                    mode = parse_output_mode(optarg);
+                for (Config &config : configs) {
+                    config.sep_header = mode.sep_header;
+                    config.sort_alphanum = mode.sort_alphanum;
+                    config.tab_output = mode.consolidated ? OutputType::CONSOLIDATED : OutputType::FILE;
                 }
-                for (Config &config : configs)
-                    config.tab_output = OutputType::FILE;
+                break;
+            }
+
+            case 's':
+                stats = true;
+                break;
+
+            case 'T':
+                Trace::start(optarg);
+                break;
+
+            case 'j':
+                json = optarg ? std::filesystem::path(optarg) : std::filesystem::path();
+                if (json->empty())
+                    quiet = true;
                 break;
 
             case '?':
@@ -414,7 +557,7 @@ void easy_mode(int argc, char *argv[])
         quit(EXIT_FAILURE);
     }
 
-    scan_easy(argv[optind], preset ? preset : std::filesystem::path(), threads);
+    scan_easy(argv[optind], preset ? preset : std::filesystem::path(), threads, memory_limit, order.value_or(threads > 1 ? ReadOrder::COST : ReadOrder::DIRECTORY), device_limits, json, stats);
 }
 
 static bool convert_bool(const char *value, bool &setting)
@@ -452,146 +595,211 @@ static FileType determine_section_type(const std::string &section)
     return it == map.end() ? FileType::INVALID : it->second;
 }
 
+// Preset being parsed, passed to the INI callbacks
+struct PresetParser {
+    ConfigTable &configs;
+    bool error = false;
+};
+
 // Callback for INI parser
-int global_handler([[maybe_unused]] void *user, const char *section, const char *name, const char *value)
+int global_handler(void *user, const char *section, const char *name, const char *value)
 {
     if (strcmp(section, "Global"))
         return 0;
+    PresetParser *parser = static_cast<PresetParser*>(user);
 
     // Parse setting keys
     if (MATCH(name, "Album")) {
         bool do_album;
         if(convert_bool(value, do_album)) {
-            for (Config &config : configs)
+            for (Config &config : parser->configs)
                 config.do_album = do_album;
         }
         else
-            quit(EXIT_FAILURE);
+            parser->error = true;
     }
     else if (MATCH(name, "TagMode")) {
         char tag_mode;
         if (parse_tag_mode_easy(value, tag_mode)) {
-            for (Config &config : configs)
+            for (Config &config : parser->configs)
                 config.tag_mode = tag_mode;
         }
         else
-            quit(EXIT_FAILURE);
+            parser->error = true;
     }
     else if (MATCH(name, "ClipMode")) {
         char clip_mode;
         if (parse_clip_mode(value, clip_mode)) {
-            for (Config &config : configs)
+            for (Config &config : parser->configs)
                 config.clip_mode = clip_mode;
         }
         else
-            quit(EXIT_FAILURE);
+            parser->error = true;
     }
     else if (MATCH(name, "TargetLoudness")) {
         double target_loudness;
         if (parse_target_loudness(value, target_loudness)) {
-            for (Config &config : configs)
+            for (Config &config : parser->configs)
                 config.target_loudness = target_loudness;
         }
         else
-            quit(EXIT_FAILURE);
+            parser->error = true;
     }
     else if (MATCH(name, "MaxPeakLevel")) {
         double max_peak_level;
         if (parse_max_peak_level(value, max_peak_level)) {
-            for (Config &config : configs)
+            for (Config &config : parser->configs)
                 config.max_peak_level = max_peak_level;
         }
         else
-            quit(EXIT_FAILURE);
+            parser->error = true;
     }
     else if (MATCH(name, "TruePeak")) {
         bool true_peak;
         if (convert_bool(value, true_peak)) {
-            for (Config &config : configs)
+            for (Config &config : parser->configs)
                 config.true_peak = true_peak;
         }
         else
-            quit(EXIT_FAILURE);
+            parser->error = true;
     }
     else if (MATCH(name, "Lowercase")) {
         bool lowercase;
         if (convert_bool(value, lowercase)) {
-            for (Config &config : configs)
+            for (Config &config : parser->configs)
                 config.lowercase = lowercase;
         }
         else
-            quit(EXIT_FAILURE);
+            parser->error = true;
     }
     else if (MATCH(name, "ID3v2Version")) {
         unsigned int id3v2version;
         if (parse_id3v2_version(value, id3v2version)) {
-            for (Config &config : configs)
+            for (Config &config : parser->configs)
                 config.id3v2version = id3v2version;
         }
         else
-            quit(EXIT_FAILURE);
+            parser->error = true;
     }
     else if (MATCH(name, "OpusMode")) {
         char opus_mode;
         if (parse_opus_mode(value, opus_mode)) {
-            for (Config &config : configs)
+            for (Config &config : parser->configs)
                 config.opus_mode = opus_mode;
         }
         else
-            quit(EXIT_FAILURE);
+            parser->error = true;
     }
     else if (MATCH(name, "PreserveMtimes")) {
         bool preserve_mtimes;
         if (convert_bool(value, preserve_mtimes)) {
-            for (Config &config : configs)
+            for (Config &config : parser->configs)
                 config.preserve_mtimes = preserve_mtimes;
         }
         else
-            quit(EXIT_FAILURE);
+            parser->error = true;
     }
     else if (MATCH(name, "DualMono")) {
         bool dual_mono;
         if (convert_bool(value, dual_mono)) {
-            for (Config &config : configs)
+            for (Config &config : parser->configs)
                 config.dual_mono = dual_mono;
         }
         else
-            quit(EXIT_FAILURE);
+            parser->error = true;
+    }
+    else if (MATCH(name, "Profiles")) {
+        std::vector<Profile> profiles;
+        if (parse_profiles(value, profiles)) {
+            for (Config &config : parser->configs)
+                config.profiles = profiles;
+        }
+        else
+            parser->error = true;
+    }
+    else if (MATCH(name, "LoudnessRange")) {
+        bool loudness_range;
+        if (convert_bool(value, loudness_range)) {
+            for (Config &config : parser->configs)
+                config.loudness_range = loudness_range;
+        }
+        else
+            parser->error = true;
+    }
+    else if (MATCH(name, "StoreLoudness")) {
+        bool store_loudness;
+        if (convert_bool(value, store_loudness)) {
+            for (Config &config : parser->configs)
+                config.store_loudness = store_loudness;
+        }
+        else
+            parser->error = true;
+    }
+    else if (MATCH(name, "Chapters")) {
+        bool chapters;
+        if (convert_bool(value, chapters)) {
+            for (Config &config : parser->configs)
+                config.chapters = chapters;
+        }
+        else
+            parser->error = true;
+    }
+    else if (MATCH(name, "AllStreams")) {
+        bool all_streams;
+        if (convert_bool(value, all_streams)) {
+            for (Config &config : parser->configs)
+                config.all_streams = all_streams;
+        }
+        else
+            parser->error = true;
     }
     return 0;
 }
 
-int format_handler([[maybe_unused]] void *user, const char *section, const char *name, const char *value)
+int format_handler(void *user, const char *section, const char *name, const char *value)
 {
     FileType file_type = determine_section_type(section);
     if (file_type == FileType::INVALID)
         return 0;
+    Config &config = static_cast<PresetParser*>(user)->configs[static_cast<size_t>(file_type)];
 
     // Parse setting keys
     if (MATCH(name, "Album"))
-        convert_bool(value, configs[static_cast<int>(file_type)].do_album);
+        convert_bool(value, config.do_album);
     else if (MATCH(name, "TagMode"))
-        parse_tag_mode_easy(value, configs[static_cast<int>(file_type)].tag_mode);
+        parse_tag_mode_easy(value, config.tag_mode);
     else if (MATCH(name, "ClipMode"))
-        parse_clip_mode(value, configs[static_cast<int>(file_type)].clip_mode);
+        parse_clip_mode(value, config.clip_mode);
     else if (MATCH(name, "Lowercase"))
-        convert_bool(value, configs[static_cast<int>(file_type)].lowercase);
+        convert_bool(value, config.lowercase);
     else if (MATCH(name, "ID3v2Version"))
-        parse_id3v2_version(value, configs[static_cast<int>(file_type)].id3v2version);
+        parse_id3v2_version(value, config.id3v2version);
     else if (MATCH(name, "TargetLoudness"))
-        parse_target_loudness(value, configs[static_cast<int>(file_type)].target_loudness);
+        parse_target_loudness(value, config.target_loudness);
     else if (MATCH(name, "MaxPeakLevel"))
-        parse_max_peak_level(value, configs[static_cast<int>(file_type)].max_peak_level);
+        parse_max_peak_level(value, config.max_peak_level);
     else if (MATCH(name, "TruePeak"))
-        convert_bool(value, configs[static_cast<int>(file_type)].true_peak);
+        convert_bool(value, config.true_peak);
     else if (MATCH(name, "OpusMode"))
-        parse_opus_mode(value, configs[static_cast<int>(file_type)].opus_mode);
+        parse_opus_mode(value, config.opus_mode);
     else if (file_type == FileType::M4A && MATCH(name, "SkipMP4"))
-        convert_bool(value, configs[static_cast<int>(file_type)].skip_mp4);
+        convert_bool(value, config.skip_mp4);
     else if (MATCH(name, "PreserveMtimes"))
-        convert_bool(value, configs[static_cast<int>(file_type)].preserve_mtimes);
+        convert_bool(value, config.preserve_mtimes);
     else if (MATCH(name, "DualMono"))
-        convert_bool(value, configs[static_cast<int>(file_type)].dual_mono);
+        convert_bool(value, config.dual_mono);
+    else if (MATCH(name, "LoudnessRange"))
+        convert_bool(value, config.loudness_range);
+    else if (MATCH(name, "StoreLoudness"))
+        convert_bool(value, config.store_loudness);
+    else if (MATCH(name, "Chapters"))
+        convert_bool(value, config.chapters);
+    else if (MATCH(name, "AllStreams"))
+        convert_bool(value, config.all_streams);
+    else if (MATCH(name, "Profiles")) {
+        config.profiles.clear();
+        parse_profiles(value, config.profiles);
+    }
     return 0;
 }
 
@@ -614,7 +822,7 @@ inline std::filesystem::path join_paths(const std::filesystem::path &first, cons
     return join_path(path, args...) ? path : std::filesystem::path();
 }
 
-static void load_preset(const std::filesystem::path &preset)
+bool load_preset(const std::filesystem::path &preset, ConfigTable &configs)
 {
     std::filesystem::path path(preset);
 
@@ -653,30 +861,34 @@ static void load_preset(const std::filesystem::path &preset)
 
     if (!std::filesystem::exists(path)) {
         output_error("Could not locate preset '{}'", preset.string());
-        quit(EXIT_FAILURE);
+        return false;
     }
 
     // Parse file
     std::FILE *file = fopen(path.string().c_str(), "r");
     if (!file) {
         output_error("Failed to open preset from '{}'", path.string());
-        quit(EXIT_FAILURE);
+        return false;
     }
 
     output_ok("Applying preset '{}'...", preset.string());
-    ini_parse_file(file, global_handler, nullptr);
+    PresetParser parser = {configs};
+    ini_parse_file(file, global_handler, &parser);
     rewind(file);
-    ini_parse_file(file, format_handler, nullptr);
+    ini_parse_file(file, format_handler, &parser);
     fclose(file);
+    return !parser.error;
 }
 
-bool WorkerThread::place_job(std::unique_ptr<ScanJob> &job)
+bool WorkerThread::place_job(std::unique_ptr<ScanJob> &job, size_t memory)
 {
     std::unique_lock lock(mutex, std::try_to_lock);
     if (!lock.owns_lock())
         return false;
     
     this->job = std::move(job);
+    this->memory = memory;
+    running = true;
     job_available = true;
     cv.notify_all();
     return true;
@@ -684,6 +896,7 @@ bool WorkerThread::place_job(std::unique_ptr<ScanJob> &job)
 
 void WorkerThread::work()
 {
+    Trace::set_thread_name("Worker");
     std::unique_lock lock(mutex);
     {
         std::scoped_lock main_lock(main_mutex);
@@ -696,14 +909,24 @@ void WorkerThread::work()
             
             // Update statistics
             {
+                TraceScope trace("main_lock");
+                auto t = std::chrono::steady_clock::now();
                 std::scoped_lock main_lock(main_mutex);
+                data.main_lock_wait += lap(t);
+                trace.end();
                 job->update_data(data);
+
+                // Free the tracks before the main thread admits jobs into their memory
+                job.reset();
+                memory = 0;
+                running = false;
             }
             job_available = false;
             main_cv.notify_all();
         }
                                                                                                                                                                                                                                                                                                                                                                         
         // Wait until we get a new job from the main thread
+        TraceScope trace("queue_wait");
         cv.wait_for(lock, std::chrono::seconds(MAX_THREAD_SLEEP));
     }
 }
@@ -722,9 +945,270 @@ bool WorkerThread::wait()
     return true;
 }
 
-void scan_easy(const std::filesystem::path &path, const std::filesystem::path &preset, size_t nb_threads)
+// A comma separated list of TYPE=n or PATH=n, where TYPE is ssd, hdd, network or unknown,
+// and PATH sets the limit of the device that the path is on
+static bool parse_device_limits(const char *value, DeviceLimits &limits)
+{
+    std::string_view list(value);
+    while (!list.empty()) {
+        size_t end = list.find(',');
+        std::string item(list.substr(0, end));
+        list.remove_prefix(end == std::string_view::npos ? list.size() : end + 1);
+        size_t equals = item.find_last_of('=');
+        char *rest;
+        unsigned long n = equals == std::string::npos ? 0 : strtoul(item.c_str() + equals + 1, &rest, 10);
+        if (equals == std::string::npos || !equals || rest == item.c_str() + equals + 1 || *rest) {
+            output_fail("Invalid device limit '{}'", item);
+            return false;
+        }
+        std::string key = item.substr(0, equals);
+        if (key == "ssd")
+            limits.ssd = (unsigned int) n;
+        else if (key == "hdd")
+            limits.hdd = (unsigned int) n;
+        else if (key == "network")
+            limits.network = (unsigned int) n;
+        else if (key == "unknown")
+            limits.unknown = (unsigned int) n;
+        else if (std::filesystem::exists(key))
+            limits.devices.emplace_back(device_id(key), (unsigned int) n);
+        else {
+            output_fail("'{}' is not a device type or an existing path", key);
+            return false;
+        }
+    }
+    return true;
+}
+
+unsigned int DeviceLimits::get(const std::filesystem::path &path) const
+{
+    uint64_t id = device_id(path);
+    for (const auto &[device, limit] : devices) {
+        if (device == id)
+            return limit;
+    }
+    switch (device_type(path)) {
+        case DeviceType::SSD:
+            return ssd;
+        case DeviceType::HDD:
+            return hdd;
+        case DeviceType::NETWORK:
+            return network;
+        default:
+            return unknown;
+    }
+}
+
+// Where the file is on the disk. Extents fall back to the inode number if the filesystem
+// doesn't support FIEMAP. Files without a location, e.g. on Windows, keep their order
+static uint64_t disk_location([[maybe_unused]] const std::filesystem::path &path, [[maybe_unused]] ReadOrder order)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st))
+        return 0;
+#ifdef __linux__
+    if (order == ReadOrder::EXTENT) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            alignas(struct fiemap) char buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+            struct fiemap *map = reinterpret_cast<struct fiemap*>(buffer);
+            map->fm_length = FIEMAP_MAX_OFFSET;
+            map->fm_extent_count = 1;
+            bool mapped = !ioctl(fd, FS_IOC_FIEMAP, map) && map->fm_mapped_extents;
+            close(fd);
+            if (mapped)
+                return map->fm_extents[0].fe_physical;
+        }
+    }
+#endif
+    return st.st_ino;
+#endif
+}
+
+PendingJobs::Name PendingJobs::intern(const std::filesystem::path &name)
+{
+    std::u8string s = name.u8string();
+    Name slice = {static_cast<uint32_t>(arena.size()), static_cast<uint32_t>(s.size())};
+    arena.append(reinterpret_cast<const char*>(s.data()), s.size());
+    return slice;
+}
+
+std::filesystem::path PendingJobs::get(Name name) const
+{
+    const char8_t *data = reinterpret_cast<const char8_t*>(arena.data()) + name.offset;
+    return std::filesystem::path(std::u8string_view(data, name.length));
+}
+
+uint32_t PendingJobs::add_directory(uint32_t parent, const std::filesystem::path &name)
+{
+    directories.push_back({parent, intern(name)});
+    return static_cast<uint32_t>(directories.size() - 1);
+}
+
+uint32_t PendingJobs::add_device(uint64_t id, bool &added)
+{
+    auto it = std::find_if(devices.begin(), devices.end(), [&](const Device &device) { return device.id == id; });
+    added = it == devices.end();
+    if (added) {
+        devices.push_back({.id = id});
+        return static_cast<uint32_t>(devices.size() - 1);
+    }
+    return static_cast<uint32_t>(it - devices.begin());
+}
+
+// The files of the job are stored in the order of their locations, if given
+void PendingJobs::add_job(uint32_t directory, uint32_t device, const std::vector<std::filesystem::path> &names, const std::vector<uint64_t> &locations, double cost, uintmax_t bytes)
+{
+    std::vector<size_t> order(names.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    if (!locations.empty())
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return locations[a] < locations[b]; });
+    jobs.push_back({
+        .directory = directory,
+        .device = device,
+        .first_file = static_cast<uint32_t>(files.size()),
+        .nb_files = static_cast<uint32_t>(names.size()),
+        .location = locations.empty() ? 0 : locations[order[0]],
+        .cost = (float) cost,
+        .cost_per_byte = bytes ? (float) (cost / (double) bytes) : 0.0f,
+        .cpu_bound = false
+    });
+    for (size_t i : order)
+        files.push_back(intern(names[i]));
+    remaining++;
+}
+
+// Group the jobs by device and split the jobs of each device into regions.
+// With INODE or EXTENT, the jobs are sorted by location and each device gets as many
+// contiguous regions as workers may read from it at once, so that the files that a worker
+// reads one after the other are next to each other. With COST, the jobs that cost more per
+// byte than the median are CPU bound and the rest are I/O bound, and each device gets a
+// region of each, sorted by cost with the largest first. Otherwise, the workers share a
+// single region per device
+void PendingJobs::schedule(size_t nb_workers, ReadOrder order)
+{
+    this->order = order;
+    if (order == ReadOrder::COST && !jobs.empty()) {
+        std::vector<float> costs;
+        for (const Job &job : jobs)
+            costs.push_back(job.cost_per_byte);
+        std::nth_element(costs.begin(), costs.begin() + costs.size() / 2, costs.end());
+        float median = costs[costs.size() / 2];
+        for (Job &job : jobs)
+            job.cpu_bound = job.cost_per_byte > median;
+    }
+    std::stable_sort(jobs.begin(), jobs.end(), [&](const Job &a, const Job &b) {
+        if (a.device != b.device)
+            return a.device < b.device;
+        if (order == ReadOrder::COST)
+            return a.cpu_bound != b.cpu_bound ? a.cpu_bound : a.cost > b.cost;
+        return order != ReadOrder::DIRECTORY && a.location < b.location;
+    });
+
+    regions.clear();
+    assignments.assign(nb_workers, SIZE_MAX);
+    for (size_t begin = 0, end; begin < jobs.size(); begin = end) {
+        const Job &first = jobs[begin];
+        for (end = begin; end < jobs.size() && jobs[end].device == first.device && (order != ReadOrder::COST || jobs[end].cpu_bound == first.cpu_bound); end++);
+        const Device &device = devices[first.device];
+        size_t n = order == ReadOrder::INODE || order == ReadOrder::EXTENT ? std::min(device.limit ? (size_t) device.limit : nb_workers, nb_workers) : 1;
+        for (size_t i = 0; i < n; i++)
+            regions.push_back({first.device, begin + (end - begin) * i / n, begin + (end - begin) * (i + 1) / n, first.cpu_bound});
+    }
+}
+
+bool PendingJobs::available(const Region &region) const
+{
+    const Device &device = devices[region.device];
+    return region.begin < region.end && (!device.limit || device.running < device.limit);
+}
+
+std::filesystem::path PendingJobs::directory_path(uint32_t directory) const
+{
+    if (directories[directory].parent == NO_PARENT)
+        return get(directories[directory].name);
+    return directory_path(directories[directory].parent) / get(directories[directory].name);
+}
+
+// Take the next job for a worker, from the region that it read from last if it can. Otherwise
+// the worker moves to the device with the fewest jobs running. With COST, it takes the
+// largest job of the kind, CPU or I/O bound, that fewer workers are running. Otherwise it
+// moves to a region of the device that no other worker reads from, or takes over the second
+// half of its largest region. Returns false if every device with jobs left is at its limit.
+// Must be called after schedule()
+bool PendingJobs::pop(size_t worker, std::filesystem::path &directory, std::vector<std::filesystem::path> &paths, uint32_t &id)
+{
+    size_t &assignment = assignments[worker];
+    if (order == ReadOrder::COST || assignment == SIZE_MAX || !available(regions[assignment])) {
+        uint32_t best = UINT32_MAX;
+        for (const Region &region : regions) {
+            if (available(region) && (best == UINT32_MAX || devices[region.device].running < devices[best].running))
+                best = region.device;
+        }
+        if (best == UINT32_MAX)
+            return false;
+
+        size_t largest = SIZE_MAX;
+        size_t unassigned = SIZE_MAX;
+        size_t cpu_bound = SIZE_MAX;
+        size_t io_bound = SIZE_MAX;
+        auto length = [&](size_t i) { return regions[i].end - regions[i].begin; };
+        for (size_t i = 0; i < regions.size(); i++) {
+            if (regions[i].device != best || !length(i))
+                continue;
+            if (largest == SIZE_MAX || length(i) > length(largest))
+                largest = i;
+            if (std::find(assignments.begin(), assignments.end(), i) == assignments.end() && (unassigned == SIZE_MAX || length(i) > length(unassigned)))
+                unassigned = i;
+            (regions[i].cpu_bound ? cpu_bound : io_bound) = i;
+        }
+        if (order == ReadOrder::COST) {
+            if (cpu_bound == SIZE_MAX || io_bound == SIZE_MAX)
+                assignment = cpu_bound == SIZE_MAX ? io_bound : cpu_bound;
+            else if (running_cpu_bound != running_io_bound)
+                assignment = running_cpu_bound < running_io_bound ? cpu_bound : io_bound;
+            else
+                assignment = jobs[regions[cpu_bound].begin].cost >= jobs[regions[io_bound].begin].cost ? cpu_bound : io_bound;
+        }
+        else if (unassigned != SIZE_MAX || order == ReadOrder::DIRECTORY)
+            assignment = unassigned != SIZE_MAX ? unassigned : largest;
+        else {
+            Region half = {best, regions[largest].begin + length(largest) / 2, regions[largest].end, false};
+            regions[largest].end = half.begin;
+            if (assignment != SIZE_MAX && !length(assignment))
+                regions[assignment] = half;
+            else {
+                regions.push_back(half);
+                assignment = regions.size() - 1;
+            }
+        }
+    }
+
+    id = static_cast<uint32_t>(regions[assignment].begin++);
+    const Job &job = jobs[id];
+    remaining--;
+    devices[job.device].running++;
+    (job.cpu_bound ? running_cpu_bound : running_io_bound)++;
+    directory = directory_path(job.directory);
+    paths.clear();
+    for (uint32_t i = job.first_file; i < job.first_file + job.nb_files; i++)
+        paths.push_back(directory / get(files[i]));
+    return true;
+}
+
+void PendingJobs::finish(uint32_t id)
 {
-    std::queue<std::unique_ptr<ScanJob>> jobs;
+    devices[jobs[id].device].running--;
+    (jobs[id].cpu_bound ? running_cpu_bound : running_io_bound)--;
+}
+
+void scan_easy(const std::filesystem::path &path, const std::filesystem::path &preset, size_t nb_threads, size_t memory_limit, ReadOrder order, const DeviceLimits &device_limits, const std::optional<std::filesystem::path> &json, bool stats)
+{
+    PendingJobs pending;
     ScanData data;
 
     // Verify directory exists and is valid
@@ -738,32 +1222,145 @@ void scan_easy(const std::filesystem::path &path, const std::filesystem::path &p
     }
 
     // Load scan preset
-    if (!preset.empty())
-        load_preset(preset);
+    if (!preset.empty() && !load_preset(preset, configs))
+        quit(EXIT_FAILURE);
+
+    // Retag every type that the preset would tag
+    if (retag) {
+        for (Config &config : configs) {
+            if (config.tag_mode == 'i')
+                config.tag_mode = 'r';
+        }
+    }
 
     // Record start time
     const auto start_time = std::chrono::system_clock::now();
 
-    // Generate queue of all directories in directory tree
+    // Set up the scan log writer
+    std::unique_ptr<OutputWriter> writer;
+    const Config &default_config = get_config(FileType::DEFAULT);
+    if (default_config.tab_output == OutputType::CONSOLIDATED) {
+        writer.reset(OutputWriter::factory(path / "replaygain.csv"));
+        if (!writer)
+            quit(EXIT_FAILURE);
+        writer->write(ScanJob::tab_header(default_config));
+    }
+    else if (default_config.tab_output == OutputType::FILE)
+        writer = std::make_unique<OutputWriter>();
+    std::unique_ptr<OutputWriter> json_writer;
+    if (json) {
+        json_writer.reset(OutputWriter::factory(*json));
+        if (!json_writer)
+            quit(EXIT_FAILURE);
+    }
+
+    // List the files of every directory in the tree, depth first like
+    // recursive_directory_iterator, which doesn't follow directory symlinks either
     output_ok("Building directory tree...");
-    std::queue<std::filesystem::path> directories;
-    directories.emplace(path);
-    for (const std::filesystem::directory_entry &entry : std::filesystem::recursive_directory_iterator(path)) {
-        if (entry.is_directory())
-            directories.emplace(entry.path());
+    size_t nb_directories = 0;
+    std::vector<uint32_t> stack = {pending.add_directory(PendingJobs::NO_PARENT, path)};
+    std::vector<std::filesystem::path> files;
+    std::vector<std::filesystem::path> subdirectories;
+    std::vector<uint64_t> locations;
+    std::vector<std::string> devices;
+    uintmax_t bytes;
+    double cost;
+    while (!stack.empty()) {
+        uint32_t directory = stack.back();
+        stack.pop_back();
+        nb_directories++;
+
+        // Each device gets its limit from the first directory found on it
+        std::filesystem::path directory_path = pending.directory_path(directory);
+        bool added;
+        uint32_t device = pending.add_device(device_id(directory_path), added);
+        if (added) {
+            unsigned int limit = device_limits.get(directory_path);
+            pending.set_device_limit(device, limit);
+            if (limit) {
+                devices.push_back(rsgain::format("Scanning at most {} {} at once from the {} of '{}'",
+                    limit, limit > 1 ? "directories" : "directory", device_type_name(device_type(directory_path)), directory_path.string()));
+            }
+        }
+        files.clear();
+        subdirectories.clear();
+        locations.clear();
+        bytes = 0;
+        cost = 0.0;
+        std::set<FileType> types;
+        for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(directory_path)) {
+            if (entry.is_directory() && !entry.is_symlink())
+                subdirectories.push_back(entry.path().filename());
+            else if (entry.is_regular_file() && ScanJob::includes(entry.path(), configs)) {
+                files.push_back(entry.path().filename());
+                if (order == ReadOrder::INODE || order == ReadOrder::EXTENT)
+                    locations.push_back(disk_location(entry.path(), order));
+                FileType file_type = determine_filetype(entry.path().extension().string());
+                if (order == ReadOrder::COST) {
+                    std::error_code ec;
+                    uintmax_t size = entry.file_size(ec);
+                    if (!ec) {
+                        bytes += size;
+                        cost += estimate_scan_cost(file_type, size, configs[static_cast<size_t>(file_type == FileType::INVALID ? FileType::DEFAULT : file_type)]);
+                    }
+                }
+                types.insert(file_type);
+            }
+        }
+        for (auto it = subdirectories.rbegin(); it != subdirectories.rend(); ++it)
+            stack.push_back(pending.add_directory(directory, *it));
+
+        // Leave out directories whose files the preset doesn't scan. A directory with CUE
+        // sheets is decided when its job is built
+        bool sheets = types.erase(FileType::INVALID);
+        FileType type = types.size() == 1 ? *types.begin() : FileType::DEFAULT;
+        if (!files.empty() && (sheets || configs[static_cast<size_t>(type)].tag_mode != 'n'))
+            pending.add_job(directory, device, files, locations, cost, bytes);
     }
-    size_t nb_directories = directories.size();
     output_ok("Found {:L} {}...", nb_directories, nb_directories > 1 ? "directories" : "directory");
-    output_ok("Scanning {} for files...", nb_directories > 1 ? "directories" : "directory");
-    ScanJob *job;
-    while(!directories.empty()) {
-        if ((job = ScanJob::factory(directories.front())))
-            jobs.emplace(job);
-        directories.pop();
-    }
-    size_t nb_jobs = jobs.size();
+
+    // Without a memory limit, leave a quarter of the cgroup limit for everything else
+    const ResourceLimits &limits = get_resource_limits();
+    if (!limits.describe().empty())
+        output_ok("Detected resource limits: {}", limits.describe());
+    if (!memory_limit && limits.memory) {
+        memory_limit = limits.memory / 4 * 3;
+        output_ok("Limiting memory use to {}", format_memory(memory_limit));
+    }
+
+    // Jobs are built from the listing only when they are about to be scanned. A job that
+    // doesn't fit in the memory limit by itself is measured with constant memory
+    auto next_job = [&](size_t worker, size_t &memory, uint32_t &id) -> std::unique_ptr<ScanJob> {
+        std::filesystem::path directory;
+        while (pending.pop(worker, directory, files, id)) {
+            std::unique_ptr<ScanJob> job(ScanJob::factory(directory, files, configs));
+            if (!job) {
+                pending.finish(id);
+                continue;
+            }
+            job->writer = writer.get();
+            job->json_writer = json_writer.get();
+            if (!multithread) {
+                job->interactive = !quiet;
+                job->on_error = [](const std::filesystem::path&, const std::string &message) { output_error("{}", message); };
+            }
+            memory = 0;
+            if (memory_limit) {
+                memory = job->estimate_memory();
+                if (memory > memory_limit) {
+                    job->use_histograms();
+                    memory = job->estimate_memory();
+                }
+            }
+            return job;
+        }
+        id = PendingJobs::NO_JOB;
+        return nullptr;
+    };
+    size_t nb_jobs = pending.size();
     if (nb_threads > nb_jobs)
         nb_threads = nb_jobs;
+    pending.schedule(std::max(nb_threads, (size_t) 1), order);
 
     // Mulithreaded scanning
     if (nb_threads > 1) {
@@ -773,36 +1370,67 @@ void scan_easy(const std::filesystem::path &path, const std::filesystem::path &p
         std::mutex mutex;
         std::condition_variable cv;
         std::unique_lock lock(mutex);
+        for (const std::string &device : devices)
+            output_ok("{}", device);
+
+        // The next job of each worker, which is taken from the pending jobs once the worker
+        // is idle, and the ID of that job or of the one that the worker is running
+        std::vector<std::unique_ptr<ScanJob>> jobs(nb_threads);
+        std::vector<size_t> job_memory(nb_threads, 0);
+        std::vector<uint32_t> job_ids(nb_threads, PendingJobs::NO_JOB);
+        auto ready = [&](size_t i) {
+            if (i < threads.size() && threads[i]->busy())
+                return false;
+            if (!jobs[i]) {
+                if (job_ids[i] != PendingJobs::NO_JOB)
+                    pending.finish(job_ids[i]);
+                jobs[i] = next_job(i, job_memory[i], job_ids[i]);
+            }
+            return jobs[i] != nullptr;
+        };
+
+        // With a memory limit, a job is only admitted while the estimates of the running
+        // jobs leave room for it. A job that doesn't fit runs once nothing else does
+        auto admit = [&](size_t i) {
+            size_t in_use = 0;
+            for (const auto &thread : threads)
+                in_use += thread->memory_in_use();
+            return !memory_limit || !in_use || in_use + job_memory[i] <= memory_limit;
+        };
 
         // Spawn worker threads
         output_ok("Scanning with {} threads...", nb_threads);
-        for (size_t i = 0; i < nb_threads; i++) {
-            progress.update(jobs.front()->path.string());
+        while (threads.size() < nb_threads && ready(threads.size()) && admit(threads.size())) {
+            size_t i = threads.size();
+            progress.update(jobs[i]->path.string());
             threads.emplace_back(std::make_unique<WorkerThread>(
-                jobs.front(),
+                jobs[i],
+                job_memory[i],
                 mutex,
                 ffmpeg_mutex,
                 cv,
                 data
             ));
             cv.wait_for(lock, std::chrono::milliseconds(200));
-            jobs.pop();
         }
 
-        // Feed jobs to workers
-        std::string current_job;
-        if (!jobs.empty())
-            current_job = jobs.front()->path.string();
-        while (!jobs.empty()) {
-            cv.wait_for(lock, std::chrono::milliseconds(200));
-            for (auto &thread : threads) {
-                if (thread->place_job(jobs.front())) {
-                    jobs.pop();
-                    progress.update(current_job);
-                    if (!jobs.empty())
-                        current_job = jobs.front()->path.string();
-                    break;
-                }
+        // Feed jobs to workers, spawning the rest of the threads once there is memory for
+        // them and a device that they may read from
+        auto all_placed = [&]() { return std::none_of(jobs.begin(), jobs.end(), [](const auto &job) { return job != nullptr; }); };
+        while (!pending.empty() || !all_placed()) {
+            {
+                TraceScope trace("dispatch_wait");
+                cv.wait_for(lock, std::chrono::milliseconds(200));
+            }
+            for (size_t i = 0; i < nb_threads && i <= threads.size(); i++) {
+                if (!ready(i) || !admit(i))
+                    continue;
+                std::string current_job = jobs[i]->path.string();
+                if (i == threads.size())
+                    threads.emplace_back(std::make_unique<WorkerThread>(jobs[i], job_memory[i], mutex, ffmpeg_mutex, cv, data));
+                else if (!threads[i]->place_job(jobs[i], job_memory[i]))
+                    continue;
+                progress.update(current_job);
             }
         }
         cv.wait_for(lock, std::chrono::milliseconds(200));
@@ -815,18 +1443,32 @@ void scan_easy(const std::filesystem::path &path, const std::filesystem::path &p
                 break;
             cv.wait_for(lock, std::chrono::milliseconds(200));
         }
-        rsgain::print("\33[2K\n");
+        if (!quiet)
+            rsgain::print("\33[2K\n");
     }
 
     // Single threaded scanning
     else {
-        while (!jobs.empty()) {
-            auto &job = jobs.front();
+        size_t memory;
+        uint32_t id;
+        while (std::unique_ptr<ScanJob> job = next_job(0, memory, id)) {
             job->scan();
             job->update_data(data);
-            jobs.pop();
+            pending.finish(id);
         }
-        rsgain::print("\n");
+        if (!quiet)
+            rsgain::print("\n");
+    }
+
+    // Flush the scan logs
+    writer.reset();
+    json_writer.reset();
+
+    // JSON Lines on stdout must not be mixed with the report
+    if (json && json->empty()) {
+        for (const std::string &s : data.error_directories)
+            output_error("There were errors while scanning directory '{}'", s);
+        return;
     }
 
     // Output statistics at the end
@@ -855,6 +1497,9 @@ void scan_easy(const std::filesystem::path &path, const std::filesystem::path &p
     HELP_STATS("Positive Gains", "{:L} ({:.1f}% of files)", data.total_positive, 100.f * (float) data.total_positive / (float) data.files);
     rsgain::print("\n");
 
+    if (stats)
+        print_performance(data, std::chrono::duration<double>(std::chrono::system_clock::now() - start_time).count());
+
     // Inform user of errors
     if (!data.error_directories.empty()) {
         rsgain::print(COLOR_RED "There were errors while scanning the following directories:" COLOR_OFF "\n");
@@ -864,6 +1509,63 @@ void scan_easy(const std::filesystem::path &path, const std::filesystem::path &p
     }
 }
 
+// Print where the time went, summed over all threads, and the throughput per file type
+static void print_performance(const ScanData &data, double elapsed)
+{
+    static const char *type_names[] = {
+        "Mixed", "MP2", "MP3", "FLAC", "Ogg", "Opus", "M4A", "WMA",
+        "WAV", "AIFF", "Wavpack", "APE", "TAK", "Musepack"
+    };
+    static_assert(std::size(type_names) == static_cast<size_t>(FileType::MAX_VAL));
+
+    Timings total;
+    size_t files = 0;
+    double duration = 0.0;
+    int64_t bytes = 0;
+    for (const FileStats &fs : data.file_stats) {
+        total += fs.timings;
+        files += fs.files;
+        duration += fs.duration;
+        bytes += fs.bytes;
+    }
+    double busy = total.scan + total.tag_exists + total.tag + total.mtime + data.main_lock_wait;
+    if (busy <= 0.0 || elapsed <= 0.0)
+        return;
+
+    rsgain::print(COLOR_GREEN "Performance" COLOR_OFF "\n");
+    HELP_STATS("Throughput", "{:.1f} files/s, {:.1f} audio s/s, {:.2f} MB/s",
+        (double) files / elapsed,
+        duration / elapsed,
+        (double) bytes / 1e6 / elapsed
+    );
+    HELP_STAGE("Open/Probe", total.open, busy);
+    HELP_STAGE("Decode", total.decode, busy);
+    HELP_STAGE("Conversion", total.convert, busy);
+    HELP_STAGE("Analysis", total.analyze, busy);
+    HELP_STAGE("Tag Check", total.tag_exists, busy);
+    HELP_STAGE("Tag Write", total.tag, busy);
+    HELP_STAGE("Mtime Restore", total.mtime, busy);
+    HELP_STAGE("FFmpeg Lock Wait", total.lock_wait, busy);
+    HELP_STAGE("Main Lock Wait", data.main_lock_wait, busy);
+    rsgain::print("\n");
+
+    // Per-type throughput is relative to the thread time spent on that type
+    rsgain::print(COLOR_YELLOW "{:<10} {:>8} {:>10} {:>12} {:>10}" COLOR_OFF "\n", "Type", "Files", "Files/s", "Audio s/s", "MB/s");
+    for (const FileStats &fs : data.file_stats) {
+        double time = fs.timings.scan + fs.timings.tag_exists + fs.timings.tag + fs.timings.mtime;
+        if (!fs.files || time <= 0.0)
+            continue;
+        rsgain::print("{:<10} {:>8L} {:>10.1f} {:>12.1f} {:>10.2f}\n",
+            type_names[&fs - &data.file_stats[0]],
+            fs.files,
+            (double) fs.files / time,
+            fs.duration / time,
+            (double) fs.bytes / 1e6 / time
+        );
+    }
+    rsgain::print("\n");
+}
+
 static inline void help_easy() {
     rsgain::print(COLOR_RED "Usage: " COLOR_OFF "{}{}{} easy [OPTIONS] DIRECTORY\n", COLOR_GREEN, EXECUTABLE_TITLE, COLOR_OFF);
 
@@ -879,7 +1581,13 @@ static inline void help_easy() {
     rsgain::print("\n");
 
     CMD_HELP("--skip-existing", "-S", "Don't scan files with existing ReplayGain information");
+    CMD_HELP("--retag", "-r", "Rewrite tags from the stored loudness without rescanning");
     CMD_HELP("--multithread=n", "-m n", "Scan files with n parallel threads");
+    CMD_HELP("--memory-limit=n", "-b n", "Only scan as many directories at once as fit in n bytes (K, M, G suffixes)");
+    CMD_HELP("--read-order=s", "-R s", "Scan in cost (largest first), directory, inode or extent (physical) order");
+    CMD_HELP("--device-limit=s", "-D s", "Directories scanned at once per device, e.g. hdd=1,network=2,/mnt/ssd=8");
+    CMD_HELP("--stats", "-s", "Print a performance report at the end of the scan");
+    CMD_HELP("--trace=f", "-T f", "Write a Chrome trace of the worker timelines to file f");
     CMD_HELP("--preset=s", "-p s", "Load scan preset s");
 
     rsgain::print("\n");
@@ -887,6 +1595,9 @@ static inline void help_easy() {
     CMD_HELP("--output", "-O",  "Output tab-delimited scan data to CSV file per directory");
     CMD_HELP("--output=s", "-O s",  "Output with sep header (needed for Microsoft Excel compatibility)");
     CMD_HELP("--output=a", "-O a",  "Output with files sorted in alphanumeric order");
+    CMD_HELP("--output=c", "-O c",  "Output to a single consolidated CSV file in DIRECTORY");
+    CMD_HELP("--json", "-j",  "Output JSON Lines scan data to stdout as each album completes");
+    CMD_HELP("--json=f", "-jf",  "Output JSON Lines scan data to file f");
 
     rsgain::print("\n");
 
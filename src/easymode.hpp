@@ -1,9 +1,12 @@
 #pragma once
 
 #include <string>
+#include <stdint.h>
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <optional>
 #include <filesystem>
 #include <condition_variable>
 #include "scan.hpp"
@@ -11,17 +14,21 @@
 class WorkerThread {
 
     public:
-        WorkerThread(std::unique_ptr<ScanJob> &initial_job, std::mutex &main_mutex, std::mutex &ffmpeg_mutex, std::condition_variable &main_cv, ScanData &data)
-        : job(std::move(initial_job)), main_mutex(main_mutex), ffmpeg_mutex(ffmpeg_mutex), main_cv(main_cv), data(data) 
+        WorkerThread(std::unique_ptr<ScanJob> &initial_job, size_t memory, std::mutex &main_mutex, std::mutex &ffmpeg_mutex, std::condition_variable &main_cv, ScanData &data)
+        : job(std::move(initial_job)), memory(memory), main_mutex(main_mutex), ffmpeg_mutex(ffmpeg_mutex), main_cv(main_cv), data(data) 
         {
             thread = std::make_unique<std::thread>(&WorkerThread::work, this);
         }
         void work();
-        bool place_job(std::unique_ptr<ScanJob> &job);
+        bool place_job(std::unique_ptr<ScanJob> &job, size_t memory);
         bool wait();
+        size_t memory_in_use() const { return memory; } // Estimate for the current job, 0 when idle
+        bool busy() const { return running; }
         
     private:
         std::unique_ptr<ScanJob> job;
+        std::atomic<size_t> memory;
+        std::atomic<bool> running = true;
         std::mutex &main_mutex;
         std::mutex &ffmpeg_mutex;
         std::condition_variable &main_cv;
@@ -33,6 +40,94 @@ class WorkerThread {
         std::condition_variable cv;
 };
 
+// The order in which Easy Mode reads files and directories
+enum class ReadOrder {
+    DIRECTORY, // As listed by the filesystem
+    INODE,     // By inode number, which most filesystems allocate close to the data
+    EXTENT,    // By the physical location of the first extent (Linux FIEMAP)
+    COST       // Largest estimated cost first, alternating CPU and I/O bound jobs
+};
+
+// How many directories Easy Mode scans at once from each device, 0 for no limit
+struct DeviceLimits {
+    unsigned int ssd = 0;
+    unsigned int hdd = 2;
+    unsigned int network = 4;
+    unsigned int unknown = 0;
+    std::vector<std::pair<uint64_t, unsigned int>> devices; // Set for the device of a path
+
+    unsigned int get(const std::filesystem::path &path) const;
+};
+
+// The directories of a library that are still to be scanned and the files in them. Each
+// directory is stored as its parent and its name, and each file as its name, all as
+// slices of one arena, so that a whole library can be listed without building a
+// ScanJob per directory. Jobs are built just before they are scanned
+class PendingJobs {
+
+    public:
+        static constexpr uint32_t NO_PARENT = UINT32_MAX;
+        static constexpr uint32_t NO_JOB = UINT32_MAX;
+        uint32_t add_directory(uint32_t parent, const std::filesystem::path &name);
+        uint32_t add_device(uint64_t id, bool &added);
+        void set_device_limit(uint32_t device, unsigned int limit) { devices[device].limit = limit; }
+        void add_job(uint32_t directory, uint32_t device, const std::vector<std::filesystem::path> &names, const std::vector<uint64_t> &locations, double cost, uintmax_t bytes);
+        void schedule(size_t nb_workers, ReadOrder order);
+        std::filesystem::path directory_path(uint32_t directory) const;
+        bool pop(size_t worker, std::filesystem::path &directory, std::vector<std::filesystem::path> &files, uint32_t &job);
+        void finish(uint32_t job);
+        size_t size() const { return remaining; }
+        bool empty() const { return !remaining; }
+
+    private:
+        struct Name {
+            uint32_t offset;
+            uint32_t length;
+        };
+        struct Directory {
+            uint32_t parent;
+            Name name;
+        };
+        struct Job {
+            uint32_t directory;
+            uint32_t device;
+            uint32_t first_file;
+            uint32_t nb_files;
+            uint64_t location; // Of the first file, with ReadOrder::INODE or EXTENT
+            float cost;        // Estimated core seconds
+            float cost_per_byte;
+            bool cpu_bound;    // Costs more per byte than the median job
+        };
+        struct Device {
+            uint64_t id;
+            unsigned int limit = 0;   // Jobs at once, 0 for no limit
+            unsigned int running = 0; // Jobs popped and not finished
+        };
+        struct Region {
+            uint32_t device;
+            size_t begin;
+            size_t end;
+            bool cpu_bound; // With ReadOrder::COST, each device has a CPU and an I/O bound region
+        };
+        std::string arena; // UTF-8
+        std::vector<Directory> directories;
+        std::vector<Name> files;
+        std::vector<Job> jobs;
+        std::vector<Device> devices;
+        std::vector<Region> regions;     // Contiguous ranges of the jobs of a device
+        std::vector<size_t> assignments; // The region that each worker reads from
+        ReadOrder order = ReadOrder::DIRECTORY;
+        unsigned int running_cpu_bound = 0;
+        unsigned int running_io_bound = 0;
+        size_t remaining = 0;
+
+        Name intern(const std::filesystem::path &name);
+        std::filesystem::path get(Name name) const;
+        bool available(const Region &region) const;
+};
+
 void easy_mode(int argc, char *argv[]);
-void scan_easy(const std::filesystem::path &path, const std::filesystem::path &preset, size_t nb_threads);
+void scan_easy(const std::filesystem::path &path, const std::filesystem::path &preset, size_t nb_threads, size_t memory_limit, ReadOrder order, const DeviceLimits &device_limits, const std::optional<std::filesystem::path> &json, bool stats);
 const Config& get_config(FileType type);
+const ConfigTable& get_default_configs();
+bool load_preset(const std::filesystem::path &preset, ConfigTable &configs);
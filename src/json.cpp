@@ -0,0 +1,199 @@
+#include <string>
+#include <string_view>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "json.hpp"
+#include "output.hpp"
+
+#define MAX_JSON_DEPTH 32
+
+class JsonParser {
+    private:
+        std::string_view text;
+        size_t pos = 0;
+
+        void skip_whitespace()
+        {
+            while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r' || text[pos] == '\n'))
+                pos++;
+        }
+
+        bool consume(std::string_view literal)
+        {
+            if (text.substr(pos, literal.size()) != literal)
+                return false;
+            pos += literal.size();
+            return true;
+        }
+
+        bool parse_hex(uint32_t &code)
+        {
+            if (pos + 4 > text.size())
+                return false;
+            code = 0;
+            for (size_t end = pos + 4; pos < end; pos++) {
+                char c = text[pos];
+                code <<= 4;
+                if (c >= '0' && c <= '9')
+                    code |= (uint32_t) (c - '0');
+                else if (c >= 'a' && c <= 'f')
+                    code |= (uint32_t) (c - 'a' + 10);
+                else if (c >= 'A' && c <= 'F')
+                    code |= (uint32_t) (c - 'A' + 10);
+                else
+                    return false;
+            }
+            return true;
+        }
+
+        static void append_utf8(std::string &out, uint32_t code)
+        {
+            if (code < 0x80)
+                out += (char) code;
+            else if (code < 0x800) {
+                out += (char) (0xC0 | (code >> 6));
+                out += (char) (0x80 | (code & 0x3F));
+            }
+            else if (code < 0x10000) {
+                out += (char) (0xE0 | (code >> 12));
+                out += (char) (0x80 | ((code >> 6) & 0x3F));
+                out += (char) (0x80 | (code & 0x3F));
+            }
+            else {
+                out += (char) (0xF0 | (code >> 18));
+                out += (char) (0x80 | ((code >> 12) & 0x3F));
+                out += (char) (0x80 | ((code >> 6) & 0x3F));
+                out += (char) (0x80 | (code & 0x3F));
+            }
+        }
+
+        bool parse_string(std::string &out)
+        {
+            if (!consume("\""))
+                return false;
+            while (pos < text.size()) {
+                char c = text[pos++];
+                if (c == '"')
+                    return true;
+                if ((unsigned char) c < 0x20)
+                    return false;
+                if (c != '\\') {
+                    out += c;
+                    continue;
+                }
+                if (pos >= text.size())
+                    return false;
+                switch (text[pos++]) {
+                    case '"':  out += '"';  break;
+                    case '\\': out += '\\'; break;
+                    case '/':  out += '/';  break;
+                    case 'b':  out += '\b'; break;
+                    case 'f':  out += '\f'; break;
+                    case 'n':  out += '\n'; break;
+                    case 'r':  out += '\r'; break;
+                    case 't':  out += '\t'; break;
+                    case 'u': {
+                        uint32_t code, low;
+                        if (!parse_hex(code))
+                            return false;
+                        if (code >= 0xD800 && code < 0xDC00) {
+                            if (!consume("\\u") || !parse_hex(low) || low < 0xDC00 || low >= 0xE000)
+                                return false;
+                            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        }
+                        append_utf8(out, code);
+                        break;
+                    }
+                    default:
+                        return false;
+                }
+            }
+            return false;
+        }
+
+        bool parse_value(JsonValue &value, int depth)
+        {
+            if (depth > MAX_JSON_DEPTH)
+                return false;
+            skip_whitespace();
+            if (pos >= text.size())
+                return false;
+            switch (text[pos]) {
+                case '{':
+                    pos++;
+                    value.type = JsonValue::Type::OBJECT;
+                    skip_whitespace();
+                    if (consume("}"))
+                        return true;
+                    do {
+                        std::pair<std::string, JsonValue> member;
+                        skip_whitespace();
+                        if (!parse_string(member.first))
+                            return false;
+                        skip_whitespace();
+                        if (!consume(":") || !parse_value(member.second, depth + 1))
+                            return false;
+                        value.object.push_back(std::move(member));
+                        skip_whitespace();
+                    } while (consume(","));
+                    return consume("}");
+
+                case '[':
+                    pos++;
+                    value.type = JsonValue::Type::ARRAY;
+                    skip_whitespace();
+                    if (consume("]"))
+                        return true;
+                    do {
+                        if (!parse_value(value.array.emplace_back(), depth + 1))
+                            return false;
+                        skip_whitespace();
+                    } while (consume(","));
+                    return consume("]");
+
+                case '"':
+                    value.type = JsonValue::Type::STRING;
+                    return parse_string(value.string);
+
+                case 't':
+                    value.type = JsonValue::Type::BOOL;
+                    value.boolean = true;
+                    return consume("true");
+
+                case 'f':
+                    value.type = JsonValue::Type::BOOL;
+                    return consume("false");
+
+                case 'n':
+                    return consume("null");
+
+                default: {
+                    // JSON has no infinities, and the decimal point doesn't depend on the locale
+                    std::string_view number = text.substr(pos, text.find_first_of(",]} \t\r\n", pos) - pos);
+                    value.type = JsonValue::Type::NUMBER;
+                    if (number.empty() || number.find("inf") != std::string_view::npos
+                    || parse_number(number, value.number) != number.size())
+                        return false;
+                    pos += number.size();
+                    return true;
+                }
+            }
+        }
+
+    public:
+        JsonParser(std::string_view text) : text(text) {}
+
+        bool parse(JsonValue &value)
+        {
+            if (!parse_value(value, 0))
+                return false;
+            skip_whitespace();
+            return pos == text.size();
+        }
+};
+
+bool parse_json(std::string_view text, JsonValue &value)
+{
+    return JsonParser(text).parse(value);
+}
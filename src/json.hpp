@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <string_view>
+
+// Just enough JSON to read requests and manifests
+struct JsonValue {
+    enum class Type {
+        NUL,
+        BOOL,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT
+    };
+    Type type = Type::NUL;
+    bool boolean = false;
+    double number = 0.0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object;
+
+    const JsonValue* get(std::string_view key, Type t) const
+    {
+        for (const auto &[k, v] : object) {
+            if (k == key)
+                return v.type == t ? &v : nullptr;
+        }
+        return nullptr;
+    }
+};
+
+bool parse_json(std::string_view text, JsonValue &value);
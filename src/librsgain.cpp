@@ -0,0 +1,207 @@
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <filesystem>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "librsgain.hpp"
+#include "scan.hpp"
+#include "output.hpp"
+
+namespace rsgain {
+
+Config default_config()
+{
+    return {
+        .tag_mode = 's',
+        .skip_existing = false,
+        .target_loudness = RG_TARGET_LOUDNESS,
+        .max_peak_level = 0.0,
+        .true_peak = false,
+        .clip_mode = 'n',
+        .do_album = false,
+        .tab_output = OutputType::NONE,
+        .sep_header = false,
+        .sort_alphanum = false,
+        .lowercase = false,
+        .id3v2version = ID3V2_KEEP,
+        .opus_mode = 'd',
+        .skip_mp4 = false,
+        .preserve_mtimes = false,
+        .dual_mono = false,
+        .loudness_range = false,
+        .store_loudness = false,
+        .chapters = false,
+        .all_streams = false,
+        .channel_threads = 0,
+        .profiles = {}
+    };
+}
+
+bool Scanner::run(ScanJob *job, const std::string &error, const ScanCallbacks &callbacks)
+{
+    std::unique_ptr<ScanJob> ptr(job);
+    bool ret = false;
+    if (job) {
+        job->on_error = callbacks.error;
+        ret = job->scan(&ffmpeg_mutex) && !job->error;
+        if (callbacks.track) {
+            for (const ScanJob::Track &track : job->get_tracks()) {
+                callbacks.track({
+                    .path = track.path,
+                    .type = track.type,
+                    .container = track.container,
+                    .codec = avcodec_get_name(static_cast<AVCodecID>(track.codec_id)),
+                    .duration = track.duration,
+                    .result = track.result,
+                    .track_clip = track.tclip,
+                    .album_clip = track.aclip,
+                    .album = job->config.do_album,
+                    .cue_track = track.cue_number
+                });
+            }
+        }
+    }
+    else if (callbacks.error)
+        callbacks.error({}, error);
+    if (callbacks.done)
+        callbacks.done(ret);
+    return ret;
+}
+
+bool Scanner::scan_files(const std::vector<std::filesystem::path> &files, const Config &config, const ScanCallbacks &callbacks)
+{
+    std::string error;
+    return run(ScanJob::factory(files, config, error), error, callbacks);
+}
+
+bool Scanner::scan_files(const std::vector<std::filesystem::path> &files, const ConfigTable &configs, const ScanCallbacks &callbacks)
+{
+    FileType type = FileType::INVALID;
+    for (const std::filesystem::path &file : files) {
+        FileType t = determine_filetype(file.extension().string());
+        type = type == FileType::INVALID || type == t ? t : FileType::DEFAULT;
+    }
+    const Config &config = configs[static_cast<size_t>(type == FileType::INVALID ? FileType::DEFAULT : type)];
+
+    // Like Easy Mode, a tag mode of 'n' skips the files
+    if (config.tag_mode == 'n') {
+        if (callbacks.done)
+            callbacks.done(true);
+        return true;
+    }
+    return scan_files(files, config, callbacks);
+}
+
+bool Scanner::scan_directory(const std::filesystem::path &directory, const ConfigTable &configs, const ScanCallbacks &callbacks)
+{
+    std::string error;
+    ScanJob *job = nullptr;
+    try {
+        job = ScanJob::factory(directory, configs);
+        if (!job)
+            error = rsgain::format("No files to scan in '{}'", directory.string());
+    }
+    catch (const std::filesystem::filesystem_error &e) {
+        error = e.what();
+    }
+    return run(job, error, callbacks);
+}
+
+void Scanner::submit_files(std::vector<std::filesystem::path> files, const Config &config, ScanCallbacks callbacks)
+{
+    auto task = [this, files = std::move(files), config, callbacks = std::move(callbacks)]() {
+        scan_files(files, config, callbacks);
+    };
+    if (pool)
+        pool->submit(std::move(task));
+    else
+        task();
+}
+
+void Scanner::submit_files(std::vector<std::filesystem::path> files, const ConfigTable &configs, ScanCallbacks callbacks)
+{
+    auto task = [this, files = std::move(files), configs, callbacks = std::move(callbacks)]() {
+        scan_files(files, configs, callbacks);
+    };
+    if (pool)
+        pool->submit(std::move(task));
+    else
+        task();
+}
+
+void Scanner::submit_directory(std::filesystem::path directory, const ConfigTable &configs, ScanCallbacks callbacks)
+{
+    auto task = [this, directory = std::move(directory), configs, callbacks = std::move(callbacks)]() {
+        scan_directory(directory, configs, callbacks);
+    };
+    if (pool)
+        pool->submit(std::move(task));
+    else
+        task();
+}
+
+WorkerPool::WorkerPool(size_t nb_threads)
+{
+    for (size_t i = 0; i < nb_threads; i++)
+        threads.emplace_back(&WorkerPool::work, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard lock(mutex);
+        done = true;
+    }
+    cv.notify_all();
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+void WorkerPool::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    cv.notify_one();
+}
+
+void WorkerPool::get_status(size_t &queued, size_t &running)
+{
+    std::lock_guard lock(mutex);
+    queued = tasks.size();
+    running = active;
+}
+
+// Queued tasks are drained before the pool shuts down
+void WorkerPool::work()
+{
+    std::unique_lock lock(mutex);
+    while (true) {
+        cv.wait(lock, [this] { return done || !tasks.empty(); });
+        if (tasks.empty())
+            return;
+        std::function<void()> task = std::move(tasks.front());
+        tasks.pop_front();
+        active++;
+        lock.unlock();
+        task();
+        lock.lock();
+        active--;
+        if (tasks.empty() && !active)
+            idle_cv.notify_all();
+    }
+}
+
+void WorkerPool::wait()
+{
+    std::unique_lock lock(mutex);
+    idle_cv.wait(lock, [this] { return tasks.empty() && !active; });
+}
+
+}
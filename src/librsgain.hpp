@@ -0,0 +1,108 @@
+#pragma once
+
+/*
+ * librsgain: embeddable scanning API
+ *
+ * A Scanner has no process-wide state of its own. Errors are reported through
+ * callbacks and return values, nothing is printed and the process is never
+ * terminated. Several scanners may be used concurrently from different threads
+ *
+ * The library still holds two process-wide globals used by the rsgain tool:
+ * - quiet (output.hpp) silences status messages and MTProgress. Scanner jobs
+ *   never print, so it doesn't affect them
+ * - Trace (trace.hpp) records into a single buffer once Trace::start() has been
+ *   called, and then includes the events of every Scanner in the process
+ */
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+#include <filesystem>
+#include "scan.hpp"
+
+namespace rsgain {
+
+// A thread pool owned by the caller. Scanner only needs to be able to queue work on it
+class ThreadPool {
+    public:
+        virtual ~ThreadPool() = default;
+        virtual void submit(std::function<void()> task) = 0;
+};
+
+// A simple fixed-size ThreadPool for callers that don't bring their own
+class WorkerPool : public ThreadPool {
+    private:
+        std::vector<std::thread> threads;
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::condition_variable idle_cv;
+        size_t active = 0;
+        bool done = false;
+
+        void work();
+
+    public:
+        WorkerPool(size_t nb_threads);
+        ~WorkerPool();
+        void submit(std::function<void()> task) override;
+        void wait();
+        size_t size() const { return threads.size(); }
+        void get_status(size_t &queued, size_t &running);
+};
+
+struct TrackResult {
+    std::filesystem::path path;
+    FileType type;
+    std::string container;
+    std::string codec;
+    double duration;      // Seconds of decoded audio
+    ScanResult result;    // Album values are only valid if album is set
+    bool track_clip;      // Track gain was reduced to prevent clipping
+    bool album_clip;
+    bool album;           // Config::do_album was set
+    int cue_track;        // TRACK number if path is a CUE sheet image, 0 otherwise
+};
+
+struct ScanCallbacks {
+    std::function<void(const TrackResult&)> track;
+    std::function<void(const std::filesystem::path&, const std::string&)> error;
+    std::function<void(bool success)> done;
+};
+
+// Custom Mode defaults: scan only, no album gain, no clipping protection, -18 LUFS target
+Config default_config();
+
+class Scanner {
+    private:
+        ThreadPool *pool;
+        std::mutex ffmpeg_mutex;
+
+        bool run(ScanJob *job, const std::string &error, const ScanCallbacks &callbacks);
+
+    public:
+        // Without a pool, the submit functions run the scan on the calling thread
+        explicit Scanner(ThreadPool *pool = nullptr) : pool(pool) {}
+        Scanner(const Scanner&) = delete;
+        Scanner& operator=(const Scanner&) = delete;
+
+        // Scan the files as a single album and block until done. Files are tagged unless config.tag_mode is 's'
+        bool scan_files(const std::vector<std::filesystem::path> &files, const Config &config, const ScanCallbacks &callbacks);
+
+        // As above, using the config of the files' type, or the default config if the types are mixed
+        bool scan_files(const std::vector<std::filesystem::path> &files, const ConfigTable &configs, const ScanCallbacks &callbacks);
+
+        // Scan the supported files directly inside a directory, using the config of their file type
+        bool scan_directory(const std::filesystem::path &directory, const ConfigTable &configs, const ScanCallbacks &callbacks);
+
+        // Queue a scan on the thread pool. The scanner must outlive all submitted scans
+        void submit_files(std::vector<std::filesystem::path> files, const Config &config, ScanCallbacks callbacks);
+        void submit_files(std::vector<std::filesystem::path> files, const ConfigTable &configs, ScanCallbacks callbacks);
+        void submit_directory(std::filesystem::path directory, const ConfigTable &configs, ScanCallbacks callbacks);
+};
+
+}
@@ -0,0 +1,263 @@
+/*
+ * Monitor mode: measures a continuous stream and reports its loudness as it goes.
+ *
+ * The stream is decoded by the same Track::scan path as a normal scan, with
+ * libebur128 in histogram mode so the integrated loudness is computed in
+ * constant memory no matter how long the stream runs. Every interval, the
+ * momentary (400 ms), short-term (3 s) and running integrated loudness are
+ * reported along with the true peak of the interval and of the whole stream.
+ */
+
+#include <string>
+#include <memory>
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <getopt.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <ebur128.h>
+
+#include "rsgain.hpp"
+#include "monitor.hpp"
+#include "librsgain.hpp"
+#include "scan.hpp"
+#include "output.hpp"
+#include "config.h"
+
+#define DEFAULT_INTERVAL 1.0
+#define MIN_INTERVAL 0.1
+
+static volatile sig_atomic_t signalled = 0;
+
+// The first signal ends the stream gracefully. A blocking read on an idle pipe can't notice
+// it, so a second one terminates the process
+static void handle_signal(int sig)
+{
+    signalled = 1;
+    signal(sig, SIG_DFL);
+}
+
+static inline void help_monitor();
+
+static double to_db(double value)
+{
+    return value > 0.0 ? 20.0 * log10(value) : -HUGE_VAL;
+}
+
+static std::string format_value(double value)
+{
+    return std::isfinite(value) ? rsgain::format("{:6.1f}", value) : "    -∞";
+}
+
+class Monitor {
+    private:
+        bool json;
+        unsigned long interval;   // Samples between reports
+        unsigned long position = 0;
+        unsigned long next_report;
+        double interval_peak = 0.0;
+        double stream_peak = 0.0;
+
+        void report(ebur128_state *ebur128, const char *type);
+
+    public:
+        Monitor(bool json, double interval, unsigned long samplerate)
+        : json(json), interval((unsigned long) (interval * (double) samplerate)), next_report(this->interval) {}
+        bool update(ebur128_state *ebur128, size_t nb_frames);
+        void finish(ebur128_state *ebur128) { report(ebur128, "summary"); }
+};
+
+void Monitor::report(ebur128_state *ebur128, const char *type)
+{
+    double momentary, short_term, integrated;
+    if (ebur128_loudness_momentary(ebur128, &momentary) != EBUR128_SUCCESS)
+        momentary = -HUGE_VAL;
+    if (ebur128_loudness_shortterm(ebur128, &short_term) != EBUR128_SUCCESS)
+        short_term = -HUGE_VAL;
+    if (ebur128_loudness_global(ebur128, &integrated) != EBUR128_SUCCESS)
+        integrated = -HUGE_VAL;
+    double time = (double) position / (double) ebur128->samplerate;
+
+    if (json) {
+        rsgain::print("{{\"type\":\"{}\",\"time\":{},\"momentary\":{},\"short_term\":{},\"integrated\":{},\"true_peak\":{},\"max_true_peak\":{}}}\n",
+            type,
+            json_number(time),
+            json_number(momentary),
+            json_number(short_term),
+            json_number(integrated),
+            json_number(to_db(interval_peak)),
+            json_number(to_db(stream_peak))
+        );
+    }
+    else {
+        rsgain::print("{:10.1f} s   M: {}   S: {}   I: {} LUFS   TP: {} dBTP   Max TP: {} dBTP\n",
+            time,
+            format_value(momentary),
+            format_value(short_term),
+            format_value(integrated),
+            format_value(to_db(interval_peak)),
+            format_value(to_db(stream_peak))
+        );
+    }
+    fflush(stdout);
+    interval_peak = 0.0;
+}
+
+bool Monitor::update(ebur128_state *ebur128, size_t nb_frames)
+{
+    double peak;
+    for (unsigned int ch = 0; ch < ebur128->channels; ch++) {
+        if (ebur128_prev_true_peak(ebur128, ch, &peak) == EBUR128_SUCCESS && peak > interval_peak)
+            interval_peak = peak;
+    }
+    if (interval_peak > stream_peak)
+        stream_peak = interval_peak;
+
+    position += nb_frames;
+    if (position >= next_report) {
+        report(ebur128, "interval");
+        next_report += interval;
+    }
+    return !signalled;
+}
+
+// Parse Monitor Mode command line arguments
+void monitor_mode(int argc, char *argv[])
+{
+    int rc, i;
+    double interval = DEFAULT_INTERVAL;
+    bool json = false;
+    bool follow = false;
+    std::string input_format;
+    Config config = rsgain::default_config();
+    config.true_peak = true;
+    const char *short_opts = "+hi:jfF:d";
+    static struct option long_opts[] = {
+        { "help",         no_argument,       nullptr, 'h' },
+        { "interval",     required_argument, nullptr, 'i' },
+        { "json",         no_argument,       nullptr, 'j' },
+        { "follow",       no_argument,       nullptr, 'f' },
+        { "input-format", required_argument, nullptr, 'F' },
+        { "dual-mono",    no_argument,       nullptr, 'd' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((rc = getopt_long(argc, argv, short_opts, long_opts, &i)) != -1) {
+        switch (rc) {
+            case 'h':
+                help_monitor();
+                quit(EXIT_SUCCESS);
+                break;
+
+            case 'i': {
+                char *end;
+                interval = strtod(optarg, &end);
+                if (*end || !(interval >= MIN_INTERVAL)) {
+                    output_fail("Invalid interval '{}', must be at least " STR(MIN_INTERVAL) " seconds", optarg);
+                    quit(EXIT_FAILURE);
+                }
+                break;
+            }
+
+            case 'j':
+                json = true;
+                break;
+
+            case 'f':
+                follow = true;
+                break;
+
+            case 'F':
+                input_format = optarg;
+                break;
+
+            case 'd':
+                config.dual_mono = true;
+                break;
+
+            case '?':
+                if (optopt)
+                    output_fail("Unrecognized option '{:c}'", optopt);
+                else
+                    output_fail("Unrecognized option '{}'", argv[optind - 1] + 2);
+                quit(EXIT_FAILURE);
+        }
+    }
+    if (argc == optind) {
+        output_fail("No input specified");
+        quit(EXIT_FAILURE);
+    }
+
+    // A growing file is read through its own descriptor so EOF can wait for more data
+    std::string input = argv[optind];
+    int fd = parse_stream_name(input);
+    bool close_fd = false;
+    if (fd < 0 && follow) {
+        fd = open(input.c_str(), O_RDONLY
+#ifdef _WIN32
+            | O_BINARY
+#endif
+        );
+        if (fd < 0) {
+            output_fail("Could not open '{}'", input);
+            quit(EXIT_FAILURE);
+        }
+        close_fd = true;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    // Histogram mode keeps integrated loudness in constant memory
+    ScanJob::Track track(input, FileType::DEFAULT);
+    track.fd = fd;
+    track.format = input_format;
+    track.follow = follow ? &signalled : nullptr;
+    track.ebur128_mode = EBUR128_MODE_S | EBUR128_MODE_HISTOGRAM;
+    std::unique_ptr<Monitor> monitor;
+    track.on_frames = [&](ebur128_state *ebur128, size_t nb_frames) {
+        if (!monitor)
+            monitor = std::make_unique<Monitor>(json, interval, ebur128->samplerate);
+        return monitor->update(ebur128, nb_frames);
+    };
+    ScanReturn ret = track.scan(config, nullptr, false);
+    if (close_fd)
+        close(fd);
+    if (ret == ScanReturn::ERR) {
+        output_fail("{}", track.error);
+        quit(EXIT_FAILURE);
+    }
+    else if (ret == ScanReturn::NO_STREAM) {
+        output_fail("No audio stream found in '{}'", input);
+        quit(EXIT_FAILURE);
+    }
+    if (monitor)
+        monitor->finish(track.ebur128.get());
+}
+
+static inline void help_monitor() {
+    rsgain::print(COLOR_RED "Usage: " COLOR_OFF "{}{}{} monitor [OPTIONS] INPUT\n", COLOR_GREEN, EXECUTABLE_TITLE, COLOR_OFF);
+
+    rsgain::print("  Monitor Mode measures a continuous stream and prints its momentary, short-term\n");
+    rsgain::print("  and running integrated loudness and true peak at a fixed interval, in constant\n");
+    rsgain::print("  memory. INPUT is a file, - for stdin or pipe:N for file descriptor N.\n");
+    rsgain::print("  A summary is printed at the end of the stream or on SIGINT/SIGTERM.\n");
+    rsgain::print("\n");
+
+    rsgain::print(COLOR_RED "Options:\n" COLOR_OFF);
+    CMD_HELP("--help",     "-h", "Show this help");
+    CMD_HELP("--interval=n", "-i n", "Report every n seconds of audio (default: 1)");
+    CMD_HELP("--json",       "-j", "Output JSON Lines instead of text");
+    CMD_HELP("--follow",     "-f", "Keep reading INPUT as it grows, like tail -f");
+    CMD_HELP("--input-format=s", "-F s", "Container format of INPUT, e.g. flac");
+    CMD_HELP("--dual-mono",  "-d", "Treat mono input as dual-mono");
+    rsgain::print("\n");
+    rsgain::print("Please report any issues to " PROJECT_URL "/issues\n\n");
+}
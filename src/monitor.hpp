@@ -0,0 +1,3 @@
+#pragma once
+
+void monitor_mode(int argc, char *argv[]);
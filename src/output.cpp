@@ -38,6 +38,8 @@
 #include <cmath>
 #include <string>
 #include <string_view>
+#include <sstream>
+#include <locale>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -53,6 +55,9 @@
 
 #define MT_MESSAGE " Scanning directory: "
 
+// Console verbosity of the command line tool. Library code only prints when a job is interactive
+int quiet = 0;
+
 constexpr int str_literal_len(const char *str)
 {
 	return *str ? 1 + str_literal_len(str + 1) : 0;
@@ -170,3 +175,136 @@ int MTProgress::utf8_length(std::string_view string)
     }
     return length;
 }
+
+OutputWriter::OutputWriter(std::FILE *stream) : stream(stream)
+{
+	thread = std::thread(&OutputWriter::work, this);
+}
+
+OutputWriter::~OutputWriter()
+{
+	{
+		std::scoped_lock lock(mutex);
+		done = true;
+	}
+	cv.notify_all();
+	thread.join();
+	if (stream && stream != stdout)
+		fclose(stream);
+	else if (stream)
+		fflush(stream);
+}
+
+// Open a writer for a single output stream; an empty path means stdout
+OutputWriter* OutputWriter::factory(const std::filesystem::path &file)
+{
+	if (file.empty())
+		return new OutputWriter(stdout);
+	std::FILE *stream = fopen(file.string().c_str(), "wb");
+	if (!stream) {
+		output_fail("Could not open output file '{}'", file.string());
+		return nullptr;
+	}
+	return new OutputWriter(stream);
+}
+
+void OutputWriter::write(std::string &&data)
+{
+	write(std::filesystem::path(), std::move(data));
+}
+
+void OutputWriter::write(const std::filesystem::path &file, std::string &&data)
+{
+	{
+		std::scoped_lock lock(mutex);
+		blocks.push_back({file, std::move(data)});
+	}
+	cv.notify_one();
+}
+
+void OutputWriter::work()
+{
+	std::unique_lock lock(mutex);
+	while (true) {
+		cv.wait(lock, [this]{ return done || !blocks.empty(); });
+		if (blocks.empty())
+			return;
+		Block block = std::move(blocks.front());
+		blocks.pop_front();
+		lock.unlock();
+
+		// Blocks without a file go to the shared stream, others replace their own file
+		if (block.file.empty()) {
+			if (stream)
+				fwrite(block.data.data(), 1, block.data.size(), stream);
+		}
+		else {
+			std::FILE *file = fopen(block.file.string().c_str(), "wb");
+			if (file) {
+				fwrite(block.data.data(), 1, block.data.size(), file);
+				fclose(file);
+			}
+			else
+				output_error("Could not open output file '{}'", block.file.string());
+		}
+		lock.lock();
+	}
+}
+
+// Quote and escape a string for JSON output
+std::string json_string(std::string_view string)
+{
+	std::string ret;
+	ret.reserve(string.size() + 2);
+	ret += '"';
+	for (char c : string) {
+		switch (c) {
+			case '"':
+				ret += "\\\"";
+				break;
+			case '\\':
+				ret += "\\\\";
+				break;
+			case '\n':
+				ret += "\\n";
+				break;
+			case '\r':
+				ret += "\\r";
+				break;
+			case '\t':
+				ret += "\\t";
+				break;
+			default:
+				if ((unsigned char) c < 0x20)
+					rsgain::format_to(std::back_inserter(ret), "\\u{:04x}", (unsigned int) c);
+				else
+					ret += c;
+		}
+	}
+	ret += '"';
+	return ret;
+}
+
+// JSON has no representation for infinity, so non-finite values become null
+std::string json_number(double value)
+{
+	return std::isfinite(value) ? rsgain::format("{}", value) : "null";
+}
+
+size_t parse_number(std::string_view string, double &value)
+{
+	// Streams don't read infinities
+	bool negative = string.starts_with('-');
+	if (string.substr(negative).starts_with("inf")) {
+		value = negative ? -HUGE_VAL : HUGE_VAL;
+		return negative + 3;
+	}
+
+	// strtod() would use the decimal point of the global locale
+	std::istringstream stream{std::string(string)};
+	stream.imbue(std::locale::classic());
+	stream >> std::noskipws >> value;
+	if (stream.fail())
+		return 0;
+	return stream.eof() ? string.size() : (size_t) stream.tellg();
+}
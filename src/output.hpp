@@ -49,6 +49,11 @@
 
 #include <string>
 #include <string_view>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <filesystem>
+#include <condition_variable>
 
 #ifdef USE_STD_FORMAT
 #include <format>
@@ -60,6 +65,8 @@ template<class... Args>
 constexpr auto print(std::format_string<Args...> fmt, Args&&... args) { std::print(fmt, std::forward<Args>(args)...); }
 template<class... Args>
 constexpr auto print(std::FILE* stream, std::format_string<Args...> fmt, Args&&... args) { std::print(stream, fmt, std::forward<Args>(args)...); }
+template<class OutputIt, class... Args>
+constexpr auto format_to(OutputIt out, std::format_string<Args...> fmt, Args&&... args) { return std::format_to(out, fmt, std::forward<Args>(args)...); }
 }
 #else
 #include <fmt/core.h>
@@ -71,6 +78,8 @@ template<class... Args>
 constexpr auto print(fmt::format_string<Args...> fmt, Args&&... args) { fmt::print(fmt, std::forward<Args>(args)...); }
 template<class... Args>
 constexpr auto print(std::FILE* stream, fmt::format_string<Args...> fmt, Args&&... args) { fmt::print(stream, fmt, std::forward<Args>(args)...); }
+template<class OutputIt, class... Args>
+constexpr auto format_to(OutputIt out, fmt::format_string<Args...> fmt, Args&&... args) { return fmt::format_to(out, fmt, std::forward<Args>(args)...); }
 }
 #endif
 
@@ -104,6 +113,14 @@ extern int quiet;
 #define output_error(format, ...) rsgain::print(stderr, ERROR_PREFIX format "\n" __VA_OPT__(,) __VA_ARGS__)
 #define output_fail(format, ...)  rsgain::print(stderr, FAIL_PREFIX format "\n" __VA_OPT__(,) __VA_ARGS__)
 
+std::string json_string(std::string_view string);
+std::string json_number(double value);
+
+// Parse a number written by rsgain::format, which uses '.' as the decimal point whatever
+// the global locale is, and "inf" for infinities. Returns the number of characters
+// parsed, 0 if the string doesn't start with a number
+size_t parse_number(std::string_view string, double &value);
+
 class ProgressBar {
     private:
         int c_prev = -1;
@@ -141,3 +158,29 @@ class MTProgress {
         MTProgress(size_t total) : total(total) {}
         void update(const std::string &path);
 };
+
+// Appends whole blocks of scan output to their destination on a dedicated thread,
+// so workers never interleave partial lines or block on slow output
+class OutputWriter {
+    private:
+        struct Block {
+            std::filesystem::path file;
+            std::string data;
+        };
+
+        std::FILE *stream;
+        std::deque<Block> blocks;
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool done = false;
+        std::thread thread;
+
+        void work();
+
+    public:
+        OutputWriter(std::FILE *stream = nullptr);
+        ~OutputWriter();
+        static OutputWriter* factory(const std::filesystem::path &file);
+        void write(std::string &&data);
+        void write(const std::filesystem::path &file, std::string &&data);
+};
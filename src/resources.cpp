@@ -0,0 +1,254 @@
+/*
+ * Detection of the CPUs and memory available to the process, and of the kind of
+ * device that a path is on.
+ *
+ * On Linux, the affinity mask comes from sched_getaffinity() and the limits from
+ * the cgroup of the process, v2 (cpu.max, memory.max) or v1 (cpu.cfs_quota_us,
+ * memory.limit_in_bytes). The limits of the parent cgroups apply as well, so the
+ * lowest one on the way up to the root of the hierarchy is used.
+ *
+ * The type of a device comes from the filesystem type for network filesystems,
+ * and otherwise from the rotational flag of its block device in sysfs.
+ */
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <filesystem>
+#include <bit>
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "resources.hpp"
+#include "output.hpp"
+
+#define CGROUP_MOUNT "/sys/fs/cgroup"
+#define CGROUP_UNLIMITED (1ULL << 60) // v1 reports no memory limit as a huge value
+
+// statfs() f_type of network filesystems
+#define NFS_SUPER_MAGIC  0x6969
+#define SMB_SUPER_MAGIC  0x517B
+#define CIFS_SUPER_MAGIC 0xFF534D42
+#define SMB2_SUPER_MAGIC 0xFE534D42
+#define CEPH_SUPER_MAGIC 0x00C36400
+#define V9FS_MAGIC       0x01021997
+#define AFS_SUPER_MAGIC  0x5346414F
+
+#ifdef __linux__
+static bool read_line(const std::string &path, std::string &line)
+{
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file)
+        return false;
+    char buffer[4096];
+    bool ok = fgets(buffer, sizeof(buffer), file) != nullptr;
+    fclose(file);
+    if (ok) {
+        line = buffer;
+        while (!line.empty() && isspace((unsigned char) line.back()))
+            line.pop_back();
+    }
+    return ok;
+}
+
+// The cgroup of the process for a v1 controller, or the v2 one if controller is empty.
+// The lines of /proc/self/cgroup are hierarchy-ID:controller-list:cgroup-path
+static bool cgroup_path(std::string_view controller, std::string &path)
+{
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    if (!file)
+        return false;
+    char buffer[4096];
+    bool found = false;
+    while (!found && fgets(buffer, sizeof(buffer), file)) {
+        std::string_view line(buffer);
+        while (!line.empty() && isspace((unsigned char) line.back()))
+            line.remove_suffix(1);
+        size_t first = line.find(':');
+        size_t second = first == std::string_view::npos ? first : line.find(':', first + 1);
+        if (second == std::string_view::npos)
+            continue;
+        std::string_view controllers = line.substr(first + 1, second - first - 1);
+        if (controller.empty())
+            found = controllers.empty() && line.substr(0, first) == "0";
+        else {
+            while (!found && !controllers.empty()) {
+                size_t end = controllers.find(',');
+                found = controllers.substr(0, end) == controller;
+                controllers.remove_prefix(end == std::string_view::npos ? controllers.size() : end + 1);
+            }
+        }
+        if (found)
+            path = line.substr(second + 1);
+    }
+    fclose(file);
+    return found;
+}
+
+// The directories of the cgroup and its ancestors under the mount point of the hierarchy.
+// If the path isn't visible, e.g. in a container without a cgroup namespace, the mount
+// point itself is the container's cgroup
+static std::vector<std::string> cgroup_directories(const std::string &mount, std::string_view controller)
+{
+    std::vector<std::string> directories;
+    std::string path;
+    if (!cgroup_path(controller, path) || path.empty() || !std::filesystem::is_directory(mount + path))
+        path = "/";
+    while (1) {
+        directories.push_back(mount + path);
+        if (path == "/")
+            break;
+        size_t slash = path.find_last_of('/');
+        path.resize(slash ? slash : 1);
+    }
+    return directories;
+}
+
+static void detect_cgroup_limits(ResourceLimits &limits)
+{
+    std::string line;
+    bool v2 = std::filesystem::exists(CGROUP_MOUNT "/cgroup.controllers");
+    for (const std::string &directory : cgroup_directories(v2 ? CGROUP_MOUNT : CGROUP_MOUNT "/cpu", v2 ? "" : "cpu")) {
+        double quota = 0.0;
+        if (v2) {
+            long long max, period;
+            if (read_line(directory + "/cpu.max", line) && sscanf(line.c_str(), "%lld %lld", &max, &period) == 2 && max > 0 && period > 0)
+                quota = (double) max / (double) period;
+        }
+        else {
+            std::string period;
+            if (read_line(directory + "/cpu.cfs_quota_us", line) && read_line(directory + "/cpu.cfs_period_us", period)
+            && atoll(line.c_str()) > 0 && atoll(period.c_str()) > 0)
+                quota = (double) atoll(line.c_str()) / (double) atoll(period.c_str());
+        }
+        if (quota > 0.0 && (limits.cpu_quota == 0.0 || quota < limits.cpu_quota))
+            limits.cpu_quota = quota;
+    }
+    for (const std::string &directory : cgroup_directories(v2 ? CGROUP_MOUNT : CGROUP_MOUNT "/memory", v2 ? "" : "memory")) {
+        unsigned long long memory = 0;
+        if (read_line(directory + (v2 ? "/memory.max" : "/memory.limit_in_bytes"), line) && isdigit((unsigned char) line[0]))
+            memory = strtoull(line.c_str(), nullptr, 10);
+        if (memory && memory < CGROUP_UNLIMITED && (!limits.memory || memory < limits.memory))
+            limits.memory = (size_t) memory;
+    }
+}
+#endif
+
+unsigned int ResourceLimits::threads() const
+{
+    unsigned int n = cores;
+    if (affinity)
+        n = std::min(n, affinity);
+    if (cpu_quota > 0.0)
+        n = std::min(n, std::max((unsigned int) std::ceil(cpu_quota), 1u));
+    return n;
+}
+
+std::string format_memory(size_t bytes)
+{
+    if (bytes >= (1 << 30))
+        return rsgain::format("{:.1f} GiB", (double) bytes / (1 << 30));
+    return rsgain::format("{:.0f} MiB", (double) bytes / (1 << 20));
+}
+
+std::string ResourceLimits::describe() const
+{
+    std::string s;
+    if (affinity && affinity < cores)
+        s += rsgain::format("{} of {} CPUs in the affinity mask", affinity, cores);
+    if (cpu_quota > 0.0 && cpu_quota < cores)
+        s += rsgain::format("{}CPU quota of {:g}", s.empty() ? "" : ", ", cpu_quota);
+    if (memory)
+        s += rsgain::format("{}memory limit of {}", s.empty() ? "" : ", ", format_memory(memory));
+    return s;
+}
+
+const ResourceLimits& get_resource_limits()
+{
+    static const ResourceLimits limits = [] {
+        ResourceLimits limits;
+        limits.cores = std::max(std::thread::hardware_concurrency(), 1u);
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (!sched_getaffinity(0, sizeof(set), &set))
+            limits.affinity = (unsigned int) CPU_COUNT(&set);
+        detect_cgroup_limits(limits);
+#elif defined(_WIN32)
+        DWORD_PTR process, system;
+        if (GetProcessAffinityMask(GetCurrentProcess(), &process, &system))
+            limits.affinity = (unsigned int) std::popcount((unsigned long long) process);
+#endif
+        return limits;
+    }();
+    return limits;
+}
+
+uint64_t device_id([[maybe_unused]] const std::filesystem::path &path)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct stat st;
+    return stat(path.c_str(), &st) ? 0 : (uint64_t) st.st_dev;
+#endif
+}
+
+DeviceType device_type([[maybe_unused]] const std::filesystem::path &path)
+{
+#ifdef __linux__
+    struct statfs fs;
+    if (statfs(path.c_str(), &fs))
+        return DeviceType::UNKNOWN;
+    switch ((unsigned long) fs.f_type) {
+        case NFS_SUPER_MAGIC:
+        case SMB_SUPER_MAGIC:
+        case CIFS_SUPER_MAGIC:
+        case SMB2_SUPER_MAGIC:
+        case CEPH_SUPER_MAGIC:
+        case V9FS_MAGIC:
+        case AFS_SUPER_MAGIC:
+            return DeviceType::NETWORK;
+    }
+
+    // A partition has no queue of its own, the disk that it's on does
+    struct stat st;
+    if (stat(path.c_str(), &st))
+        return DeviceType::UNKNOWN;
+    std::string device = rsgain::format("/sys/dev/block/{}:{}", major(st.st_dev), minor(st.st_dev));
+    std::string line;
+    if (!read_line(device + "/queue/rotational", line) && !read_line(device + "/../queue/rotational", line))
+        return DeviceType::UNKNOWN;
+    return line == "1" ? DeviceType::HDD : DeviceType::SSD;
+#else
+    return DeviceType::UNKNOWN;
+#endif
+}
+
+const char* device_type_name(DeviceType type)
+{
+    switch (type) {
+        case DeviceType::SSD:
+            return "solid state drive";
+        case DeviceType::HDD:
+            return "hard disk";
+        case DeviceType::NETWORK:
+            return "network filesystem";
+        default:
+            return "unknown device";
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <filesystem>
+#include <stddef.h>
+#include <stdint.h>
+
+// The CPUs and memory that the process may use. In a container or under taskset
+// these can be far lower than what the machine has, which is all that
+// std::thread::hardware_concurrency() reports
+struct ResourceLimits {
+    unsigned int cores = 1;    // Reported by the operating system
+    unsigned int affinity = 0; // CPUs in the affinity mask, 0 if unknown
+    double cpu_quota = 0.0;    // cgroup CPU quota in CPUs, 0 if unlimited
+    size_t memory = 0;         // cgroup memory limit in bytes, 0 if unlimited
+
+    // The number of threads that can run at once
+    unsigned int threads() const;
+
+    // The limits that apply, e.g. "8 of 16 CPUs in the affinity mask, CPU quota of 2.5"
+    std::string describe() const;
+};
+
+// Detected once, on the first call
+const ResourceLimits& get_resource_limits();
+
+// e.g. "512 MiB" or "2.0 GiB"
+std::string format_memory(size_t bytes);
+
+enum class DeviceType {
+    UNKNOWN,
+    SSD,
+    HDD,
+    NETWORK
+};
+
+// The device that a path is on, 0 if unknown
+uint64_t device_id(const std::filesystem::path &path);
+
+// Whether the device that a path is on is a network filesystem, or a rotational or
+// non-rotational disk. Only detected on Linux
+DeviceType device_type(const std::filesystem::path &path);
+const char* device_type_name(DeviceType type);
@@ -36,7 +36,13 @@
 #include <getopt.h>
 #include <cmath>
 #include <string>
+#include <thread>
 #include <locale>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <string_view>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -57,6 +63,12 @@ extern "C" {
 #include "scan.hpp"
 #include "output.hpp"
 #include "easymode.hpp"
+#include "librsgain.hpp"
+#include "serve.hpp"
+#include "monitor.hpp"
+#include "trace.hpp"
+#include "resources.hpp"
+#include "json.hpp"
 
 #define PRINT_LIB(lib, version) rsgain::print("  " COLOR_YELLOW " {:<14}" COLOR_OFF " {}\n", lib, version)
 #define PRINT_LIB_FFMPEG(name, fn) \
@@ -73,8 +85,6 @@ static void help_main();
 static void version();
 static inline void help_custom();
 
-int quiet = 0;
-
 #ifdef _WIN32
 BOOL initial_cursor_visibility;
 static void init_console()
@@ -99,6 +109,7 @@ static void set_cursor_visibility(HANDLE console, BOOL setting, BOOL* previous)
 
 void quit(int status)
 {
+    Trace::write();
 #ifdef _WIN32
     if (initial_cursor_visibility)
         set_cursor_visibility(GetStdHandle(STD_OUTPUT_HANDLE), TRUE, nullptr);
@@ -159,14 +170,90 @@ bool parse_max_peak_level(const char *value, double &peak)
     return true;
 }
 
-std::pair<bool, bool> parse_output_mode(const std::string_view arg)
+// A comma-separated list of NAME:TARGET[:PEAK], e.g. "streaming:-14:-1,broadcast:-23"
+bool parse_profiles(const char *value, std::vector<Profile> &profiles)
+{
+    std::string_view list = value;
+    while (!list.empty()) {
+        size_t end = list.find(',');
+        std::string spec(list.substr(0, end));
+        list = end == std::string_view::npos ? std::string_view() : list.substr(end + 1);
+
+        Profile profile;
+        size_t colon = spec.find(':');
+        if (colon == 0 || colon == std::string::npos) {
+            output_error("Invalid profile '{}', expected NAME:TARGET[:PEAK]", spec);
+            return false;
+        }
+        profile.name = spec.substr(0, colon);
+        const char *target = spec.c_str() + colon + 1;
+        char *rest;
+        profile.target_loudness = strtod(target, &rest);
+        if (rest == target || (*rest && *rest != ':')
+        || !(profile.target_loudness >= MIN_TARGET_LOUDNESS && profile.target_loudness <= MAX_TARGET_LOUDNESS)) {
+            output_error("Invalid target loudness in profile '{}'", spec);
+            return false;
+        }
+        if (*rest == ':') {
+            double peak;
+            if (!parse_max_peak_level(rest + 1, peak))
+                return false;
+            profile.max_peak_level = peak;
+        }
+        profiles.push_back(std::move(profile));
+    }
+    return true;
+}
+
+bool parse_multithread(const char *value, unsigned int &threads)
+{
+    unsigned int max_threads = get_resource_limits().threads();
+    if (MATCH(value, "MAX") || MATCH(value, "max")) {
+        threads = max_threads;
+        return true;
+    }
+    unsigned int n = (unsigned int) (strtoul(value, nullptr, 10));
+    if (n < 1) {
+        output_fail("Invalid multithread argument '{}'", value);
+        return false;
+    }
+    else if (n > max_threads) {
+        output_warn("{} threads were requested, but only {} are available", n, max_threads);
+        n = max_threads;
+    }
+    threads = n;
+    return true;
+}
+
+// A size in bytes, or in KiB, MiB or GiB with a K, M or G suffix
+bool parse_memory_limit(const char *value, size_t &bytes)
 {
-    std::pair<bool, bool> ret(false, false);
+    char *end;
+    unsigned long long n = strtoull(value, &end, 10);
+    unsigned int shift = 0;
+    switch (toupper((unsigned char) *end)) {
+        case 'K': shift = 10; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'G': shift = 30; end++; break;
+    }
+    if (end == value || *end || !n || n > (SIZE_MAX >> shift)) {
+        output_fail("Invalid memory limit '{}'", value);
+        return false;
+    }
+    bytes = (size_t) n << shift;
+    return true;
+}
+
+OutputMode parse_output_mode(const std::string_view arg)
+{
+    OutputMode ret;
     for (char c : arg) {
         if (c == 's')
-            ret.first = true;
+            ret.sep_header = true;
         else if (c == 'a')
-            ret.second = true;
+            ret.sort_alphanum = true;
+        else if (c == 'c')
+            ret.consolidated = true;
         else {
             output_fail("Unrecognized output argument '{}'", c);
             quit(EXIT_FAILURE);
@@ -175,14 +262,116 @@ std::pair<bool, bool> parse_output_mode(const std::string_view arg)
     return ret;
 }
 
+// One album of a --files-from list or --manifest
+struct Batch {
+    std::vector<std::filesystem::path> files;
+    std::string name;
+    int album = -1; // -1: use the command line setting
+};
+
+static bool read_list(const char *file, std::string &data)
+{
+    bool from_stdin = MATCH(file, "-");
+    std::FILE *stream = from_stdin ? stdin : fopen(file, "rb");
+    if (!stream) {
+        output_fail("Could not open '{}'", file);
+        return false;
+    }
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), stream)) > 0)
+        data.append(buffer, n);
+    bool ok = !ferror(stream);
+    if (!from_stdin)
+        fclose(stream);
+    if (!ok)
+        output_fail("Could not read '{}'", file);
+    return ok;
+}
+
+// Records are NUL-delimited if the list contains a NUL, otherwise newline-delimited.
+// An empty record ends the current album
+static bool parse_files_from(const char *file, std::vector<Batch> &batches)
+{
+    std::string data;
+    if (!read_list(file, data))
+        return false;
+    char delim = data.find('\0') != std::string::npos ? '\0' : '\n';
+    batches.emplace_back();
+    size_t start = 0;
+    while (start < data.size()) {
+        size_t end = data.find(delim, start);
+        if (end == std::string::npos)
+            end = data.size();
+        std::string_view record(data.data() + start, end - start);
+        if (delim == '\n' && record.ends_with('\r'))
+            record.remove_suffix(1);
+        if (record.empty()) {
+            if (!batches.back().files.empty())
+                batches.emplace_back();
+        }
+        else
+            batches.back().files.emplace_back(std::string(record));
+        start = end + 1;
+    }
+    if (batches.back().files.empty())
+        batches.pop_back();
+    return true;
+}
+
+// A manifest is JSON Lines, one album per line: {"files": [...], "album": true, "name": "..."}
+static bool parse_manifest(const char *file, std::vector<Batch> &batches)
+{
+    std::string data;
+    if (!read_list(file, data))
+        return false;
+    size_t start = 0;
+    for (unsigned int line_nb = 1; start < data.size(); line_nb++) {
+        size_t end = data.find('\n', start);
+        if (end == std::string::npos)
+            end = data.size();
+        std::string_view line(data.data() + start, end - start);
+        start = end + 1;
+        if (line.find_first_not_of(" \t\r") == std::string_view::npos)
+            continue;
+
+        JsonValue entry;
+        const JsonValue *files = nullptr;
+        if (!parse_json(line, entry) || entry.type != JsonValue::Type::OBJECT
+        || !(files = entry.get("files", JsonValue::Type::ARRAY))) {
+            output_fail("Invalid manifest entry on line {} of '{}'", line_nb, file);
+            return false;
+        }
+        Batch &batch = batches.emplace_back();
+        for (const JsonValue &f : files->array) {
+            if (f.type != JsonValue::Type::STRING) {
+                output_fail("Invalid file name on line {} of '{}'", line_nb, file);
+                return false;
+            }
+            batch.files.emplace_back(f.string);
+        }
+        if (const JsonValue *album = entry.get("album", JsonValue::Type::BOOL))
+            batch.album = album->boolean;
+        if (const JsonValue *name = entry.get("name", JsonValue::Type::STRING))
+            batch.name = name->string;
+    }
+    return true;
+}
+
 // Parse Custom Mode command line arguments
 static void custom_mode(int argc, char *argv[])
 {
     int rc, i;
     unsigned int nb_files   = 0;
+    bool json = false;
+    std::filesystem::path json_file;
+    const char *files_from = nullptr;
+    const char *manifest = nullptr;
+    std::string input_format;
+    unsigned int threads = 1;
     opterr = 0;
 
-    const char *short_opts = "+ac:m:tdl:O::qps:LSI:o:h?";
+    const char *short_opts = "+ac:m:tdrkCxX:l:P:O::j::T:qps:LSI:o:f:A:M:F:h?";
     static struct option long_opts[] = {
         { "album",           no_argument,       nullptr, 'a' },
         { "skip-existing",   no_argument,       nullptr, 'S' },
@@ -191,10 +380,18 @@ static void custom_mode(int argc, char *argv[])
         { "max-peak",        required_argument, nullptr, 'm' },
         { "true-peak",       no_argument,       nullptr, 't' },
         { "dual-mono",       no_argument,       nullptr, 'd' },
+        { "loudness-range",  no_argument,       nullptr, 'r' },
+        { "store-loudness",  no_argument,       nullptr, 'k' },
+        { "chapters",        no_argument,       nullptr, 'C' },
+        { "all-streams",     no_argument,       nullptr, 'x' },
+        { "channel-threads", required_argument, nullptr, 'X' },
 
         { "loudness",        required_argument, nullptr, 'l' },
+        { "profile",         required_argument, nullptr, 'P' },
 
         { "output",          optional_argument, nullptr, 'O' },
+        { "json",            optional_argument, nullptr, 'j' },
+        { "trace",           required_argument, nullptr, 'T' },
         { "quiet",           no_argument,       nullptr, 'q' },
         { "preserve-mtimes", no_argument,       nullptr, 'p' },
 
@@ -202,28 +399,16 @@ static void custom_mode(int argc, char *argv[])
         { "lowercase",       no_argument,       nullptr, 'L' },
         { "id3v2-version",   required_argument, nullptr, 'I' },
         { "opus-mode",       required_argument, nullptr, 'o' },
+
+        { "files-from",      required_argument, nullptr, 'f' },
+        { "manifest",        required_argument, nullptr, 'A' },
+        { "multithread",     required_argument, nullptr, 'M' },
+        { "input-format",    required_argument, nullptr, 'F' },
         { "help",            no_argument,       nullptr, 'h' },
         { 0, 0, 0, 0 }
     };
 
-    Config config = {
-        .tag_mode = 's',
-        .skip_existing = false,
-        .target_loudness = RG_TARGET_LOUDNESS,
-        .max_peak_level = 0.0,
-        .true_peak = false,
-        .clip_mode = 'n',
-        .do_album = false,
-        .tab_output = OutputType::NONE,
-        .sep_header = false,
-        .sort_alphanum = false,
-        .lowercase = false,
-        .id3v2version = ID3V2_KEEP,
-        .opus_mode = 'd',
-        .skip_mp4 = false,
-        .preserve_mtimes = false,
-        .dual_mono = false
-    };
+    Config config = rsgain::default_config();
 
     while ((rc = getopt_long(argc, argv, short_opts, long_opts, &i)) != -1) {
         switch (rc) {
@@ -256,22 +441,59 @@ static void custom_mode(int argc, char *argv[])
                 break;
             }
 
+            case 'r':
+                config.loudness_range = true;
+                break;
+
+            case 'k':
+                config.store_loudness = true;
+                break;
+
+            case 'C':
+                config.chapters = true;
+                break;
+
+            case 'x':
+                config.all_streams = true;
+                break;
+
+            case 'X':
+                if (!parse_multithread(optarg, config.channel_threads))
+                    quit(EXIT_FAILURE);
+                break;
+
             case 'l': {
                 if (!parse_target_loudness(optarg, config.target_loudness))
                     quit(EXIT_FAILURE);
                 break;
             }
 
+            case 'P':
+                if (!parse_profiles(optarg, config.profiles))
+                    quit(EXIT_FAILURE);
+                break;
+
             case 'O':
                 config.tab_output = OutputType::STDOUT;
                 if (optarg) {
-                    const auto& [sep_header, sort_alphanum] = parse_output_mode(optarg);
-                    config.sep_header = sep_header;
-                    config.sort_alphanum = sort_alphanum;
+                    const OutputMode mode = parse_output_mode(optarg);
+                    config.sep_header = mode.sep_header;
+                    config.sort_alphanum = mode.sort_alphanum;
                 }
                 quiet = 1;
                 break;
 
+            case 'j':
+                json = true;
+                json_file = optarg ? optarg : "";
+                if (json_file.empty())
+                    quiet = 1;
+                break;
+
+            case 'T':
+                Trace::start(optarg);
+                break;
+
             case 'q':
                 quiet = 1;
                 break;
@@ -299,6 +521,23 @@ static void custom_mode(int argc, char *argv[])
                 if (!parse_opus_mode(optarg, config.opus_mode))
                     quit(EXIT_FAILURE);
                 break;
+
+            case 'f':
+                files_from = optarg;
+                break;
+
+            case 'A':
+                manifest = optarg;
+                break;
+
+            case 'M':
+                if (!parse_multithread(optarg, threads))
+                    quit(EXIT_FAILURE);
+                break;
+
+            case 'F':
+                input_format = optarg;
+                break;
                 
             case 'h':
                 help_custom();
@@ -314,19 +553,133 @@ static void custom_mode(int argc, char *argv[])
         }
     }
 
+    // Only the true peaks are measured on the channel threads
+    if (config.channel_threads && !config.true_peak) {
+        output_fail("--channel-threads can only be used together with --true-peak");
+        quit(EXIT_FAILURE);
+    }
+
+    // Both would write to stdout and interleave
+    if (config.tab_output != OutputType::NONE && json && json_file.empty()) {
+        output_fail("--output and --json can only be used together with --json=FILE");
+        quit(EXIT_FAILURE);
+    }
+
     nb_files = (unsigned int) (argc - optind);
-    if (!nb_files) {
+    std::vector<Batch> batches;
+    if (files_from || manifest) {
+        if (files_from && manifest) {
+            output_fail("--files-from and --manifest cannot be used together");
+            quit(EXIT_FAILURE);
+        }
+        if (nb_files) {
+            output_fail("Files cannot be listed on the command line with --{}", files_from ? "files-from" : "manifest");
+            quit(EXIT_FAILURE);
+        }
+        if (files_from ? !parse_files_from(files_from, batches) : !parse_manifest(manifest, batches))
+            quit(EXIT_FAILURE);
+        if (batches.empty()) {
+            output_fail("No files were specified");
+            quit(EXIT_FAILURE);
+        }
+
+        // Rows from different albums are interleaved, so they need the full path
+        if (config.tab_output != OutputType::NONE)
+            config.tab_output = OutputType::CONSOLIDATED;
+    }
+    else if (!nb_files) {
         output_fail("No files were specified");
         quit(EXIT_FAILURE);
     }
+    else
+        batches.emplace_back().files.assign(argv + optind, argv + argc);
+
+    // Streams are scanned for their numbers only, so default to machine-readable output
+    bool streams = false;
+    for (const Batch &batch : batches) {
+        for (const std::filesystem::path &file : batch.files) {
+            int fd = parse_stream_name(file.string());
+            if (fd == 0 && ((files_from && MATCH(files_from, "-")) || (manifest && MATCH(manifest, "-")))) {
+                output_fail("Audio can't be read from stdin when the file list is");
+                quit(EXIT_FAILURE);
+            }
+            streams |= fd >= 0;
+        }
+    }
+    if (streams && !json && config.tab_output == OutputType::NONE) {
+        json = true;
+        quiet = 1;
+    }
 
-    std::unique_ptr<ScanJob> job(ScanJob::factory(argv + optind, nb_files, config));
-    if (!job) {
-        output_fail("File list is not valid");
-        quit(EXIT_FAILURE);
+    // Jobs hold a reference to their config, so each album's copy must stay put
+    std::deque<Config> configs;
+    std::vector<std::unique_ptr<ScanJob>> jobs;
+    bool failed = false;
+    for (Batch &batch : batches) {
+        Config &album_config = configs.emplace_back(config);
+        if (batch.album != -1)
+            album_config.do_album = batch.album;
+        std::string error;
+        std::unique_ptr<ScanJob> job(ScanJob::factory(batch.files, album_config, error, input_format));
+        if (!job) {
+            output_error("{}", error);
+            if (batches.size() == 1) {
+                output_fail("File list is not valid");
+                quit(EXIT_FAILURE);
+            }
+            output_error("Skipping album '{}'", batch.name.empty() ? batch.files.front().string() : batch.name);
+            failed = true;
+            continue;
+        }
+        if (!batch.name.empty())
+            job->path = batch.name;
+        else
+            job->path = batch.files.front().parent_path();
+        job->interactive = !quiet && threads == 1;
+        job->on_error = [](const std::filesystem::path&, const std::string &message) { output_error("{}", message); };
+        jobs.push_back(std::move(job));
     }
-    job->scan();
-    if (job->error)
+
+    std::unique_ptr<OutputWriter> writer;
+    if (config.tab_output != OutputType::NONE) {
+        writer = std::make_unique<OutputWriter>(stdout);
+        writer->write(ScanJob::tab_header(config));
+    }
+    std::unique_ptr<OutputWriter> json_writer;
+    if (json) {
+        json_writer.reset(OutputWriter::factory(json_file));
+        if (!json_writer)
+            quit(EXIT_FAILURE);
+    }
+    for (auto &job : jobs) {
+        job->writer = writer.get();
+        job->json_writer = json_writer.get();
+    }
+
+    // Albums are independent, so they are scanned in parallel. Threads left over
+    // when there are fewer albums than threads go to scanning the tracks of each album
+    if (threads > 1 && jobs.size() > 1) {
+        std::mutex ffmpeg_mutex;
+        size_t nb_albums = std::min((size_t) threads, jobs.size());
+        rsgain::WorkerPool pool(nb_albums);
+        for (auto &job : jobs) {
+            job->nb_threads = threads / nb_albums;
+            pool.submit([&job, &ffmpeg_mutex] { job->scan(&ffmpeg_mutex); });
+        }
+        pool.wait();
+    }
+    else {
+        for (auto &job : jobs) {
+            job->interactive = !quiet;
+            job->nb_threads = threads;
+            job->scan();
+        }
+    }
+    writer.reset();
+    json_writer.reset();
+    for (const auto &job : jobs)
+        failed |= job->error;
+    if (failed)
         quit(EXIT_FAILURE);
 }
 
@@ -385,6 +738,10 @@ int main(int argc, char *argv[]) {
         easy_mode(num_subargs, subargs);
     else if (MATCH(command, "custom"))
         custom_mode(num_subargs, subargs);
+    else if (MATCH(command, "serve"))
+        serve_mode(num_subargs, subargs);
+    else if (MATCH(command, "monitor"))
+        monitor_mode(num_subargs, subargs);
     else {
         output_fail("Invalid command '{}'", command);
         quit(EXIT_FAILURE);
@@ -411,6 +768,8 @@ static void help_main() {
 
     CMD_CMD("easy",     "Easy Mode:   Recursively scan a directory with recommended settings");
     CMD_CMD("custom",   "Custom Mode: Scan individual files with custom settings");
+    CMD_CMD("serve",    "Serve Mode:  Run as a daemon accepting requests on a Unix socket");
+    CMD_CMD("monitor",  "Monitor Mode: Continuously measure the loudness of a live stream");
     rsgain::print("\n");
     rsgain::print("Run '{} easy --help' or '{} custom --help' for more information.", EXECUTABLE_TITLE, EXECUTABLE_TITLE);
 
@@ -422,7 +781,9 @@ static inline void help_custom() {
     rsgain::print(COLOR_RED "Usage: " COLOR_OFF "{}{}{} custom [OPTIONS] FILES...\n", COLOR_GREEN, EXECUTABLE_TITLE, COLOR_OFF);
 
     rsgain::print("  Custom Mode allows the user to specify the options to scan the files with. The\n");
-    rsgain::print("  list of files to scan must be listed explicitly after the options.\n");
+    rsgain::print("  list of files to scan must be listed explicitly after the options, or read\n");
+    rsgain::print("  from a file with --files-from or --manifest. A file name of - reads the audio\n");
+    rsgain::print("  from stdin and pipe:N from file descriptor N, which can only be scanned.\n");
     rsgain::print("\n");
     
     rsgain::print(COLOR_RED "Options:\n" COLOR_OFF);
@@ -436,9 +797,13 @@ static inline void help_custom() {
     CMD_HELP("--tagmode=s", "-s s", "Scan files but don't write ReplayGain tags (default)");
     CMD_HELP("--tagmode=d", "-s d",  "Delete ReplayGain tags from files");
     CMD_HELP("--tagmode=i", "-s i",  "Scan and write ReplayGain 2.0 tags to files");
+    CMD_HELP("--tagmode=r", "-s r",  "Recalculate and write ReplayGain tags from the loudness");
+    CMD_CONT("stored by --store-loudness, without decoding the audio");
     rsgain::print("\n");
 
     CMD_HELP("--loudness=n",  "-l n",  "Use n LUFS as target loudness (" STR(MIN_TARGET_LOUDNESS) " ≤ n ≤ " STR(MAX_TARGET_LOUDNESS) ")");
+    CMD_HELP("--profile=s",  "-P s",  "Also calculate gains for profile s, written as NAME:TARGET[:PEAK]");
+    CMD_CONT("Can be repeated or comma-separated. Profiles are only output, not tagged");
     rsgain::print("\n");
 
     CMD_HELP("--clip-mode=n", "-c n", "No clipping protection (default)");
@@ -447,6 +812,10 @@ static inline void help_custom() {
     CMD_HELP("--max-peak=n", "-m n", "Use max peak level n dB for clipping protection");
     CMD_HELP("--true-peak",  "-t", "Use true peak for peak calculations");
     CMD_HELP("--dual-mono",  "-d", "Treat mono files as dual-mono");
+    CMD_HELP("--loudness-range", "-r", "Also measure LRA and max momentary/short-term loudness");
+    CMD_HELP("--store-loudness", "-k", "Also write the loudness to tags for --tagmode=r");
+    CMD_HELP("--chapters", "-C", "Also measure the loudness and peak of each chapter");
+    CMD_HELP("--all-streams", "-x", "Also measure every other audio stream in the same pass");
 
     rsgain::print("\n");
 
@@ -469,12 +838,29 @@ static inline void help_custom() {
     CMD_HELP("--output", "-O",  "Output tab-delimited scan data to stdout");
     CMD_HELP("--output=s", "-O s",  "Output with sep header (needed for Microsoft Excel compatibility)");
     CMD_HELP("--output=a", "-O a",  "Output with files sorted in alphanumeric order");
+    CMD_HELP("--json", "-j",  "Output JSON Lines scan data to stdout");
+    CMD_CONT("Can't be combined with -O, use -jf instead");
+    CMD_HELP("--json=f", "-jf",  "Output JSON Lines scan data to file f");
+    CMD_HELP("--trace=f", "-T f",  "Write a Chrome trace of the scan to file f");
 
     CMD_HELP("--preserve-mtimes", "-p", "Preserve file mtimes");
     CMD_HELP("--quiet",      "-q",  "Don't print scanning status messages");
 
     rsgain::print("\n");
 
+    CMD_HELP("--files-from=f", "-f f", "Read files from f (- for stdin), NUL or newline delimited");
+    CMD_CONT("An empty entry starts a new album");
+    CMD_HELP("--manifest=f", "-A f", "Read albums from JSON Lines manifest f (- for stdin)");
+    CMD_CONT("Each line is {\"files\": [...], \"album\": bool, \"name\": \"...\"}");
+    CMD_HELP("--input-format=s", "-F s", "Container format of audio read from stdin or a pipe, e.g. flac");
+    CMD_CONT("Streams are output as JSON Lines to stdout unless -O or -j is given");
+    CMD_HELP("--multithread=n", "-M n", "Scan files with n parallel threads. Use \"MAX\" for all available threads");
+    CMD_CONT("Albums are scanned in parallel, then the tracks within each album");
+    CMD_HELP("--channel-threads=n", "-X n", "Analyze files with " STR(PARALLEL_MIN_CHANNELS) " or more channels on n threads");
+    CMD_CONT("Requires -t, the true peaks are measured on the extra threads");
+
+    rsgain::print("\n");
+
     rsgain::print("Please report any issues to " PROJECT_URL "/issues\n");
     rsgain::print("\n");
 }
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <string_view>
+#include <vector>
+#include "scan.hpp"
+
 #define CMD_HELP(CMDL, CMDS, MSG) rsgain::print("  {}{:<8} {:<20}{}  {}.\n", COLOR_YELLOW, CMDS ",", CMDL, COLOR_OFF, MSG);
 #define CMD_CMD(CMD, MSG) rsgain::print("  {}{:<22}{}  {}.\n", COLOR_YELLOW, CMD, COLOR_OFF, MSG);
 #define CMD_CONT(MSG) rsgain::print("  {}{:<8} {:<20}{}  {}.\n", COLOR_YELLOW, "", "", COLOR_OFF, MSG);
@@ -10,42 +14,22 @@
 #define MAX_TARGET_LOUDNESS -5
 #define MIN_TARGET_LOUDNESS -30
 
-#define RG_TARGET_LOUDNESS -18.0
-#define ID3V2_KEEP 0
-
-enum class OutputType{
-	NONE,
-	STDOUT,
-	FILE,
+struct OutputMode {
+	bool sep_header = false;
+	bool sort_alphanum = false;
+	bool consolidated = false;
 };
 
-struct Config {
-	char tag_mode;
-	bool skip_existing;
-	double target_loudness;
-	double max_peak_level;
-	bool true_peak;
-	char clip_mode;
-	bool do_album;
-	OutputType tab_output;
-	bool sep_header;
-	bool sort_alphanum;
-	bool lowercase;
-	unsigned int id3v2version;
-	char opus_mode;
-	bool skip_mp4;
-	bool preserve_mtimes;
-	bool dual_mono;
-};
-
-
 void quit(int status);
 bool parse_mode(const char *name, const char *valid_modes, const char *value, char &mode);
-#define parse_tag_mode_easy(value, mode) parse_mode("tag", "disn", value, mode)
-#define parse_tag_mode_custom(value, mode) parse_mode("tag", "dis", value, mode)
+#define parse_tag_mode_easy(value, mode) parse_mode("tag", "disrn", value, mode)
+#define parse_tag_mode_custom(value, mode) parse_mode("tag", "disr", value, mode)
 #define parse_clip_mode(value, mode) parse_mode("clip", "npa", value, mode)
 #define parse_opus_mode(value, mode) parse_mode("Opus", "drtas", value, mode)
 bool parse_target_loudness(const char *value, double &target_loudness);
 bool parse_id3v2_version(const char *value, unsigned int &version);
 bool parse_max_peak_level(const char *value, double &peak);
-std::pair<bool, bool> parse_output_mode(const std::string_view arg);
+bool parse_multithread(const char *value, unsigned int &threads);
+bool parse_memory_limit(const char *value, size_t &bytes);
+bool parse_profiles(const char *value, std::vector<Profile> &profiles);
+OutputMode parse_output_mode(const std::string_view arg);
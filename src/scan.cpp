@@ -31,13 +31,27 @@
 
 
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include <thread>
+#include <condition_variable>
 #include <vector>
 #include <unordered_set>
 #include <algorithm>
 #include <filesystem>
 #include <unordered_map>
+#include <map>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
 
 #include <ebur128.h>
 extern "C" {
@@ -49,26 +63,25 @@ extern "C" {
 #include <libavutil/opt.h>
 }
 
-#include "rsgain.hpp"
-#include "easymode.hpp"
 #include "scan.hpp"
 #include "output.hpp"
 #include "tag.hpp"
+#include "trace.hpp"
+#include "cue.hpp"
 
-template <typename T>
-constexpr void output_fferror(int error, T&& msg)
+static std::string fferror(int error, std::string_view msg)
 {
     char errbuf[512];
     av_strerror(error, errbuf, sizeof(errbuf));
-    output_error("{}: {}", msg, errbuf);
+    return rsgain::format("{}: {}", msg, errbuf);
 }
 #define OLD_CHANNEL_LAYOUT LIBAVUTIL_VERSION_MAJOR < 57 || (LIBAVUTIL_VERSION_MAJOR == 57 && LIBAVUTIL_VERSION_MINOR < 18)
 #define OUTPUT_FORMAT AV_SAMPLE_FMT_S16
-
-extern bool multithread;
+#define STREAM_BUFFER_SIZE 65536
+#define FOLLOW_INTERVAL 200 // ms
 
 // A function to determine a file type
-static FileType determine_filetype(const std::string &extension)
+FileType determine_filetype(const std::string &extension)
 {
     static const std::unordered_map<std::string, FileType> map =  {
         {".mp2",  FileType::MP2},
@@ -96,56 +109,556 @@ static FileType determine_filetype(const std::string &extension)
     return it == map.end() ? FileType::INVALID : it->second;
 }
 
-ScanJob* ScanJob::factory(const std::filesystem::path &path)
+// A rough estimate of the time that one core takes to scan a file, in seconds. The duration
+// is guessed from the size and a typical bitrate of the type, and each second of audio
+// costs its decoding plus the analysis
+double estimate_scan_cost(FileType type, uintmax_t size, const Config &config)
+{
+    struct CostModel {
+        double bytes_per_second;
+        double decode; // Core seconds per second of audio
+    };
+    static const std::array<CostModel, static_cast<size_t>(FileType::MAX_VAL)> models = {{
+        {32000,  0.0025}, // DEFAULT
+        {32000,  0.0015}, // MP2
+        {32000,  0.002},  // MP3
+        {110000, 0.001},  // FLAC
+        {24000,  0.0025}, // OGG
+        {16000,  0.0035}, // OPUS
+        {32000,  0.0025}, // M4A
+        {24000,  0.0025}, // WMA
+        {176400, 0.0002}, // WAV
+        {176400, 0.0002}, // AIFF
+        {110000, 0.002},  // WAVPACK
+        {100000, 0.02},   // APE
+        {100000, 0.0015}, // TAK
+        {24000,  0.0015}  // MPC
+    }};
+    if (type == FileType::INVALID)
+        type = FileType::DEFAULT;
+    const CostModel &model = models[static_cast<size_t>(type)];
+    double analysis = 0.002 + (config.true_peak ? 0.008 : 0.0005);
+    return (double) size / model.bytes_per_second * (model.decode + analysis);
+}
+
+static bool is_cue_sheet(const std::filesystem::path &path)
+{
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == ".cue";
+}
+
+// A rough estimate of the peak memory use of the job. The ebur128 state of every track
+// lives until the album loudness is calculated, and without histograms it keeps the
+// gating blocks of the whole track. Tracks are decoded nb_threads at a time
+size_t ScanJob::estimate_memory() const
+{
+    double window = config.loudness_range ? 3.0 : 0.4;
+    std::unordered_set<std::string> images;
+    size_t memory = DECODER_MEMORY * std::min(std::max(nb_threads, (size_t) 1), tracks.size());
+    for (const Track &track : tracks) {
+        memory += (size_t) (window * STATE_MEMORY);
+        if (track.ebur128_mode & EBUR128_MODE_HISTOGRAM) {
+            memory += HISTOGRAM_MEMORY;
+            continue;
+        }
+
+        // The blocks of the tracks of a CUE sheet image add up to those of the image
+        std::error_code ec;
+        uintmax_t size = track.fd < 0 && images.insert(track.path.string()).second ? std::filesystem::file_size(track.path, ec) : 0;
+        if (!ec)
+            memory += (size_t) (size / MIN_BYTES_PER_SECOND) * BLOCK_MEMORY_PER_SECOND;
+    }
+    return memory;
+}
+
+// Measure with histograms, which take constant memory regardless of the duration,
+// at the cost of slightly quantized loudness values
+void ScanJob::use_histograms()
+{
+    for (Track &track : tracks)
+        track.ebur128_mode |= EBUR128_MODE_HISTOGRAM;
+}
+
+// Whether a directory job scans the file: audio of a supported type, or a CUE sheet
+bool ScanJob::includes(const std::filesystem::path &file, const ConfigTable &configs)
+{
+    if (is_cue_sheet(file))
+        return true;
+    FileType file_type;
+    return file.has_extension()
+        && ((file_type = determine_filetype(file.extension().string())) != FileType::INVALID)
+        && !(file_type == FileType::M4A && configs[static_cast<size_t>(file_type)].skip_mp4 && file.extension().string() == ".mp4")
+        && !(file.filename().string().starts_with("._"));
+}
+
+ScanJob* ScanJob::factory(const std::filesystem::path &path, const ConfigTable &configs)
+{
+    std::vector<std::filesystem::path> files;
+    for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(path)) {
+        if (entry.is_regular_file() && includes(entry.path(), configs))
+            files.push_back(entry.path());
+    }
+    return factory(path, files, configs);
+}
+
+// Build the job of a directory from files that it includes, listed beforehand
+ScanJob* ScanJob::factory(const std::filesystem::path &path, const std::vector<std::filesystem::path> &files, const ConfigTable &configs)
 {
     std::unordered_set<FileType> extensions;
     FileType file_type;
     std::vector<Track> tracks;
+    std::vector<std::filesystem::path> sheets;
 
-    for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(path)) {
-        if (entry.is_regular_file() && entry.path().has_extension()
-        && ((file_type = determine_filetype(entry.path().extension().string())) != FileType::INVALID)
-        && !(file_type == FileType::M4A && get_config(file_type).skip_mp4 && entry.path().extension().string() == ".mp4")
-        && !(entry.path().filename().string().starts_with("._"))) {
-            tracks.emplace_back(entry.path(), file_type);
+    for (const std::filesystem::path &file : files) {
+        if (is_cue_sheet(file))
+            sheets.push_back(file);
+        else {
+            file_type = determine_filetype(file.extension().string());
+            tracks.emplace_back(file, file_type);
             extensions.insert(file_type);
         }
     }
+
+    // A sheet that can't be used, e.g. one left over from splitting the image, is ignored
+    std::string error;
+    for (const std::filesystem::path &sheet : sheets) {
+        if (add_cue_tracks(sheet, tracks, error)) {
+            for (const Track &track : tracks)
+                extensions.insert(track.type);
+        }
+    }
     if (tracks.empty())
         return nullptr;
     file_type = extensions.size() > 1 ? FileType::DEFAULT : *extensions.begin();
-    const Config &config = get_config(file_type);
+    const Config &config = configs[static_cast<size_t>(file_type)];
     if (config.tag_mode == 'n')
         return nullptr;
     return new ScanJob(path, tracks, config, file_type);
 }
 
-ScanJob* ScanJob::factory(char **files, size_t nb_files, const Config &config)
+ScanJob* ScanJob::factory(const std::vector<std::filesystem::path> &files, const Config &config, std::string &error, const std::string &stream_format)
 {
     FileType file_type;
-    std::filesystem::path path;
     std::vector<Track> tracks;
     std::unordered_set<FileType> types;
-    for (size_t i = 0; i < nb_files; i++) {
-        path = files[i];
-        if (!std::filesystem::exists(path)) {
-            output_error("File '{}' does not exist", path.string());
+    std::unordered_set<int> fds;
+    for (const std::filesystem::path &path : files) {
+        int fd = parse_stream_name(path.string());
+        if (fd >= 0) {
+            if (config.tag_mode != 's' || config.skip_existing) {
+                error = rsgain::format("'{}' is a stream, which can only be scanned", path.string());
+                return nullptr;
+            }
+            else if (!fds.insert(fd).second) {
+                error = rsgain::format("Stream '{}' was specified more than once", path.string());
+                return nullptr;
+            }
+            file_type = stream_format.empty() ? FileType::INVALID : determine_filetype("." + stream_format);
+            if (file_type == FileType::INVALID)
+                file_type = FileType::DEFAULT;
+            Track &track = tracks.emplace_back(path, file_type);
+            track.fd = fd;
+            track.format = stream_format;
+            types.insert(file_type);
+        }
+        else if (!std::filesystem::exists(path)) {
+            error = rsgain::format("File '{}' does not exist", path.string());
             return nullptr;
         }
+        else if (is_cue_sheet(path)) {
+            if (!add_cue_tracks(path, tracks, error))
+                return nullptr;
+            for (const Track &track : tracks)
+                types.insert(track.type);
+        }
         else if ((file_type = determine_filetype(path.extension().string())) == FileType::INVALID) {
-            output_error("File '{}' is not of a supported type", files[i]);
+            error = rsgain::format("File '{}' is not of a supported type", path.string());
             return nullptr;
         }
-        else {
+        // An image already added by a CUE sheet listed before it is scanned through the sheet
+        else if (std::none_of(tracks.begin(), tracks.end(), [&](const Track &track) { return track.fd < 0 && track.path.lexically_normal() == path.lexically_normal(); })) {
             tracks.emplace_back(path, file_type);
             types.insert(file_type);
         }
     }
-    if (tracks.empty())
+    if (tracks.empty()) {
+        error = "No files were specified";
         return nullptr;
+    }
     return new ScanJob(tracks, config, types.size() > 1 ? FileType::DEFAULT : *types.begin());
 }
 
+int parse_stream_name(const std::string &name)
+{
+    if (name == "-")
+        return 0;
+    if (!name.starts_with("pipe:") || name.size() == 5)
+        return -1;
+    char *end;
+    long fd = strtol(name.c_str() + 5, &end, 10);
+    return *end || fd < 0 || fd > INT_MAX ? -1 : (int) fd;
+}
+
+struct StreamSource {
+    int fd;
+    const volatile sig_atomic_t *follow;
+};
+
+static int read_stream(void *opaque, uint8_t *buf, int size)
+{
+    const StreamSource *source = (const StreamSource*) opaque;
+    while (true) {
+#ifdef _WIN32
+        int n = _read(source->fd, buf, (unsigned int) size);
+#else
+        ssize_t n = read(source->fd, buf, (size_t) size);
+        if (n < 0 && errno == EINTR)
+            continue;
+#endif
+        if (n < 0)
+            return AVERROR(errno);
+        else if (n)
+            return (int) n;
+
+        // A growing file reads as EOF until the writer appends more
+        if (!source->follow || *source->follow)
+            return AVERROR_EOF;
+        std::this_thread::sleep_for(std::chrono::milliseconds(FOLLOW_INTERVAL));
+    }
+}
+
+int open_stream_input(AVFormatContext **format_ctx, int fd, const std::string &format, const volatile sig_atomic_t *follow)
+{
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+    const
+#endif
+    AVInputFormat *input_format = nullptr;
+    if (!format.empty() && !(input_format = av_find_input_format(format.c_str())))
+        return AVERROR_DEMUXER_NOT_FOUND;
+#ifdef _WIN32
+    _setmode(fd, _O_BINARY);
+#endif
+
+    *format_ctx = avformat_alloc_context();
+    StreamSource *source = new StreamSource{fd, follow};
+    unsigned char *buffer = (unsigned char*) av_malloc(STREAM_BUFFER_SIZE);
+    AVIOContext *avio = buffer ? avio_alloc_context(buffer, STREAM_BUFFER_SIZE, 0, source, read_stream, nullptr, nullptr) : nullptr;
+    if (!*format_ctx || !avio) {
+        avformat_free_context(*format_ctx);
+        *format_ctx = nullptr;
+        av_free(buffer);
+        delete source;
+        return AVERROR(ENOMEM);
+    }
+    (*format_ctx)->pb = avio;
+    (*format_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // On failure the format context is freed, but the custom AVIO context is still ours
+    int rc = avformat_open_input(format_ctx, nullptr, input_format, nullptr);
+    if (rc < 0) {
+        av_freep(&avio->buffer);
+        avio_context_free(&avio);
+        delete source;
+    }
+    return rc;
+}
+
+void close_stream_input(AVFormatContext **format_ctx)
+{
+    AVIOContext *avio = (*format_ctx)->pb;
+    avformat_close_input(format_ctx);
+    if (avio) {
+        delete (StreamSource*) avio->opaque;
+        av_freep(&avio->buffer);
+        avio_context_free(&avio);
+    }
+}
+
+// Set up the conversion of a decoder's output to OUTPUT_FORMAT
+static int init_swr(AVCodecContext *codec_ctx, SwrContext **swr)
+{
+#if OLD_CHANNEL_LAYOUT
+    if (!codec_ctx->channel_layout)
+        codec_ctx->channel_layout = av_get_default_channel_layout(codec_ctx->channels);
+    *swr = swr_alloc_set_opts(nullptr,
+             codec_ctx->channel_layout,
+             OUTPUT_FORMAT,
+             codec_ctx->sample_rate,
+             codec_ctx->channel_layout,
+             codec_ctx->sample_fmt,
+             codec_ctx->sample_rate,
+             0,
+             nullptr
+         );
+#else
+    swr_alloc_set_opts2(swr,
+        &codec_ctx->ch_layout,
+        OUTPUT_FORMAT,
+        codec_ctx->sample_rate,
+        &codec_ctx->ch_layout,
+        codec_ctx->sample_fmt,
+        codec_ctx->sample_rate,
+        0,
+        nullptr
+    );
+#endif
+    return *swr ? swr_init(*swr) : AVERROR(ENOMEM);
+}
+
+static int get_nb_channels(const AVCodecContext *codec_ctx)
+{
+#if OLD_CHANNEL_LAYOUT
+    return codec_ctx->channels;
+#else
+    return codec_ctx->ch_layout.nb_channels;
+#endif
+}
+
+static int get_nb_channels(const AVFrame *frame)
+{
+#if OLD_CHANNEL_LAYOUT
+    return frame->channels;
+#else
+    return frame->ch_layout.nb_channels;
+#endif
+}
+
+// An audio stream other than the best one, decoded alongside it with Config::all_streams
+struct ExtraStream {
+    int index;
+    AVCodecContext *codec_ctx = nullptr;
+    SwrContext *swr = nullptr;
+    ebur128_state *ebur128 = nullptr;
+    int nb_channels = 0;
+    int64_t nb_samples = 0;
+};
+
+static int open_extra_stream(const AVStream *stream, int peak_mode, bool dual_mono, ExtraStream &extra)
+{
+    int rc;
+    const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (!codec)
+        return AVERROR_DECODER_NOT_FOUND;
+    if (!(extra.codec_ctx = avcodec_alloc_context3(codec)))
+        return AVERROR(ENOMEM);
+    avcodec_parameters_to_context(extra.codec_ctx, stream->codecpar);
+    if ((rc = avcodec_open2(extra.codec_ctx, codec, nullptr)) < 0)
+        return rc;
+    if (extra.codec_ctx->sample_fmt != OUTPUT_FORMAT && (rc = init_swr(extra.codec_ctx, &extra.swr)) < 0)
+        return rc;
+    extra.nb_channels = get_nb_channels(extra.codec_ctx);
+    extra.ebur128 = ebur128_init((unsigned int) extra.nb_channels, (size_t) extra.codec_ctx->sample_rate, EBUR128_MODE_I | peak_mode);
+    if (!extra.ebur128)
+        return AVERROR(ENOMEM);
+    if (extra.nb_channels == 1 && dual_mono)
+        ebur128_set_channel(extra.ebur128, 0, EBUR128_DUAL_MONO);
+    return 0;
+}
+
+static void close_extra_stream(ExtraStream &extra)
+{
+    if (extra.codec_ctx)
+        avcodec_free_context(&extra.codec_ctx);
+    if (extra.swr)
+        swr_free(&extra.swr);
+    free_ebur128(extra.ebur128);
+}
+
+// Packets that fail to decode are skipped, like for the best stream
+static int decode_extra_stream(ExtraStream &extra, const AVPacket *packet, AVFrame *frame)
+{
+    if (avcodec_send_packet(extra.codec_ctx, packet) != 0)
+        return 0;
+    while (avcodec_receive_frame(extra.codec_ctx, frame) >= 0) {
+        if (get_nb_channels(frame) == extra.nb_channels) {
+            if (extra.swr) {
+                uint8_t *out;
+                if (av_samples_alloc(&out, nullptr, extra.nb_channels, frame->nb_samples, OUTPUT_FORMAT, 0) < 0) {
+                    av_frame_unref(frame);
+                    return AVERROR(ENOMEM);
+                }
+                int rc = swr_convert(extra.swr, &out, frame->nb_samples, (const uint8_t**) frame->data, frame->nb_samples);
+                if (rc >= 0)
+                    ebur128_add_frames_short(extra.ebur128, (short*) out, static_cast<size_t>(frame->nb_samples));
+                av_freep(&out);
+                if (rc < 0) {
+                    av_frame_unref(frame);
+                    return rc;
+                }
+            }
+            else
+                ebur128_add_frames_short(extra.ebur128, (short*) frame->data[0], static_cast<size_t>(frame->nb_samples));
+            extra.nb_samples += frame->nb_samples;
+        }
+        av_frame_unref(frame);
+    }
+    return 0;
+}
+
+// The highest peak of all channels
+static double max_peak(ebur128_state *ebur128, bool true_peak)
+{
+    std::vector<double> peaks(ebur128->channels);
+    int (*get_peak)(ebur128_state*, unsigned int, double*) = true_peak ? ebur128_true_peak : ebur128_sample_peak;
+    for (unsigned int channel = 0; channel < ebur128->channels; channel++)
+        get_peak(ebur128, channel, &peaks[channel]);
+    return *std::max_element(peaks.begin(), peaks.end());
+}
+
+// Analyzes tracks with many channels on several threads. libebur128 can't merge the
+// gating blocks of separate states, so the K-weighted loudness of all channels stays in
+// one state on the decoding thread, while the peak measurement, which is the per-channel
+// work that dominates with true peak, is fanned out over groups of channels. A sample peak
+// is too cheap to be worth the hand-off, so this is only used with true peak. The audio
+// is handed over in blocks of PARALLEL_BLOCK_SECONDS to keep the synchronization cheap
+#define PARALLEL_BLOCK_SECONDS 1
+class ParallelAnalyzer {
+    private:
+        ScanJob::Track &track;
+        const Config &config;
+        ebur128_state *loudness;
+        unsigned int nb_channels;
+        std::vector<short> buffer;
+        size_t nb_frames = 0;
+        struct Group {
+            unsigned int first;
+            ebur128_state *ebur128;
+            std::vector<short> samples;
+        };
+        std::vector<Group> groups;
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::condition_variable done_cv;
+        size_t generation = 0;
+        size_t pending = 0;
+        bool done = false;
+
+        void work(Group &group);
+        void analyze(Group &group);
+
+    public:
+        ParallelAnalyzer(ScanJob::Track &track, const Config &config, ebur128_state *loudness, unsigned int nb_channels, unsigned int sample_rate, size_t nb_groups)
+        : track(track), config(config), loudness(loudness), nb_channels(nb_channels), buffer((size_t) sample_rate * PARALLEL_BLOCK_SECONDS * nb_channels)
+        {
+            // Every channel is unused for K-weighting, so only the peaks are measured
+            int peak_mode = config.true_peak ? EBUR128_MODE_TRUE_PEAK : EBUR128_MODE_SAMPLE_PEAK;
+            nb_groups = std::min<size_t>(nb_groups, nb_channels);
+            for (size_t i = 0; i < nb_groups; i++) {
+                unsigned int first = (unsigned int) (i * nb_channels / nb_groups);
+                unsigned int count = (unsigned int) ((i + 1) * nb_channels / nb_groups) - first;
+                ebur128_state *ebur128 = ebur128_init(count, sample_rate, peak_mode);
+                if (!ebur128) {
+                    for (Group &group : groups)
+                        free_ebur128(group.ebur128);
+                    groups.clear();
+                    break;
+                }
+                for (unsigned int ch = 0; ch < count; ch++)
+                    ebur128_set_channel(ebur128, ch, EBUR128_UNUSED);
+                groups.push_back({first, ebur128, std::vector<short>(buffer.size() / nb_channels * count)});
+            }
+            for (Group &group : groups)
+                threads.emplace_back([this, &group]() {
+                    Trace::set_thread_name("Channel worker");
+                    work(group);
+                });
+        }
+
+        ~ParallelAnalyzer()
+        {
+            {
+                std::lock_guard lock(mutex);
+                done = true;
+            }
+            cv.notify_all();
+            for (std::thread &thread : threads)
+                thread.join();
+            for (Group &group : groups)
+                free_ebur128(group.ebur128);
+        }
+
+        bool valid() const { return !groups.empty(); }
+        void add_frames(const short *samples, size_t count);
+        void flush();
+        double peak();
+};
+
+void ParallelAnalyzer::work(Group &group)
+{
+    size_t seen = 0;
+    std::unique_lock lock(mutex);
+    while (true) {
+        cv.wait(lock, [&]() { return done || generation != seen; });
+        if (done)
+            return;
+        seen = generation;
+        lock.unlock();
+        analyze(group);
+        lock.lock();
+        if (!--pending)
+            done_cv.notify_one();
+    }
+}
+
+// Deinterleave the group's channels of the buffered block
+void ParallelAnalyzer::analyze(Group &group)
+{
+    unsigned int count = group.ebur128->channels;
+    const short *in = buffer.data() + group.first;
+    short *out = group.samples.data();
+    for (size_t i = 0; i < nb_frames; i++, in += nb_channels, out += count)
+        std::copy(in, in + count, out);
+    ebur128_add_frames_short(group.ebur128, group.samples.data(), nb_frames);
+}
+
+void ParallelAnalyzer::add_frames(const short *samples, size_t count)
+{
+    size_t capacity = buffer.size() / nb_channels;
+    while (count) {
+        size_t n = std::min(count, capacity - nb_frames);
+        std::copy(samples, samples + n * nb_channels, buffer.begin() + (ptrdiff_t) (nb_frames * nb_channels));
+        nb_frames += n;
+        samples += n * nb_channels;
+        count -= n;
+        if (nb_frames == capacity)
+            flush();
+    }
+}
+
+// The loudness is analyzed on this thread while the workers measure the peaks
+void ParallelAnalyzer::flush()
+{
+    if (!nb_frames)
+        return;
+    {
+        std::lock_guard lock(mutex);
+        generation++;
+        pending = groups.size();
+    }
+    cv.notify_all();
+    track.add_frames(loudness, buffer.data(), nb_frames, nb_channels, config);
+    std::unique_lock lock(mutex);
+    done_cv.wait(lock, [this]() { return !pending; });
+    nb_frames = 0;
+}
+
+double ParallelAnalyzer::peak()
+{
+    double peak = 0.0;
+    for (const Group &group : groups)
+        peak = std::max(peak, max_peak(group.ebur128, config.true_peak));
+    return peak;
+}
+
+static std::string stream_metadata(const AVStream *stream, const char *key)
+{
+    const AVDictionaryEntry *entry = av_dict_get(stream->metadata, key, nullptr, 0);
+    return entry ? entry->value : "";
+}
+
+
 void free_ebur128(ebur128_state *ebur128_state)
 {
     if (ebur128_state)
@@ -154,11 +667,18 @@ void free_ebur128(ebur128_state *ebur128_state)
 
 bool ScanJob::scan(std::mutex *ffmpeg_mutex)
 {
+    TraceScope scope("ScanJob", &path);
+    if (config.tag_mode == 'r')
+        return retag();
     if (config.tag_mode != 'd') {
         if (config.skip_existing) {
             std::vector<int> existing;
             for (auto track = tracks.rbegin(); track != tracks.rend(); ++track) {
-                if (tag_exists(*track))
+                TraceScope trace("tag_exists", &track->path);
+                auto t = std::chrono::steady_clock::now();
+                bool exists = tag_exists(*track);
+                track->timings.tag_exists = lap(t);
+                if (exists)
                     existing.push_back((int) (tracks.rend() - track - 1));
             }
             size_t nb_exists = existing.size();
@@ -177,16 +697,31 @@ bool ScanJob::scan(std::mutex *ffmpeg_mutex)
                 }
             }
         }
-        ScanReturn ret;
-        std::vector<size_t> remove;
+        group_cue_tracks();
+        std::vector<ScanReturn> ret(tracks.size(), ScanReturn::SUCCESS);
+        if (nb_threads > 1 && tracks.size() > 1)
+            scan_parallel(ffmpeg_mutex, ret);
+        else {
+            for (Track &track : tracks) {
+                ret[&track - &tracks[0]] = track.scan(config, ffmpeg_mutex, interactive);
+                if (ret[&track - &tracks[0]] == ScanReturn::ERR)
+                    break;
+            }
+        }
+
+        // The tracks of a CUE sheet image share the result of decoding it
         for (Track &track : tracks) {
-            ret = track.scan(config, ffmpeg_mutex);
-            if (ret == ScanReturn::ERR) {
-                error = true;
+            for (const Track *t : track.cue_tracks)
+                ret[t - &tracks[0]] = ret[&track - &tracks[0]];
+        }
+        std::vector<size_t> remove;
+        for (size_t i = 0; i < tracks.size(); i++) {
+            if (ret[i] == ScanReturn::ERR) {
+                report_error(tracks[i]);
                 return false;
             }
-            else if (ret == ScanReturn::NO_STREAM)
-                remove.push_back(&track - &tracks[0]);
+            else if (ret[i] == ScanReturn::NO_STREAM)
+                remove.push_back(i);
         }
         for (auto it = remove.rbegin(); it != remove.rend(); ++it) {
             tracks.erase(tracks.begin() + *it);
@@ -199,19 +734,120 @@ bool ScanJob::scan(std::mutex *ffmpeg_mutex)
     return true;
 }
 
-ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
+// Recalculate the gains from the loudness and peaks stored in the tags instead of decoding
+bool ScanJob::retag()
+{
+    for (Track &track : tracks) {
+        TraceScope trace("read_stored_loudness", &track.path);
+        if (track.cue_number) {
+            track.error = rsgain::format("'{}' is from a CUE sheet, which can't be retagged", track.display_name());
+            report_error(track);
+            return false;
+        }
+        if (config.preserve_mtimes) {
+            track.mtime = std::filesystem::last_write_time(track.path);
+        }
+        if (!read_stored_loudness(track, config.do_album)) {
+            track.error = rsgain::format("Missing or invalid stored loudness in '{}', it must be scanned with loudness storage enabled first", track.path.string());
+            report_error(track);
+            return false;
+        }
+
+        // Ogg files are tagged according to their codec, which only needs the container headers
+        if (track.type == FileType::OGG) {
+            AVFormatContext *format_ctx = nullptr;
+            if (avformat_open_input(&format_ctx, rsgain::format("file:{}", track.path.string()).c_str(), nullptr, nullptr) == 0) {
+                int stream_id = av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+                if (stream_id >= 0)
+                    track.codec_id = format_ctx->streams[stream_id]->codecpar->codec_id;
+                avformat_close_input(&format_ctx);
+            }
+        }
+    }
+    calculate_loudness();
+    tag_tracks();
+    return true;
+}
+
+// Tracks of the same CUE sheet image are decoded together by the first of them
+void ScanJob::group_cue_tracks()
+{
+    std::unordered_map<std::string, Track*> images;
+    for (Track &track : tracks) {
+        track.cue_tracks.clear();
+        if (track.cue_number)
+            images.try_emplace(track.path.string(), &track).first->second->cue_tracks.push_back(&track);
+    }
+    for (auto &[image, track] : images)
+        std::sort(track->cue_tracks.begin(), track->cue_tracks.end(), [](const Track *a, const Track *b) { return a->cue_start < b->cue_start; });
+}
+
+std::string ScanJob::Track::display_name(bool filename_only) const
+{
+    std::string name = filename_only ? path.filename().string() : path.string();
+    return cue_number ? rsgain::format("{} [{:02}]", name, cue_number) : name;
+}
+
+// Scan the tracks on nb_threads threads. Each result lands in the track's own slot,
+// so the order of the tracks, and therefore of the output, doesn't depend on timing
+void ScanJob::scan_parallel(std::mutex *ffmpeg_mutex, std::vector<ScanReturn> &ret)
+{
+    std::mutex local_mutex;
+    if (!ffmpeg_mutex)
+        ffmpeg_mutex = &local_mutex;
+    std::atomic<size_t> next = 0;
+    std::atomic<bool> failed = false;
+    auto work = [&]() {
+        size_t i;
+        while (!failed && (i = next++) < tracks.size()) {
+            ret[i] = tracks[i].scan(config, ffmpeg_mutex, false);
+            if (ret[i] == ScanReturn::ERR)
+                failed = true;
+        }
+    };
+    if (interactive && config.tag_mode != 'd')
+        output_ok("Scanning {} files with {} threads...", tracks.size(), std::min(nb_threads, tracks.size()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(nb_threads, tracks.size()); i++)
+        threads.emplace_back([&]() {
+            Trace::set_thread_name("Track worker");
+            work();
+        });
+    work();
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m, bool interactive)
 {
     ProgressBar progress_bar;
     int rc, stream_id = -1;
     uint8_t *swr_out_data[1];
     ScanReturn ret = ScanReturn::ERR;
     bool repeat = false;
+    bool stop = false;
     int peak_mode;
     double time_base;
-    bool output_progress = !quiet && !multithread && config.tag_mode != 'd';
+    bool output_progress = interactive && config.tag_mode != 'd';
     std::unique_lock<std::mutex> *lk = nullptr;
     ebur128_state *ebur128 = nullptr;
     int nb_channels;
+    int64_t nb_samples = 0;
+    const auto start_time = std::chrono::steady_clock::now();
+    auto t = start_time;
+
+    // A CUE sheet image is analyzed with one scanner per track
+    if (cue_number && cue_tracks.empty())
+        return ScanReturn::SUCCESS;
+    const std::vector<Track*> targets = cue_tracks.empty() ? std::vector<Track*>{this} : cue_tracks;
+    std::vector<ebur128_state*> states;
+    std::vector<ebur128_state*> chapter_states;
+    std::vector<ExtraStream> extra_streams;
+    std::unique_ptr<ParallelAnalyzer> parallel;
+    size_t segment = 0;
+    size_t chapter = 0;
+    TraceScope trace("Track::scan", &path);
+    TraceScope phase("open");
 
 #if LIBAVCODEC_VERSION_MAJOR >= 59 
     const 
@@ -223,15 +859,66 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
     SwrContext *swr = nullptr;
     AVFormatContext *format_ctx = nullptr;
     const AVStream *stream = nullptr;
-    if (config.preserve_mtimes) {
-        mtime = std::make_unique<std::filesystem::file_time_type>();
-        *mtime = std::filesystem::last_write_time(path);
+
+    // Chapters are analyzed on top of the whole file, by the same sample position routing
+    auto add_chapter_frames = [&](const short *samples, size_t nb_frames) {
+        int64_t position = nb_samples;
+        while (nb_frames && chapter < chapters.size()) {
+            int64_t start = (int64_t) std::round(chapters[chapter].start * codec_ctx->sample_rate);
+            int64_t end = (int64_t) std::round(chapters[chapter].end * codec_ctx->sample_rate);
+            if (position >= end) {
+                chapter++;
+                continue;
+            }
+            size_t n = (size_t) std::min<int64_t>((position < start ? start : end) - position, (int64_t) nb_frames);
+            if (position >= start)
+                ebur128_add_frames_short(chapter_states[chapter], samples, n);
+            samples += n * (size_t) nb_channels;
+            nb_frames -= n;
+            position += (int64_t) n;
+        }
+    };
+
+    // Audio of a CUE sheet image goes to the scanner of the track it belongs to. Audio
+    // outside of every track, like a hidden pregap, isn't analyzed
+    auto analyze = [&](const short *samples, size_t nb_frames) {
+        if (cue_tracks.empty()) {
+            if (parallel)
+                parallel->add_frames(samples, nb_frames);
+            else
+                add_frames(ebur128, samples, nb_frames, (unsigned int) nb_channels, config);
+            add_chapter_frames(samples, nb_frames);
+            return;
+        }
+        auto to_samples = [&](int64_t frames) { return frames * codec_ctx->sample_rate / CUE_FRAMES_PER_SECOND; };
+        int64_t position = nb_samples;
+        while (nb_frames && segment < targets.size()) {
+            Track *track = targets[segment];
+            int64_t start = to_samples(track->cue_start);
+            int64_t end = track->cue_end < 0 ? INT64_MAX : to_samples(track->cue_end);
+            if (position >= end) {
+                segment++;
+                continue;
+            }
+            size_t n = (size_t) std::min<int64_t>((position < start ? start : end) - position, (int64_t) nb_frames);
+            if (position >= start) {
+                track->add_frames(states[segment], samples, n, (unsigned int) nb_channels, config);
+                track->duration += (double) n / (double) codec_ctx->sample_rate;
+            }
+            samples += n * (size_t) nb_channels;
+            nb_frames -= n;
+            position += (int64_t) n;
+        }
+    };
+
+    if (config.preserve_mtimes && fd < 0) {
+        mtime = std::filesystem::last_write_time(path);
     }
 
     // For Opus files, FFmpeg always adjusts the decoded audio samples by the header output
     // gain with no way to disable. To get the actual loudness of the audio signal,
     // we need to set the header output gain to 0 dB before decoding
-    if (type == FileType::OPUS && config.tag_mode != 's')
+    if (type == FileType::OPUS && config.tag_mode != 's' && !cue_number)
         set_opus_header_gain(path.string().c_str(), 0);
     
     if (m)
@@ -239,12 +926,19 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
     if (output_progress)
         output_ok("Scanning '{}'", path.string());
 
-    if (lk)
+    if (lk) {
+        timings.open += lap(t);
+        phase.begin("ffmpeg_lock");
         lk->lock();
-    rc = avformat_open_input(&format_ctx, rsgain::format("file:{}", path.string()).c_str(), nullptr, nullptr);
+        timings.lock_wait += lap(t);
+        phase.begin("open");
+    }
+    if (fd >= 0)
+        rc = open_stream_input(&format_ctx, fd, format, follow);
+    else
+        rc = avformat_open_input(&format_ctx, rsgain::format("file:{}", path.string()).c_str(), nullptr, nullptr);
     if (rc < 0) {
-        if (!multithread)
-            output_fferror(rc, "Could not open input");
+        error = fferror(rc, "Could not open input");
         goto end;
     }
 
@@ -254,15 +948,14 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
 
     rc = avformat_find_stream_info(format_ctx, nullptr);
     if (rc < 0) {
-        if (!multithread)
-            output_fferror(rc, "Could not find stream info");
+        error = fferror(rc, "Could not find stream info");
         goto end;
     }
 
     // Select the best audio stream
     stream_id = av_find_best_stream(format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
     if (stream_id < 0) {
-        if (!multithread)
+        if (interactive)
             output_warn("Could not find audio stream\n");
         ret = ScanReturn::NO_STREAM;
         goto end;
@@ -274,8 +967,7 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
     do {
         codec_ctx = avcodec_alloc_context3(codec);
         if (!codec_ctx) {
-            if (!multithread)
-                output_error("Could not allocate audio codec context");
+            error = "Could not allocate audio codec context";
             goto end;
         }
         avcodec_parameters_to_context(codec_ctx, stream->codecpar);
@@ -299,18 +991,13 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
                     }
                 }
             }
-            if (!multithread)
-                output_fferror(rc, "Could not open codec");
+            error = fferror(rc, "Could not open codec");
             goto end;
         }
         repeat = false;
     } while (repeat);
     codec_id = codec->id;
-#if OLD_CHANNEL_LAYOUT
-    nb_channels = codec_ctx->channels;
-#else
-    nb_channels = codec_ctx->ch_layout.nb_channels;
-#endif
+    nb_channels = get_nb_channels(codec_ctx);
 
     // Display some information about the file
     if (output_progress)
@@ -323,76 +1010,94 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
         );
 
     // Only initialize swresample if we need to convert the format
-    if (codec_ctx->sample_fmt != OUTPUT_FORMAT) {
-#if OLD_CHANNEL_LAYOUT
-        if (!codec_ctx->channel_layout)
-            codec_ctx->channel_layout = av_get_default_channel_layout(codec_ctx->channels);
-        swr = swr_alloc_set_opts(nullptr,
-                 codec_ctx->channel_layout,
-                 OUTPUT_FORMAT,
-                 codec_ctx->sample_rate,
-                 codec_ctx->channel_layout,
-                 codec_ctx->sample_fmt,
-                 codec_ctx->sample_rate,
-                 0,
-                 nullptr
-             );
-#else
-        swr_alloc_set_opts2(&swr,
-            &codec_ctx->ch_layout,
-            OUTPUT_FORMAT,
-            codec_ctx->sample_rate,
-            &codec_ctx->ch_layout,
-            codec_ctx->sample_fmt,
-            codec_ctx->sample_rate,
-            0,
-            nullptr
+    if (codec_ctx->sample_fmt != OUTPUT_FORMAT && (rc = init_swr(codec_ctx, &swr)) < 0) {
+        error = fferror(rc, "Could not open libswresample context");
+        goto end;
+    }
+
+    if (lk)
+        lk->unlock();
+
+    // Initialize libebur128. With many channels, the true peaks can be measured on other threads
+    peak_mode = config.true_peak ? EBUR128_MODE_TRUE_PEAK : EBUR128_MODE_SAMPLE_PEAK;
+    peak_measured = config.channel_threads > 1 && config.true_peak && nb_channels >= PARALLEL_MIN_CHANNELS && cue_tracks.empty() && !on_frames;
+    for (size_t i = 0; i < targets.size(); i++) {
+        ebur128 = ebur128_init((unsigned int) nb_channels,
+            (size_t) codec_ctx->sample_rate,
+            EBUR128_MODE_I | (peak_measured ? 0 : peak_mode) | ebur128_mode | (config.loudness_range ? EBUR128_MODE_LRA : 0)
         );
-#endif
-        if (!swr) {
-            if (!multithread)
-                output_error("Could not allocate libswresample context");
+        if (!ebur128) {
+            error = "Could not initialize libebur128 scanner";
             goto end;
         }
-
-        rc = swr_init(swr);
-        if (rc < 0) {
-            if (!multithread)
-                output_fferror(rc, "Could not open libswresample context");
+        if (nb_channels == 1 && config.dual_mono)
+            ebur128_set_channel(ebur128, 0, EBUR128_DUAL_MONO);
+        states.push_back(ebur128);
+    }
+    ebur128 = states[0];
+    if (peak_measured) {
+        parallel = std::make_unique<ParallelAnalyzer>(*this, config, ebur128, (unsigned int) nb_channels, (unsigned int) codec_ctx->sample_rate, config.channel_threads - 1);
+        if (!parallel->valid()) {
+            error = "Could not initialize libebur128 scanner";
             goto end;
         }
+        if (output_progress)
+            output_ok("Analyzing {} channels on {} threads", nb_channels, config.channel_threads);
     }
 
-    if (lk)
-        lk->unlock();
+    // Chapters get their own scanners, fed alongside the one for the whole file
+    chapters.clear();
+    if (config.chapters && cue_tracks.empty()) {
+        for (unsigned int i = 0; i < format_ctx->nb_chapters; i++) {
+            const AVChapter *c = format_ctx->chapters[i];
+            const AVDictionaryEntry *title = av_dict_get(c->metadata, "title", nullptr, 0);
+            chapters.push_back({
+                .title = title ? title->value : "",
+                .start = (double) c->start * av_q2d(c->time_base),
+                .end = (double) c->end * av_q2d(c->time_base),
+                .loudness = -HUGE_VAL,
+                .peak = 0.0
+            });
+        }
+        std::sort(chapters.begin(), chapters.end(), [](const auto &a, const auto &b) { return a.start < b.start; });
+        for (size_t i = 0; i < chapters.size(); i++) {
+            ebur128_state *state = ebur128_init((unsigned int) nb_channels, (size_t) codec_ctx->sample_rate, EBUR128_MODE_I | peak_mode);
+            if (!state) {
+                error = "Could not initialize libebur128 scanner";
+                goto end;
+            }
+            if (nb_channels == 1 && config.dual_mono)
+                ebur128_set_channel(state, 0, EBUR128_DUAL_MONO);
+            chapter_states.push_back(state);
+        }
+    }
 
-    // Initialize libebur128
-    peak_mode = config.true_peak ? EBUR128_MODE_TRUE_PEAK : EBUR128_MODE_SAMPLE_PEAK;
-    ebur128 = ebur128_init((unsigned int) nb_channels,
-        (size_t) codec_ctx->sample_rate,
-        EBUR128_MODE_I | peak_mode
-    );
-    if (!ebur128) {
-        if (!multithread)
-            output_error("Could not initialize libebur128 scanner");
-        goto end;
+    // The other audio streams get their own decoders and scanners, fed from the same read loop
+    streams.clear();
+    if (config.all_streams && cue_tracks.empty()) {
+        for (unsigned int i = 0; i < format_ctx->nb_streams; i++) {
+            if ((int) i == stream_id || format_ctx->streams[i]->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+                continue;
+            ExtraStream &extra = extra_streams.emplace_back();
+            extra.index = (int) i;
+            if ((rc = open_extra_stream(format_ctx->streams[i], peak_mode, config.dual_mono, extra)) < 0) {
+                error = fferror(rc, rsgain::format("Could not open audio stream #{}", i));
+                goto end;
+            }
+        }
     }
-    if (nb_channels == 1 && config.dual_mono)
-        ebur128_set_channel(ebur128, 0, EBUR128_DUAL_MONO);
 
     // Allocate AVPacket structure
     packet = av_packet_alloc();
     if (!packet) {
-        if (!multithread)
-            output_error("Could not allocate packet");
+        error = "Could not allocate packet";
         goto end;
     }
 
     // Alocate AVFrame structure
     frame = av_frame_alloc();
     if (!frame) {
-        if (!multithread)
-            output_error("Could not allocate frame");
+        error = "Could not allocate frame";
         goto end;
     }
 
@@ -406,16 +1111,15 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
             progress_bar.begin(start, (int) std::round((double) stream->duration * time_base));
         }
     }
-    
-    while (av_read_frame(format_ctx, packet) == 0) {
+    timings.open += lap(t);
+    phase.begin("decode");
+
+    while (!stop && av_read_frame(format_ctx, packet) == 0) {
         if (packet->stream_index == stream_id) {
             if ((rc = avcodec_send_packet(codec_ctx, packet)) == 0) {
-                while ((rc = avcodec_receive_frame(codec_ctx, frame)) >= 0) {
-#if OLD_CHANNEL_LAYOUT
-                    if (frame->channels == nb_channels) {
-#else
-                    if (frame->ch_layout.nb_channels == nb_channels) {
-#endif
+                while (!stop && (rc = avcodec_receive_frame(codec_ctx, frame)) >= 0) {
+                    if (get_nb_channels(frame) == nb_channels) {
+                        timings.decode += lap(t);
                         // Convert audio format with libswresample if necessary
                         if (swr) {
                             size_t out_size = static_cast<size_t>(
@@ -428,20 +1132,24 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
                             );
                             swr_out_data[0] = (uint8_t*) av_malloc(out_size);
                             if (swr_convert(swr, swr_out_data, frame->nb_samples, (const uint8_t**) frame->data, frame->nb_samples) < 0) {
-                                if (!multithread)
-                                    output_error("Could not convert audio frame");
+                                error = "Could not convert audio frame";
                                 av_free(swr_out_data[0]);
                                 goto end;
                             }
+                            timings.convert += lap(t);
 
-                            ebur128_add_frames_short(ebur128, (short*) swr_out_data[0], static_cast<size_t>(frame->nb_samples));
+                            analyze((short*) swr_out_data[0], static_cast<size_t>(frame->nb_samples));
                             av_free(swr_out_data[0]);
                         }
 
                         // Audio is already in correct format
                         else
-                            ebur128_add_frames_short(ebur128, (short*) frame->data[0], static_cast<size_t>(frame->nb_samples));
+                            analyze((short*) frame->data[0], static_cast<size_t>(frame->nb_samples));
+                        timings.analyze += lap(t);
 
+                        nb_samples += frame->nb_samples;
+                        if (on_frames && !on_frames(ebur128, static_cast<size_t>(frame->nb_samples)))
+                            stop = true;
                         if (output_progress) {
                             int pos = (int) std::round((double) frame->pts * time_base);
                             if (pos >= 0)
@@ -452,32 +1160,119 @@ ScanReturn ScanJob::Track::scan(const Config &config, std::mutex *m)
                 }
             }
         }
+        else if (!extra_streams.empty()) {
+            auto extra = std::find_if(extra_streams.begin(), extra_streams.end(), [&](const ExtraStream &e) { return e.index == packet->stream_index; });
+            if (extra != extra_streams.end() && (rc = decode_extra_stream(*extra, packet, frame)) < 0) {
+                error = fferror(rc, rsgain::format("Could not decode audio stream #{}", extra->index));
+                goto end;
+            }
+        }
         av_packet_unref(packet);
     }
 
+    timings.decode += lap(t);
+    if (parallel) {
+        parallel->flush();
+        result.track_peak = parallel->peak();
+        timings.analyze += lap(t);
+    }
+
     // Make sure the progress bar finishes at 100%
     if (output_progress)
         progress_bar.complete();
 
+    if (cue_tracks.empty())
+        duration = (double) nb_samples / (double) codec_ctx->sample_rate;
+    for (Track *track : targets) {
+        track->container = container;
+        track->codec_id = codec_id;
+    }
+    if (format_ctx->pb)
+        bytes_read = format_ctx->pb->bytes_read;
+    if (config.all_streams && cue_tracks.empty()) {
+        for (unsigned int i = 0; i < format_ctx->nb_streams; i++) {
+            const AVStream *s = format_ctx->streams[i];
+            if (s->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+                continue;
+            auto extra = std::find_if(extra_streams.begin(), extra_streams.end(), [&](const ExtraStream &e) { return e.index == (int) i; });
+            ebur128_state *state = (int) i == stream_id ? ebur128 : extra->ebur128;
+            StreamResult &result = streams.emplace_back();
+            result.index = (int) i;
+            result.codec = avcodec_get_name(s->codecpar->codec_id);
+            result.language = stream_metadata(s, "language");
+            result.title = stream_metadata(s, "title");
+            result.channels = (int) state->channels;
+            result.duration = (int) i == stream_id ? (double) nb_samples / (double) codec_ctx->sample_rate : (double) extra->nb_samples / (double) state->samplerate;
+            if (ebur128_loudness_global(state, &result.loudness) != EBUR128_SUCCESS)
+                result.loudness = -HUGE_VAL;
+
+            // The peaks of the best stream were measured by the channel workers, not its loudness state
+            if (result.loudness == -HUGE_VAL)
+                result.peak = 0.0;
+            else if ((int) i == stream_id && parallel)
+                result.peak = parallel->peak();
+            else
+                result.peak = max_peak(state, config.true_peak);
+            result.gain = result.loudness == -HUGE_VAL ? 0.0 : config.target_loudness - result.loudness;
+        }
+    }
+    for (size_t i = 0; i < chapter_states.size(); i++) {
+        if (ebur128_loudness_global(chapter_states[i], &chapters[i].loudness) != EBUR128_SUCCESS)
+            chapters[i].loudness = -HUGE_VAL;
+        chapters[i].peak = chapters[i].loudness == -HUGE_VAL ? 0.0 : max_peak(chapter_states[i], config.true_peak);
+    }
     ret = ScanReturn::SUCCESS;
 end:
     av_packet_free(&packet);
     av_frame_free(&frame);
     if (codec_ctx)
         avcodec_free_context(&codec_ctx);
-    if (format_ctx)
-        avformat_close_input(&format_ctx);
+    if (format_ctx) {
+        if (fd >= 0)
+            close_stream_input(&format_ctx);
+        else
+            avformat_close_input(&format_ctx);
+    }
     if (swr)
         swr_free(&swr);
 
-    // Use a smart pointer to manage the remaining lifetime of the ebur128 state
-    if (ebur128) 
-        this->ebur128 = std::unique_ptr<ebur128_state, decltype(&free_ebur128)>(ebur128, free_ebur128);
+    // Use a smart pointer to manage the remaining lifetime of the ebur128 states
+    for (size_t i = 0; i < states.size(); i++)
+        targets[i]->ebur128 = std::unique_ptr<ebur128_state, decltype(&free_ebur128)>(states[i], free_ebur128);
+    for (ebur128_state *state : chapter_states)
+        free_ebur128(state);
+    for (ExtraStream &extra : extra_streams)
+        close_extra_stream(extra);
+    parallel.reset();
     
     delete lk;
+    timings.scan = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
     return ret;
 }
 
+void ScanJob::report_error(const Track &track)
+{
+    error = true;
+    if (on_error)
+        on_error(track.path, track.error);
+}
+
+// Reduce gain so that peak doesn't exceed the max peak level once the gain is applied
+static void protect_clipping(char clip_mode, double max_peak_level, double peak, double &gain, bool &clip)
+{
+    if (clip_mode == 'n' || (clip_mode == 'p' && gain <= 0.0))
+        return;
+    double max_peak = pow(10.0, max_peak_level / 20.0);
+    double new_peak = pow(10.0, gain / 20.0) * peak;
+    if (new_peak > max_peak) {
+        double adjustment = 20.0 * log10(new_peak / max_peak);
+        if (clip_mode == 'p' && adjustment > gain)
+            adjustment = gain;
+        gain -= adjustment;
+        clip = true;
+    }
+}
+
 void ScanJob::calculate_loudness()
 {
     if (tracks.empty())
@@ -492,95 +1287,136 @@ void ScanJob::calculate_loudness()
         calculate_album_loudness();
 
     // Check clipping conditions
-    if (config.clip_mode != 'n') {
-        double t_new_peak; // Track peak after application of gain
-        double a_new_peak; // Album peak after application of gain
-        double max_peak = pow(10.0, config.max_peak_level / 20.0);
-
-        // Track clipping
+    for (Track &track : tracks)
+        protect_clipping(config.clip_mode, config.max_peak_level, track.result.track_peak, track.result.track_gain, track.tclip);
+    if (config.do_album) {
+        double album_gain = tracks[0].result.album_gain;
+        bool aclip = false;
+        protect_clipping(config.clip_mode, config.max_peak_level, tracks[0].result.album_peak, album_gain, aclip);
         for (Track &track : tracks) {
-            if (config.clip_mode == 'a' || (config.clip_mode == 'p' && (track.result.track_gain > 0.0))) {
-                t_new_peak = pow(10.0, track.result.track_gain / 20.0) * track.result.track_peak;
-                if (t_new_peak > max_peak) {
-                    double adjustment = 20.0 * log10(t_new_peak / max_peak);
-                    if (config.clip_mode == 'p' && adjustment > track.result.track_gain)
-                        adjustment = track.result.track_gain;
-                    track.result.track_gain -= adjustment;
-                    track.tclip = true;
-                }
-            }
+            track.result.album_gain = album_gain;
+            track.aclip = aclip;
         }
+    }
 
-        // Album clipping
-        double album_gain = tracks[0].result.album_gain;
-        double album_peak = tracks[0].result.album_peak;
-        if (config.do_album && (config.clip_mode == 'a' || (config.clip_mode == 'p' && album_gain > 0.0))) {
-            a_new_peak = pow(10.0, album_gain / 20.0) * album_peak;
-            if (a_new_peak > max_peak) {
-                double adjustment = 20.0 * log10(a_new_peak / max_peak);
-                if (config.clip_mode == 'p' && adjustment > album_gain)
-                    adjustment = album_gain;
-                for (Track &track : tracks) {
-                    track.result.album_gain -= adjustment;
-                    track.aclip = true;
-                }
-            }
+    // The profiles reuse the measured loudness, only the target and peak limit differ
+    for (const Profile &profile : config.profiles) {
+        double max_peak_level = profile.max_peak_level.value_or(config.max_peak_level);
+        double album_gain = 0.0;
+        bool aclip = false;
+        if (config.do_album) {
+            const ScanResult &result = tracks[0].result;
+            if (std::isfinite(result.album_loudness))
+                album_gain = profile.target_loudness - result.album_loudness;
+            protect_clipping(config.clip_mode, max_peak_level, result.album_peak, album_gain, aclip);
+        }
+        for (Track &track : tracks) {
+            ProfileResult &p = track.profiles.emplace_back();
+            p.track_gain = std::isfinite(track.result.track_loudness) ? profile.target_loudness - track.result.track_loudness : 0.0;
+            p.tclip = false;
+            protect_clipping(config.clip_mode, max_peak_level, track.result.track_peak, p.track_gain, p.tclip);
+            p.album_gain = album_gain;
+            p.aclip = aclip;
         }
     }
 }
 
+template<typename It>
+static void format_range(It out, double range, double max_momentary, double max_shortterm)
+{
+    rsgain::format_to(out, "\t{:.2f}\t", range);
+    max_momentary == -HUGE_VAL ? rsgain::format_to(out, "-∞\t") : rsgain::format_to(out, "{:.2f}\t", max_momentary);
+    max_shortterm == -HUGE_VAL ? rsgain::format_to(out, "-∞") : rsgain::format_to(out, "{:.2f}", max_shortterm);
+}
+
+static std::string format_timestamp(double seconds)
+{
+    int64_t ms = (int64_t) std::round(seconds * 1000.0);
+    return rsgain::format("{}:{:02}:{:02}.{:03}", ms / 3600000, ms / 60000 % 60, ms / 1000 % 60, ms % 1000);
+}
+
+static std::string format_lufs(double loudness)
+{
+    return loudness == -HUGE_VAL ? "-∞" : rsgain::format("{:.2f}", loudness);
+}
+
+std::string ScanJob::tab_header(const Config &config)
+{
+    std::string header;
+    if (config.sep_header)
+        header += "sep=\t\n";
+    header += "Filename\tLoudness (LUFS)\tGain (dB)\tPeak\t Peak (dB)\tPeak Type\tClipping Adjustment?";
+    if (config.loudness_range)
+        header += "\tLoudness Range (LU)\tMax Momentary (LUFS)\tMax Short-term (LUFS)";
+    for (const Profile &profile : config.profiles)
+        header += rsgain::format("\t{} Gain (dB)\t{} Clipping Adjustment?", profile.name, profile.name);
+    header += "\n";
+    return header;
+}
+
 void ScanJob::tag_tracks()
 {
     if (tracks.empty())
         return;
-    std::FILE *stream = nullptr;
-    if (config.tab_output != OutputType::NONE) {
-        if (config.tab_output == OutputType::FILE) {
-            std::filesystem::path output_file = path / "replaygain.csv";
-            stream = fopen(output_file.string().c_str(), "wb");
-        }
-        else
-            stream = stdout;
 
-        if (stream) {
-            if (config.sep_header)
-                fputs("sep=\t\n", stream);
-            fputs("Filename\tLoudness (LUFS)\tGain (dB)\tPeak\t Peak (dB)\tPeak Type\tClipping Adjustment?\n", stream);
-        }
-    }
+    // Tab-delimited rows are collected for the whole job and handed to the writer as one block
+    std::string block;
+    auto out = std::back_inserter(block);
+    bool tab_output = config.tab_output != OutputType::NONE && writer != nullptr;
+    if (tab_output && config.tab_output == OutputType::FILE)
+        block = tab_header(config);
+    std::string json_block;
+    bool json_output = json_writer != nullptr && config.tag_mode != 'd';
+
+    auto album_max = [this](double ScanResult::*field) {
+        double max = -HUGE_VAL;
+        for (const Track &track : tracks)
+            max = std::max(max, track.result.*field);
+        return max;
+    };
 
     // Tag the files
-    bool tab_output = config.tab_output != OutputType::NONE && stream != nullptr;
-    bool human_output = !multithread && !quiet && config.tag_mode != 'd';
+    bool human_output = interactive && config.tag_mode != 'd';
     if (config.sort_alphanum)
-        std::sort(tracks.begin(), tracks.end(), [](const auto &a, const auto &b){ return a.path.string() < b.path.string(); });
+        std::stable_sort(tracks.begin(), tracks.end(), [](const auto &a, const auto &b){ return a.path.string() < b.path.string(); });
     for (Track &track : tracks) {
-        if (config.tag_mode != 's')
-            error |= !tag_track(track, config);
+        if (config.tag_mode != 's' && !track.cue_number) {
+            TraceScope trace("tag", &track.path);
+            if (!tag_track(track, config))
+                report_error(track);
+        }
+        if (json_output)
+            format_json(json_block, track);
 
         if (tab_output) {
             // Filename;Loudness;Gain (dB);Peak;Peak (dB);Peak Type;Clipping Adjustment;
-            rsgain::print(stream, "{}\t", track.path.filename().string());
-            track.result.track_loudness == -HUGE_VAL ? rsgain::print(stream, "-∞\t") : rsgain::print(stream, "{:.2f}\t", track.result.track_loudness);
-            rsgain::print(stream, "{:.2f}\t", track.result.track_gain);
-            rsgain::print(stream, "{:.6f}\t", track.result.track_peak);
-            track.result.track_peak == 0.0 ? rsgain::print(stream, "-∞\t") : rsgain::print(stream, "{:.2f}\t", 20.0 * log10(track.result.track_peak));
-            rsgain::print(stream, "{}\t", config.true_peak ? "True" : "Sample");
-            rsgain::print(stream, "{}\n", track.tclip ? "Y" : "N");
+            rsgain::format_to(out, "{}\t", track.display_name(config.tab_output != OutputType::CONSOLIDATED));
+            track.result.track_loudness == -HUGE_VAL ? rsgain::format_to(out, "-∞\t") : rsgain::format_to(out, "{:.2f}\t", track.result.track_loudness);
+            rsgain::format_to(out, "{:.2f}\t{:.6f}\t", track.result.track_gain, track.result.track_peak);
+            track.result.track_peak == 0.0 ? rsgain::format_to(out, "-∞\t") : rsgain::format_to(out, "{:.2f}\t", 20.0 * log10(track.result.track_peak));
+            rsgain::format_to(out, "{}\t{}", config.true_peak ? "True" : "Sample", track.tclip ? "Y" : "N");
+            if (config.loudness_range)
+                format_range(out, track.result.track_range, track.result.max_momentary, track.result.max_shortterm);
+            for (const ProfileResult &p : track.profiles)
+                rsgain::format_to(out, "\t{:.2f}\t{}", p.track_gain, p.tclip ? "Y" : "N");
+            rsgain::format_to(out, "\n");
             if (config.do_album && ((size_t) (&track - &tracks[0]) == (nb_files - 1))) {
-                rsgain::print(stream, "{}\t", "Album");
-                track.result.album_loudness == -HUGE_VAL ? rsgain::print(stream, "-∞\t") : rsgain::print(stream, "{:.2f}\t", track.result.album_loudness);
-                rsgain::print(stream, "{:.2f}\t", track.result.album_gain);
-                rsgain::print(stream, "{:.6f}\t", track.result.album_peak);
-                track.result.album_peak == 0.0 ? rsgain::print(stream, "-∞\t") : rsgain::print(stream, "{:.2f}\t", 20.0 * log10(track.result.album_peak));
-                rsgain::print(stream, "{}\t", config.true_peak ? "True" : "Sample");
-                rsgain::print(stream, "{}\n", track.aclip ? "Y" : "N");
+                rsgain::format_to(out, "{}\t", config.tab_output == OutputType::CONSOLIDATED ? path.string() : "Album");
+                track.result.album_loudness == -HUGE_VAL ? rsgain::format_to(out, "-∞\t") : rsgain::format_to(out, "{:.2f}\t", track.result.album_loudness);
+                rsgain::format_to(out, "{:.2f}\t{:.6f}\t", track.result.album_gain, track.result.album_peak);
+                track.result.album_peak == 0.0 ? rsgain::format_to(out, "-∞\t") : rsgain::format_to(out, "{:.2f}\t", 20.0 * log10(track.result.album_peak));
+                rsgain::format_to(out, "{}\t{}", config.true_peak ? "True" : "Sample", track.aclip ? "Y" : "N");
+                if (config.loudness_range)
+                    format_range(out, track.result.album_range, album_max(&ScanResult::max_momentary), album_max(&ScanResult::max_shortterm));
+                for (const ProfileResult &p : track.profiles)
+                    rsgain::format_to(out, "\t{:.2f}\t{}", p.album_gain, p.aclip ? "Y" : "N");
+                rsgain::format_to(out, "\n");
             }
         } 
         
         // Human-readable output
         if (human_output) {
-            rsgain::print("\nTrack: {}\n", track.path.string());
+            rsgain::print("\nTrack: {}\n", track.display_name());
             rsgain::print("  Loudness: {} LUFS\n", track.result.track_loudness == -HUGE_VAL ? "   -∞" : rsgain::format("{:8.2f}", track.result.track_loudness));
             rsgain::print("  Peak:     {:8.6f} ({} dB)\n",
                 track.result.track_peak,
@@ -591,6 +1427,41 @@ void ScanJob::tag_tracks()
                 track.type == FileType::OPUS && (config.opus_mode == 'r' || config.opus_mode == 's') ? rsgain::format("({})", GAIN_TO_Q78(track.result.track_gain)) : "",
                 track.tclip ? " (adjusted to prevent clipping)" : ""
             );
+            if (config.loudness_range) {
+                rsgain::print("  Range:    {:8.2f} LU\n", track.result.track_range);
+                rsgain::print("  Max M/S:  {} / {} LUFS\n", format_lufs(track.result.max_momentary), format_lufs(track.result.max_shortterm));
+            }
+            for (const ProfileResult &p : track.profiles) {
+                const Profile &profile = config.profiles[&p - &track.profiles[0]];
+                rsgain::print("  {}: {:8.2f} dB at {} LUFS{}\n", profile.name, p.track_gain, profile.target_loudness, p.tclip ? " (adjusted to prevent clipping)" : "");
+            }
+            if (!track.streams.empty()) {
+                rsgain::print("  Streams:\n");
+                for (const StreamResult &st : track.streams) {
+                    rsgain::print("  {:4}  {:<8} {} ch  {:>6} LUFS  {:8.6f}  {:6.2f} dB  {}{}\n",
+                        st.index,
+                        st.codec,
+                        st.channels,
+                        format_lufs(st.loudness),
+                        st.peak,
+                        st.gain,
+                        st.language.empty() ? "" : rsgain::format("[{}] ", st.language),
+                        st.title
+                    );
+                }
+            }
+            if (!track.chapters.empty()) {
+                rsgain::print("  Chapters:\n");
+                for (const ChapterResult &c : track.chapters) {
+                    rsgain::print("  {:4}  {}  {:>6} LUFS  {:8.6f}  {}\n",
+                        &c - &track.chapters[0] + 1,
+                        format_timestamp(c.start),
+                        format_lufs(c.loudness),
+                        c.peak,
+                        c.title
+                    );
+                }
+            }
 
             if (config.do_album && ((size_t) (&track - &tracks[0]) == (nb_files - 1))) {
                 rsgain::print("\nAlbum:\n");
@@ -604,12 +1475,174 @@ void ScanJob::tag_tracks()
                     type == FileType::OPUS && (config.opus_mode == 'r' || config.opus_mode == 's') ? rsgain::format("({})", GAIN_TO_Q78(track.result.album_gain)) : "",
                     track.aclip ? " (adjusted to prevent clipping)" : ""
                 );
+                if (config.loudness_range) {
+                    rsgain::print("  Range:    {:8.2f} LU\n", track.result.album_range);
+                    rsgain::print("  Max M/S:  {} / {} LUFS\n", format_lufs(album_max(&ScanResult::max_momentary)), format_lufs(album_max(&ScanResult::max_shortterm)));
+                }
+                for (const ProfileResult &p : track.profiles) {
+                    const Profile &profile = config.profiles[&p - &track.profiles[0]];
+                    rsgain::print("  {}: {:8.2f} dB at {} LUFS{}\n", profile.name, p.album_gain, profile.target_loudness, p.aclip ? " (adjusted to prevent clipping)" : "");
+                }
             }
             rsgain::print("\n");
         }
     }
-    if (config.tab_output == OutputType::FILE && stream != nullptr)
-        fclose(stream);
+
+    // The gains of CUE sheet tracks are written to their sheet
+    if (config.tag_mode != 's') {
+        std::map<std::filesystem::path, std::vector<const Track*>> sheets;
+        for (const Track &track : tracks) {
+            if (track.cue_number)
+                sheets[track.cue_sheet].push_back(&track);
+        }
+        for (const auto &[sheet, sheet_tracks] : sheets) {
+            TraceScope trace("tag_cue_sheet", &sheet);
+            if (!tag_cue_sheet(sheet, sheet_tracks, config)) {
+                error = true;
+                if (on_error)
+                    on_error(sheet, "Could not write ReplayGain comments to CUE sheet");
+            }
+        }
+    }
+    if (tab_output) {
+        if (config.tab_output == OutputType::FILE)
+            writer->write(path / "replaygain.csv", std::move(block));
+        else
+            writer->write(std::move(block));
+    }
+    if (json_output) {
+        if (config.do_album) {
+            const ScanResult &result = tracks[0].result;
+            auto out = std::back_inserter(json_block);
+            rsgain::format_to(out,
+                "{{\"type\":\"album\",\"path\":{},\"tracks\":{},\"album_gain\":{},\"album_peak\":{},\"album_loudness\":{},\"album_clip\":{},\"peak_type\":\"{}\"",
+                json_string(path.string()),
+                tracks.size(),
+                json_number(result.album_gain),
+                json_number(result.album_peak),
+                json_number(result.album_loudness),
+                tracks[0].aclip,
+                config.true_peak ? "true" : "sample"
+            );
+            if (config.loudness_range) {
+                rsgain::format_to(out, ",\"album_range\":{},\"max_momentary\":{},\"max_short_term\":{}",
+                    json_number(result.album_range),
+                    json_number(album_max(&ScanResult::max_momentary)),
+                    json_number(album_max(&ScanResult::max_shortterm))
+                );
+            }
+            if (!tracks[0].profiles.empty()) {
+                rsgain::format_to(out, ",\"profiles\":[");
+                for (const ProfileResult &p : tracks[0].profiles) {
+                    const Profile &profile = config.profiles[&p - &tracks[0].profiles[0]];
+                    rsgain::format_to(out, "{}{{\"name\":{},\"target_loudness\":{},\"album_gain\":{},\"album_clip\":{}}}",
+                        &p == &tracks[0].profiles[0] ? "" : ",",
+                        json_string(profile.name),
+                        json_number(profile.target_loudness),
+                        json_number(p.album_gain),
+                        p.aclip
+                    );
+                }
+                rsgain::format_to(out, "]");
+            }
+            rsgain::format_to(out, "}}\n");
+        }
+        json_writer->write(std::move(json_block));
+    }
+}
+
+// Append one JSON Lines record for a track
+void ScanJob::format_json(std::string &block, const Track &track)
+{
+    const ScanResult &result = track.result;
+    auto out = std::back_inserter(block);
+    rsgain::format_to(out,
+        "{{\"type\":\"track\",\"path\":{},\"codec\":{},\"container\":{},\"duration\":{},\"bytes_read\":{},"
+        "\"track_gain\":{},\"track_peak\":{},\"track_loudness\":{},\"track_clip\":{},\"peak_type\":\"{}\"",
+        json_string(track.path.string()),
+        json_string(avcodec_get_name(static_cast<AVCodecID>(track.codec_id))),
+        json_string(track.container),
+        json_number(track.duration),
+        track.bytes_read,
+        json_number(result.track_gain),
+        json_number(result.track_peak),
+        json_number(result.track_loudness),
+        track.tclip,
+        config.true_peak ? "true" : "sample"
+    );
+    if (track.cue_number)
+        rsgain::format_to(out, ",\"cue_sheet\":{},\"cue_track\":{}", json_string(track.cue_sheet.string()), track.cue_number);
+    if (config.do_album) {
+        rsgain::format_to(out, ",\"album_gain\":{},\"album_peak\":{},\"album_loudness\":{},\"album_clip\":{}",
+            json_number(result.album_gain),
+            json_number(result.album_peak),
+            json_number(result.album_loudness),
+            track.aclip
+        );
+        if (config.loudness_range)
+            rsgain::format_to(out, ",\"album_range\":{}", json_number(result.album_range));
+    }
+    if (config.loudness_range) {
+        rsgain::format_to(out, ",\"track_range\":{},\"max_momentary\":{},\"max_short_term\":{}",
+            json_number(result.track_range),
+            json_number(result.max_momentary),
+            json_number(result.max_shortterm)
+        );
+    }
+    if (!track.profiles.empty()) {
+        rsgain::format_to(out, ",\"profiles\":[");
+        for (const ProfileResult &p : track.profiles) {
+            const Profile &profile = config.profiles[&p - &track.profiles[0]];
+            rsgain::format_to(out, "{}{{\"name\":{},\"target_loudness\":{},\"track_gain\":{},\"track_clip\":{}",
+                &p == &track.profiles[0] ? "" : ",",
+                json_string(profile.name),
+                json_number(profile.target_loudness),
+                json_number(p.track_gain),
+                p.tclip
+            );
+            if (config.do_album)
+                rsgain::format_to(out, ",\"album_gain\":{},\"album_clip\":{}", json_number(p.album_gain), p.aclip);
+            rsgain::format_to(out, "}}");
+        }
+        rsgain::format_to(out, "]");
+    }
+    if (!track.streams.empty()) {
+        rsgain::format_to(out, ",\"streams\":[");
+        for (const StreamResult &st : track.streams) {
+            rsgain::format_to(out, "{}{{\"index\":{},\"codec\":{},\"language\":{},\"title\":{},\"channels\":{},\"duration\":{},\"loudness\":{},\"peak\":{},\"gain\":{}}}",
+                &st == &track.streams[0] ? "" : ",",
+                st.index,
+                json_string(st.codec),
+                json_string(st.language),
+                json_string(st.title),
+                st.channels,
+                json_number(st.duration),
+                json_number(st.loudness),
+                json_number(st.peak),
+                json_number(st.gain)
+            );
+        }
+        rsgain::format_to(out, "]");
+    }
+    if (!track.chapters.empty()) {
+        rsgain::format_to(out, ",\"chapters\":[");
+        for (const ChapterResult &c : track.chapters) {
+            rsgain::format_to(out, "{}{{\"title\":{},\"start\":{},\"end\":{},\"loudness\":{},\"peak\":{}}}",
+                &c == &track.chapters[0] ? "" : ",",
+                json_string(c.title),
+                json_number(c.start),
+                json_number(c.end),
+                json_number(c.loudness),
+                json_number(c.peak)
+            );
+        }
+        rsgain::format_to(out, "]");
+    }
+    const Timings &t = track.timings;
+    rsgain::format_to(out,
+        ",\"timings\":{{\"open\":{},\"decode\":{},\"convert\":{},\"analyze\":{},\"lock_wait\":{},\"scan\":{},\"tag_exists\":{},\"tag\":{},\"mtime\":{}}}}}\n",
+        t.open, t.decode, t.convert, t.analyze, t.lock_wait, t.scan, t.tag_exists, t.tag, t.mtime
+    );
 }
 
 void ScanJob::update_data(ScanData &data)
@@ -629,6 +1662,15 @@ void ScanJob::update_data(ScanData &data)
             data.clipping_adjustments++;
     }
 
+    // Collect performance stats
+    for (const Track &track : tracks) {
+        FileStats &stats = data.file_stats[static_cast<size_t>(track.type)];
+        stats.files++;
+        stats.duration += track.duration;
+        stats.bytes += track.bytes_read;
+        stats.timings += track.timings;
+    }
+
     if (config.tag_mode != 'd') {
         for (const Track &track : tracks) {
             data.total_gain += track.result.track_gain;
@@ -640,46 +1682,77 @@ void ScanJob::update_data(ScanData &data)
     }
 }
 
+// With loudness_range, the audio is fed in 100 ms hops so the momentary and short-term
+// maxima are sampled at every hop of their sliding windows, like a meter would
+void ScanJob::Track::add_frames(ebur128_state *ebur128, const short *samples, size_t nb_frames, unsigned int nb_channels, const Config &config)
+{
+    if (!config.loudness_range) {
+        ebur128_add_frames_short(ebur128, samples, nb_frames);
+        return;
+    }
+    size_t hop = std::max(ebur128->samplerate / 10, 1ul);
+    double loudness;
+    while (nb_frames) {
+        size_t n = std::min(hop, nb_frames);
+        ebur128_add_frames_short(ebur128, samples, n);
+        if (ebur128_loudness_momentary(ebur128, &loudness) == EBUR128_SUCCESS && loudness > result.max_momentary)
+            result.max_momentary = loudness;
+        if (ebur128_loudness_shortterm(ebur128, &loudness) == EBUR128_SUCCESS && loudness > result.max_shortterm)
+            result.max_shortterm = loudness;
+        samples += n * nb_channels;
+        nb_frames -= n;
+    }
+}
+
 void ScanJob::Track::calculate_loudness(const Config &config)
 {
-    unsigned int channel = 0;
-    double track_loudness, track_peak;
+    // Without a scanner state, the loudness and peak were read from the tags
+    if (ebur128) {
+        double track_loudness;
+        if (ebur128_loudness_global(ebur128.get(), &track_loudness) != EBUR128_SUCCESS)
+            track_loudness = config.target_loudness;
+        result.track_loudness = track_loudness;
 
-    if (ebur128_loudness_global(ebur128.get(), &track_loudness) != EBUR128_SUCCESS)
-        track_loudness = config.target_loudness;
+        // Edge case for completely silent tracks
+        if (track_loudness == -HUGE_VAL)
+            result.track_peak = 0.0;
+        else if (!peak_measured)
+            result.track_peak = max_peak(ebur128.get(), config.true_peak);
 
-    // Edge case for completely silent tracks
-    if (track_loudness == -HUGE_VAL) {
-        result.track_gain = 0.0;
-        result.track_peak = 0.0;
-        result.track_loudness = -HUGE_VAL;
+        if (config.loudness_range && ebur128_loudness_range(ebur128.get(), &result.track_range) != EBUR128_SUCCESS)
+            result.track_range = 0.0;
+        result.has_track_range = config.loudness_range;
     }
 
-    else {
-        std::vector<double> peaks(ebur128->channels);
-        int (*get_peak)(ebur128_state*, unsigned int, double*) = config.true_peak ? ebur128_true_peak : ebur128_sample_peak;
-        for (double &pk : peaks)
-            get_peak(ebur128.get(), channel++, &pk);
-        track_peak = *std::max_element(peaks.begin(), peaks.end());
-
+    if (result.track_loudness == -HUGE_VAL)
+        result.track_gain = 0.0;
+    else
         result.track_gain = (type == FileType::OPUS && config.opus_mode == 's' ? -23.0 : config.target_loudness)
-                             - track_loudness;
-        result.track_peak = track_peak;
-        result.track_loudness = track_loudness;
-    }
+                             - result.track_loudness;
+    profiles.clear();
 }
 
 void ScanJob::calculate_album_loudness() 
 {
     double album_loudness, album_peak;
-    size_t nb_states = tracks.size();
-    std::vector<ebur128_state*> states(nb_states);
-    for (const Track &track : tracks)
-        if (track.result.track_loudness != -HUGE_VAL)
-            states.emplace_back(track.ebur128.get());
+    double album_range = 0.0;
 
-    if (ebur128_loudness_global_multiple(states.data(), states.size(), &album_loudness) != EBUR128_SUCCESS)
-        album_loudness = config.target_loudness;
+    // When retagging there are no scanner states, the loudness and range were read from the tags
+    const bool retag = config.tag_mode == 'r';
+    if (retag)
+        album_loudness = tracks[0].result.album_loudness;
+    else {
+        std::vector<ebur128_state*> states;
+        states.reserve(tracks.size());
+        for (const Track &track : tracks)
+            if (track.result.track_loudness != -HUGE_VAL)
+                states.emplace_back(track.ebur128.get());
+
+        if (ebur128_loudness_global_multiple(states.data(), states.size(), &album_loudness) != EBUR128_SUCCESS)
+            album_loudness = config.target_loudness;
+        if (config.loudness_range && ebur128_loudness_range_multiple(states.data(), states.size(), &album_range) != EBUR128_SUCCESS)
+            album_range = 0.0;
+    }
 
     album_peak = std::max_element(tracks.begin(),
                      tracks.end(),
@@ -692,5 +1765,9 @@ void ScanJob::calculate_album_loudness()
         track.result.album_gain = album_gain;
         track.result.album_peak = album_peak;
         track.result.album_loudness = album_loudness;
+        if (!retag) {
+            track.result.album_range = album_range;
+            track.result.has_album_range = config.loudness_range;
+        }
     }
 }
@@ -1,10 +1,80 @@
 #pragma once
 
 #include <mutex>
+#include <signal.h>
+#include <array>
+#include <string>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <cmath>
 #include <vector>
+#include <optional>
 #include <filesystem>
 #include <ebur128.h>
 
+class OutputWriter;
+struct AVFormatContext;
+
+#define RG_TARGET_LOUDNESS -18.0
+#define PARALLEL_MIN_CHANNELS 6
+
+// Memory estimates for --memory-limit. The duration of a track is bounded by
+// assuming the lowest bitrate that albums are commonly encoded at
+#define MIN_BYTES_PER_SECOND 8000
+#define DECODER_MEMORY (8 << 20)             // Demuxer, decoder and resampler buffers
+#define STATE_MEMORY (48000 * 2 * 8)         // ebur128 audio buffer per second of window, 48 kHz stereo
+#define BLOCK_MEMORY_PER_SECOND 640          // ebur128 keeps 10 gating blocks a second for I and for LRA
+#define HISTOGRAM_MEMORY (2 * 1000 * 8)      // ebur128 histograms for I and LRA
+#define ID3V2_KEEP 0
+
+enum class OutputType{
+	NONE,
+	STDOUT,
+	FILE,
+	CONSOLIDATED
+};
+
+// An extra loudness target whose gains are calculated alongside the main one
+struct Profile {
+	std::string name;
+	double target_loudness;
+	std::optional<double> max_peak_level; // Defaults to Config::max_peak_level
+};
+
+struct Config {
+	char tag_mode;
+	bool skip_existing;
+	double target_loudness;
+	double max_peak_level;
+	bool true_peak;
+	char clip_mode;
+	bool do_album;
+	OutputType tab_output;
+	bool sep_header;
+	bool sort_alphanum;
+	bool lowercase;
+	unsigned int id3v2version;
+	char opus_mode;
+	bool skip_mp4;
+	bool preserve_mtimes;
+	bool dual_mono;
+	bool loudness_range; // Also measure LRA and max momentary/short-term loudness
+	bool store_loudness; // Write the measured loudness to tags so tag mode 'r' can recalculate the gains
+	bool chapters;       // Also measure each chapter of files with a chapter table
+	bool all_streams;    // Also measure the audio streams other than the best one
+	unsigned int channel_threads; // Threads to analyze tracks with PARALLEL_MIN_CHANNELS or more with true peak, 0 or 1 to disable
+	std::vector<Profile> profiles;
+};
+
+// Returns the time since t in seconds and resets t to now
+inline double lap(std::chrono::steady_clock::time_point &t)
+{
+	const auto now = std::chrono::steady_clock::now();
+	const double elapsed = std::chrono::duration<double>(now - t).count();
+	t = now;
+	return elapsed;
+}
 void free_ebur128(ebur128_state *ebur128);
 
 enum class FileType {
@@ -22,9 +92,25 @@ enum class FileType {
     WAVPACK,
     APE,
 	TAK,
-	MPC
+	MPC,
+	MAX_VAL
 };
 
+// One configuration per file type, indexed by FileType
+using ConfigTable = std::array<Config, static_cast<size_t>(FileType::MAX_VAL)>;
+FileType determine_filetype(const std::string &extension);
+double estimate_scan_cost(FileType type, uintmax_t size, const Config &config);
+
+// Audio can also be read from a pipe: "-" is stdin and "pipe:N" is file descriptor N.
+// Returns the descriptor, or -1 if the name is a regular path
+int parse_stream_name(const std::string &name);
+
+// Open a demuxer reading from fd through a custom AVIO context, optionally forcing the container
+// format since a pipe can't be probed by extension. If follow is set, EOF waits for more data
+// until *follow becomes nonzero, like tail -f. Must be closed with close_stream_input
+int open_stream_input(AVFormatContext **format_ctx, int fd, const std::string &format, const volatile sig_atomic_t *follow = nullptr);
+void close_stream_input(AVFormatContext **format_ctx);
+
 struct ScanResult {
 	double track_gain;
 	double track_peak;
@@ -33,6 +119,81 @@ struct ScanResult {
 	double album_gain;
 	double album_peak;
 	double album_loudness;
+
+	// Only measured with Config::loudness_range
+	double track_range = 0.0;           // LRA in LU
+	double max_momentary = -HUGE_VAL;   // LUFS
+	double max_shortterm = -HUGE_VAL;
+	double album_range = 0.0;
+
+	// Whether the ranges were measured, or read back from the tags in tag mode 'r'
+	bool has_track_range = false;
+	bool has_album_range = false;
+};
+
+// Loudness of one chapter, measured with Config::chapters
+struct ChapterResult {
+	std::string title;
+	double start;     // Seconds
+	double end;
+	double loudness;  // LUFS
+	double peak;
+};
+
+// One audio stream of a file, measured with Config::all_streams
+struct StreamResult {
+	int index;         // Stream index in the container
+	std::string codec;
+	std::string language;
+	std::string title;
+	int channels;
+	double duration;
+	double loudness;   // LUFS
+	double peak;
+	double gain;       // To the target loudness, without clipping protection
+};
+
+// Gains for one Config::profiles entry, after clipping protection
+struct ProfileResult {
+	double track_gain;
+	double album_gain;
+	bool tclip;
+	bool aclip;
+};
+
+// Wall-clock time spent in each stage of processing a track, in seconds
+struct Timings {
+	double open = 0.0;        // Open, probe, and decoder setup
+	double decode = 0.0;
+	double convert = 0.0;     // Sample format conversion
+	double analyze = 0.0;     // Loudness analysis
+	double tag_exists = 0.0;
+	double tag = 0.0;
+	double mtime = 0.0;       // Restoring the modification time
+	double lock_wait = 0.0;   // Waiting for the FFmpeg mutex
+	double scan = 0.0;        // Total time in Track::scan
+
+	Timings& operator+=(const Timings &t)
+	{
+		open += t.open;
+		decode += t.decode;
+		convert += t.convert;
+		analyze += t.analyze;
+		tag_exists += t.tag_exists;
+		tag += t.tag;
+		mtime += t.mtime;
+		lock_wait += t.lock_wait;
+		scan += t.scan;
+		return *this;
+	}
+};
+
+// Throughput statistics for one file type
+struct FileStats {
+	size_t files = 0;
+	double duration = 0.0;
+	int64_t bytes = 0;
+	Timings timings;
 };
 
 enum class ScanReturn {
@@ -51,6 +212,8 @@ struct ScanData {
     size_t total_negative = 0;
     size_t total_positive = 0;
     std::vector<std::string> error_directories;
+    std::array<FileStats, static_cast<size_t>(FileType::MAX_VAL)> file_stats;
+    double main_lock_wait = 0.0;
 };
 
 
@@ -60,16 +223,42 @@ class ScanJob {
 			std::filesystem::path path;
 			FileType type;
 			std::unique_ptr<ebur128_state, decltype(&free_ebur128)> ebur128;
-			std::unique_ptr<std::filesystem::file_time_type> mtime;
+			std::optional<std::filesystem::file_time_type> mtime;
 			std::string container;
 			ScanResult result;
-			int codec_id;
+			std::vector<ProfileResult> profiles; // Parallel to Config::profiles
+			std::vector<ChapterResult> chapters;
+			std::vector<StreamResult> streams;  // All audio streams, including the one that was tagged
+			Timings timings;
+			double duration = 0.0;
+			int64_t bytes_read = 0;
+			int codec_id = 0;
 			bool tclip = false;
 			bool aclip = false;
+			std::string error;
+			int fd = -1;        // Read from this descriptor instead of opening path
+			std::string format; // Container hint for fd
+			const volatile sig_atomic_t *follow = nullptr; // See open_stream_input
+			int ebur128_mode = 0; // Modes added to the scanner's, e.g. EBUR128_MODE_HISTOGRAM for unbounded input
+			bool peak_measured = false; // result.track_peak was measured outside of ebur128
+
+			// Tracks of a CUE sheet image. The first of them decodes the image for all of them
+			std::filesystem::path cue_sheet;
+			int cue_number = 0;    // TRACK number, 0 if not from a CUE sheet
+			int64_t cue_start = 0; // INDEX 01 in CD frames
+			int64_t cue_end = -1;  // Start of the next track, -1 for the end of the image
+			std::vector<Track*> cue_tracks; // Set on the track that decodes the image
+
+			// Called after each decoded frame is analyzed. Returning false stops decoding early
+			std::function<bool(ebur128_state *ebur128, size_t nb_frames)> on_frames;
 
 			Track(const std::filesystem::path &path, FileType type) : path(path), type(type), ebur128(nullptr, free_ebur128) {};
-			ScanReturn scan(const Config &config, std::mutex *ffmpeg_mutex);
+			ScanReturn scan(const Config &config, std::mutex *ffmpeg_mutex, bool interactive);
 			void calculate_loudness(const Config &config);
+			void add_frames(ebur128_state *ebur128, const short *samples, size_t nb_frames, unsigned int nb_channels, const Config &config);
+
+			// The path, with the track number for CUE sheet tracks
+			std::string display_name(bool filename_only = false) const;
 		};
 
 		std::filesystem::path path;
@@ -79,18 +268,34 @@ class ScanJob {
 		bool error = false;
 		size_t clipping_adjustments = 0;
 		size_t skipped = 0;
+		OutputWriter *writer = nullptr;
+		OutputWriter *json_writer = nullptr;
+		bool interactive = false; // Print status messages, progress bars and results to the console
+		size_t nb_threads = 1;    // Threads used to scan the tracks of this job
+		std::function<void(const std::filesystem::path&, const std::string&)> on_error;
 
 		ScanJob(const std::filesystem::path &path, std::vector<Track> &tracks, const Config &config, FileType &type) : path(path), nb_files(tracks.size()), config(config), type(type), tracks(std::move(tracks)) {}
 		ScanJob(std::vector<Track> &tracks, const Config &config, FileType type) : nb_files(tracks.size()), config(config), type(type), tracks(std::move(tracks)) {}
-		static ScanJob* factory(char **files, size_t nb_files, const Config &config);
-		static ScanJob* factory(const std::filesystem::path &path);
+		static ScanJob* factory(const std::vector<std::filesystem::path> &files, const Config &config, std::string &error, const std::string &stream_format = {});
+		static ScanJob* factory(const std::filesystem::path &path, const ConfigTable &configs);
+		static ScanJob* factory(const std::filesystem::path &path, const std::vector<std::filesystem::path> &files, const ConfigTable &configs);
+		static bool includes(const std::filesystem::path &file, const ConfigTable &configs);
+		static std::string tab_header(const Config &config);
+		size_t estimate_memory() const;
+		void use_histograms();
 		bool scan(std::mutex *ffmpeg_mutex = nullptr);
 		void update_data(ScanData &data);
+		const std::vector<Track>& get_tracks() const { return tracks; }
 
 	private:
 		std::vector<Track> tracks;
 
+		void scan_parallel(std::mutex *ffmpeg_mutex, std::vector<ScanReturn> &ret);
+		void group_cue_tracks();
+		bool retag();
 		void calculate_loudness();
 		void calculate_album_loudness();
 		void tag_tracks();
+		void report_error(const Track &track);
+		void format_json(std::string &block, const Track &track);
 };
@@ -0,0 +1,461 @@
+/*
+ * Daemon mode: keeps a warm worker pool and the loaded preset in memory and
+ * accepts scan and tag requests over a Unix domain socket.
+ *
+ * The protocol is line-delimited JSON. Each request is one object on one line:
+ *   {"id": 1, "command": "scan", "files": ["a.flac", "b.flac"], "album": true}
+ *   {"id": 2, "command": "tag", "directory": "/music/album"}
+ *   {"id": 3, "command": "reload", "preset": "ebur128"}
+ *   {"id": 4, "command": "status"}
+ *   {"id": 5, "command": "shutdown"}
+ * Every response line echoes the id of its request. Scans are acknowledged with
+ * a "queued" line, then produce one "track" line per file, "error" lines as
+ * needed, and a final "done" line. Responses of concurrent requests on the
+ * same connection may interleave, but lines never do.
+ */
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <optional>
+#include <filesystem>
+#include <string_view>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "rsgain.hpp"
+#include "easymode.hpp"
+#include "librsgain.hpp"
+#include "serve.hpp"
+#include "output.hpp"
+#include "json.hpp"
+#include "resources.hpp"
+#include "config.h"
+
+#define MAX_REQUEST_SIZE (16 * 1024 * 1024)
+#define POLL_INTERVAL 200
+
+static inline void help_serve();
+
+#ifndef _WIN32
+
+// A client connection. Whole lines are written under a lock so responses from
+// different workers never interleave, and the socket stays open until the last
+// pending request referencing the connection has finished
+class Connection {
+    private:
+        int fd;
+        std::mutex mutex;
+        bool closed = false;
+
+    public:
+        Connection(int fd) : fd(fd) {}
+        ~Connection() { close(fd); }
+        int get_fd() const { return fd; }
+        void stop() { shutdown(fd, SHUT_RD); }
+
+        void send(const std::string &line)
+        {
+            std::lock_guard lock(mutex);
+            for (size_t written = 0; !closed && written < line.size();) {
+                ssize_t n = write(fd, line.data() + written, line.size() - written);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    closed = true;
+                else
+                    written += (size_t) n;
+            }
+        }
+};
+
+class Server {
+    private:
+        std::filesystem::path socket_path;
+        std::filesystem::path preset;
+        rsgain::WorkerPool pool;
+        rsgain::Scanner scanner;
+        std::mutex config_mutex;
+        ConfigTable configs;
+        int listen_fd = -1;
+        std::atomic<bool> stopping = false;
+        std::mutex connections_mutex;
+        std::vector<std::weak_ptr<Connection>> connections;
+
+        // The reader threads are detached, so only their number is kept to wait for them
+        std::mutex readers_mutex;
+        std::condition_variable readers_cv;
+        size_t nb_readers = 0;
+
+        void read(std::shared_ptr<Connection> connection);
+        void handle(const std::shared_ptr<Connection> &connection, const std::string &line);
+        void submit(const std::shared_ptr<Connection> &connection, const std::string &id, const JsonValue &request, bool tag);
+        bool reload(const std::filesystem::path &new_preset);
+
+    public:
+        inline static volatile sig_atomic_t signalled = 0;
+
+        Server(const std::filesystem::path &socket_path, const std::filesystem::path &preset, size_t nb_threads)
+        : socket_path(socket_path), preset(preset), pool(nb_threads), scanner(&pool), configs(get_default_configs()) {}
+        bool start();
+        void run();
+};
+
+static std::string response(const std::string &id, const char *type, std::string_view fields = {})
+{
+    return rsgain::format("{{\"id\":{},\"type\":\"{}\"{}{}}}\n", id, type, fields.empty() ? "" : ",", fields);
+}
+
+static std::string error_response(const std::string &id, const std::string &message, const std::filesystem::path &path = {})
+{
+    return response(id, "error", path.empty() ? rsgain::format("\"message\":{}", json_string(message))
+        : rsgain::format("\"path\":{},\"message\":{}", json_string(path.string()), json_string(message)));
+}
+
+bool Server::reload(const std::filesystem::path &new_preset)
+{
+    ConfigTable table = get_default_configs();
+    if (!new_preset.empty() && !load_preset(new_preset, table))
+        return false;
+    std::lock_guard lock(config_mutex);
+    configs = table;
+    preset = new_preset;
+    return true;
+}
+
+bool Server::start()
+{
+    if (!reload(preset))
+        return false;
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    const std::string path = socket_path.string();
+    if (path.size() >= sizeof(address.sun_path)) {
+        output_fail("Socket path '{}' is too long", path);
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    // Remove a stale socket left by a previous instance
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path.c_str());
+
+    // Requests can tag any file that rsgain may write, so only the owner may connect. Nobody
+    // can connect before listen(), so the permissions are set in between
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr*) &address, sizeof(address)) < 0
+    || chmod(path.c_str(), S_IRUSR | S_IWUSR) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        output_fail("Could not listen on '{}': {}", path, strerror(errno));
+        return false;
+    }
+    output_ok("Listening on '{}' with {} threads", path, pool.size());
+    return true;
+}
+
+void Server::run()
+{
+    pollfd pfd = {listen_fd, POLLIN, 0};
+    while (!stopping && !signalled) {
+        int rc = poll(&pfd, 1, POLL_INTERVAL);
+        if (rc <= 0)
+            continue;
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+        auto connection = std::make_shared<Connection>(fd);
+        std::lock_guard lock(connections_mutex);
+        std::erase_if(connections, [](const auto &c) { return c.expired(); });
+        connections.push_back(connection);
+        {
+            std::lock_guard readers_lock(readers_mutex);
+            nb_readers++;
+        }
+        std::thread([this, connection]() {
+            read(connection);
+
+            // Notify under the lock, so the server can't be destroyed before this thread is done with it
+            std::lock_guard readers_lock(readers_mutex);
+            nb_readers--;
+            readers_cv.notify_all();
+        }).detach();
+    }
+
+    // Stop reading new requests, but finish the queued ones
+    output_ok("Shutting down...");
+    close(listen_fd);
+    unlink(socket_path.string().c_str());
+    {
+        std::lock_guard lock(connections_mutex);
+        for (const auto &c : connections) {
+            if (auto connection = c.lock())
+                connection->stop();
+        }
+    }
+    {
+        std::unique_lock lock(readers_mutex);
+        readers_cv.wait(lock, [&]() { return nb_readers == 0; });
+    }
+    pool.wait();
+}
+
+void Server::read(std::shared_ptr<Connection> connection)
+{
+    std::string buffer;
+    char chunk[65536];
+    ssize_t n;
+    while ((n = recv(connection->get_fd(), chunk, sizeof(chunk), 0)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        buffer.append(chunk, (size_t) n);
+        size_t start = 0, end;
+        while ((end = buffer.find('\n', start)) != std::string::npos) {
+            std::string line = buffer.substr(start, end - start);
+            start = end + 1;
+            if (line.find_first_not_of(" \t\r") != std::string::npos)
+                handle(connection, line);
+        }
+        buffer.erase(0, start);
+        if (buffer.size() > MAX_REQUEST_SIZE) {
+            connection->send(error_response("null", "Request is too large"));
+            break;
+        }
+    }
+}
+
+void Server::handle(const std::shared_ptr<Connection> &connection, const std::string &line)
+{
+    JsonValue request;
+    if (!parse_json(line, request) || request.type != JsonValue::Type::OBJECT) {
+        connection->send(error_response("null", "Invalid JSON request"));
+        return;
+    }
+
+    std::string id = "null";
+    if (const JsonValue *v = request.get("id", JsonValue::Type::STRING))
+        id = json_string(v->string);
+    else if (const JsonValue *v = request.get("id", JsonValue::Type::NUMBER))
+        id = json_number(v->number);
+
+    const JsonValue *command = request.get("command", JsonValue::Type::STRING);
+    if (!command)
+        connection->send(error_response(id, "Missing command"));
+    else if (command->string == "scan" || command->string == "tag")
+        submit(connection, id, request, command->string == "tag");
+    else if (command->string == "reload") {
+        const JsonValue *p = request.get("preset", JsonValue::Type::STRING);
+        std::filesystem::path new_preset;
+        {
+            std::lock_guard lock(config_mutex);
+            new_preset = p ? std::filesystem::path(p->string) : preset;
+        }
+        bool success = reload(new_preset);
+        if (!success)
+            connection->send(error_response(id, rsgain::format("Could not load preset '{}'", new_preset.string())));
+        connection->send(response(id, "done", rsgain::format("\"success\":{}", success)));
+    }
+    else if (command->string == "status") {
+        size_t queued, running;
+        pool.get_status(queued, running);
+        connection->send(response(id, "status", rsgain::format("\"queued\":{},\"running\":{},\"threads\":{}", queued, running, pool.size())));
+    }
+    else if (command->string == "shutdown") {
+        connection->send(response(id, "done", "\"success\":true"));
+        stopping = true;
+    }
+    else
+        connection->send(error_response(id, rsgain::format("Unknown command '{}'", command->string)));
+}
+
+void Server::submit(const std::shared_ptr<Connection> &connection, const std::string &id, const JsonValue &request, bool tag)
+{
+    const JsonValue *files = request.get("files", JsonValue::Type::ARRAY);
+    const JsonValue *directory = request.get("directory", JsonValue::Type::STRING);
+    if (!files == !directory) {
+        connection->send(error_response(id, "Exactly one of 'files' or 'directory' is required"));
+        return;
+    }
+
+    // Apply the request's overrides to a snapshot of the preset
+    ConfigTable table;
+    {
+        std::lock_guard lock(config_mutex);
+        table = configs;
+    }
+    const JsonValue *album = request.get("album", JsonValue::Type::BOOL);
+    const JsonValue *true_peak = request.get("true_peak", JsonValue::Type::BOOL);
+    const JsonValue *skip_existing = request.get("skip_existing", JsonValue::Type::BOOL);
+    const JsonValue *target = request.get("target_loudness", JsonValue::Type::NUMBER);
+    if (target && (target->number < MIN_TARGET_LOUDNESS || target->number > MAX_TARGET_LOUDNESS)) {
+        connection->send(error_response(id, "Invalid target loudness"));
+        return;
+    }
+    for (Config &config : table) {
+        if (config.tag_mode != 'n')
+            config.tag_mode = tag ? 'i' : 's';
+        config.tab_output = OutputType::NONE;
+        if (album)
+            config.do_album = album->boolean;
+        if (true_peak)
+            config.true_peak = true_peak->boolean;
+        if (skip_existing)
+            config.skip_existing = skip_existing->boolean;
+        if (target)
+            config.target_loudness = target->number;
+    }
+
+    rsgain::ScanCallbacks callbacks = {
+        .track = [connection, id](const rsgain::TrackResult &track) {
+            std::string fields = rsgain::format(
+                "\"path\":{},\"codec\":{},\"container\":{},\"duration\":{},\"track_gain\":{},\"track_peak\":{},\"track_loudness\":{},\"track_clip\":{}",
+                json_string(track.path.string()),
+                json_string(track.codec),
+                json_string(track.container),
+                json_number(track.duration),
+                json_number(track.result.track_gain),
+                json_number(track.result.track_peak),
+                json_number(track.result.track_loudness),
+                track.track_clip
+            );
+            if (track.cue_track)
+                rsgain::format_to(std::back_inserter(fields), ",\"cue_track\":{}", track.cue_track);
+            if (track.album) {
+                rsgain::format_to(std::back_inserter(fields), ",\"album_gain\":{},\"album_peak\":{},\"album_loudness\":{},\"album_clip\":{}",
+                    json_number(track.result.album_gain),
+                    json_number(track.result.album_peak),
+                    json_number(track.result.album_loudness),
+                    track.album_clip
+                );
+            }
+            connection->send(response(id, "track", fields));
+        },
+        .error = [connection, id](const std::filesystem::path &path, const std::string &message) {
+            connection->send(error_response(id, message, path));
+        },
+        .done = [connection, id](bool success) {
+            connection->send(response(id, "done", rsgain::format("\"success\":{}", success)));
+        }
+    };
+
+    connection->send(response(id, "queued"));
+    if (files) {
+        std::vector<std::filesystem::path> paths;
+        for (const JsonValue &file : files->array) {
+            // The daemon's own descriptors are not the client's to read
+            if (file.type != JsonValue::Type::STRING || parse_stream_name(file.string) >= 0) {
+                connection->send(error_response(id, "File names must be strings naming files"));
+                connection->send(response(id, "done", "\"success\":false"));
+                return;
+            }
+            paths.emplace_back(file.string);
+        }
+        scanner.submit_files(std::move(paths), table, std::move(callbacks));
+    }
+    else
+        scanner.submit_directory(directory->string, table, std::move(callbacks));
+}
+
+static void handle_signal([[maybe_unused]] int signal)
+{
+    Server::signalled = 1;
+}
+
+#endif
+
+// Parse Serve Mode command line arguments
+void serve_mode([[maybe_unused]] int argc, [[maybe_unused]] char *argv[])
+{
+#ifdef _WIN32
+    output_fail("Serve Mode is not supported on Windows");
+    quit(EXIT_FAILURE);
+#else
+    int rc, i;
+    const char *short_opts = "+hqm:p:";
+    unsigned int threads = get_resource_limits().threads();
+    std::filesystem::path preset;
+    static struct option long_opts[] = {
+        { "help",        no_argument,       nullptr, 'h' },
+        { "quiet",       no_argument,       nullptr, 'q' },
+        { "multithread", required_argument, nullptr, 'm' },
+        { "preset",      required_argument, nullptr, 'p' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((rc = getopt_long(argc, argv, short_opts, long_opts, &i)) != -1) {
+        switch (rc) {
+            case 'h':
+                help_serve();
+                quit(EXIT_SUCCESS);
+                break;
+
+            case 'q':
+                quiet = 1;
+                break;
+
+            case 'm':
+                if (!parse_multithread(optarg, threads))
+                    quit(EXIT_FAILURE);
+                break;
+
+            case 'p':
+                preset = optarg;
+                break;
+
+            case '?':
+                if (optopt)
+                    output_fail("Unrecognized option '{:c}'", optopt);
+                else
+                    output_fail("Unrecognized option '{}'", argv[optind - 1] + 2);
+                quit(EXIT_FAILURE);
+        }
+    }
+    if (argc == optind) {
+        output_fail("No socket specified");
+        quit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    Server server(argv[optind], preset, threads);
+    if (!server.start())
+        quit(EXIT_FAILURE);
+    server.run();
+#endif
+}
+
+static inline void help_serve() {
+    rsgain::print(COLOR_RED "Usage: " COLOR_OFF "{}{}{} serve [OPTIONS] SOCKET\n", COLOR_GREEN, EXECUTABLE_TITLE, COLOR_OFF);
+
+    rsgain::print("  Serve Mode runs as a daemon that accepts scan and tag requests as line-delimited\n");
+    rsgain::print("  JSON on the Unix domain socket SOCKET, keeping its worker threads and preset loaded.\n");
+    rsgain::print("  Send a 'reload' request to re-read the preset, or SIGTERM to shut down.\n");
+    rsgain::print("\n");
+
+    rsgain::print(COLOR_RED "Options:\n" COLOR_OFF);
+    CMD_HELP("--help",     "-h", "Show this help");
+    CMD_HELP("--quiet",      "-q",  "Don't print status messages");
+    CMD_HELP("--multithread=n", "-m n", "Scan with n parallel threads (default: all cores)");
+    CMD_HELP("--preset=s", "-p s", "Load settings from preset s");
+    rsgain::print("\n");
+    rsgain::print("Please report any issues to " PROJECT_URL "/issues\n\n");
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+void serve_mode(int argc, char *argv[]);
@@ -30,13 +30,16 @@
 
 #include <cmath>
 #include <cstdio>
+#include <chrono>
 #include <string>
 #include <array>
 #include <memory>
 #include <bit>
+#include <stdlib.h>
 
 #include <taglib/taglib.h>
 #include <taglib/fileref.h>
+#include <taglib/tpropertymap.h>
 #include <taglib/textidentificationframe.h>
 #include <taglib/mpegfile.h>
 #include <taglib/id3v2tag.h>
@@ -59,14 +62,18 @@
 #define CRCPP_USE_CPP11
 #include "external/CRC.h"
 
-#include "rsgain.hpp"
 #include "scan.hpp"
 #include "tag.hpp"
+#include "cue.hpp"
 #include "output.hpp"
 
 #define TAGLIB_VERSION (TAGLIB_MAJOR_VERSION * 10000 + TAGLIB_MINOR_VERSION * 100 + TAGLIB_PATCH_VERSION)
 #define FORMAT_GAIN(gain) rsgain::format("{:.2f} dB", gain)
 #define FORMAT_PEAK(peak) rsgain::format("{:.6f}", peak)
+#define FORMAT_LOUDNESS(loudness) rsgain::format("{:.2f} LUFS", loudness)
+
+// Retagging rewrites the same tags as a scan
+#define WRITE_TAGS(config) ((config).tag_mode == 'i' || (config).tag_mode == 'r')
 #define OPUS_HEADER_SIZE 47
 #define OGG_ROW_SIZE 4
 #define OPUS_HEAD_OFFSET 7 * OGG_ROW_SIZE
@@ -80,7 +87,7 @@
 #define MP4_ATOM_STRING "----:com.apple.iTunes:"
 #define FORMAT_MP4_TAG(s, tag) s.append(MP4_ATOM_STRING).append(tag)
 
-using RGTagsArray = std::array<TagLib::String, 7>;
+using RGTagsArray = std::array<TagLib::String, 9>;
 
 static bool set_mpc_packet_rg(const char *path);
 static bool tag_mp3(ScanJob::Track &track, const Config &config);
@@ -127,6 +134,8 @@ enum class RGTag {
     ALBUM_PEAK,
     ALBUM_RANGE,
     REFERENCE_LOUDNESS,
+    TRACK_LOUDNESS,
+    ALBUM_LOUDNESS,
     MAX_VAL
 };
 
@@ -137,7 +146,9 @@ static const RGTagsArray RG_STRING_UPPER = {{
     "REPLAYGAIN_ALBUM_GAIN",
     "REPLAYGAIN_ALBUM_PEAK",
     "REPLAYGAIN_ALBUM_RANGE",
-    "REPLAYGAIN_REFERENCE_LOUDNESS"
+    "REPLAYGAIN_REFERENCE_LOUDNESS",
+    "REPLAYGAIN_TRACK_LOUDNESS",
+    "REPLAYGAIN_ALBUM_LOUDNESS"
 }};
 
 static const RGTagsArray RG_STRING_LOWER = {{
@@ -147,7 +158,9 @@ static const RGTagsArray RG_STRING_LOWER = {{
     "replaygain_album_gain",
     "replaygain_album_peak",
     "replaygain_album_range",
-    "replaygain_reference_loudness"
+    "replaygain_reference_loudness",
+    "replaygain_track_loudness",
+    "replaygain_album_loudness"
 }};
 
 static_assert((size_t) RGTag::MAX_VAL == RG_STRING_UPPER.size());
@@ -168,6 +181,7 @@ static_assert((size_t) R128Tag::MAX_VAL == R128_STRING.size());
 bool tag_track(ScanJob::Track &track, const Config &config)
 {
     bool ret = false;
+    auto t = std::chrono::steady_clock::now();
     switch (track.type) {
         case FileType::MP2:
         case FileType::MP3:
@@ -238,15 +252,20 @@ bool tag_track(ScanJob::Track &track, const Config &config)
         default:
             break;
     }
-    if (track.mtime)
+    track.timings.tag = lap(t);
+    if (track.mtime) {
         std::filesystem::last_write_time(track.path, *(track.mtime));
+        track.timings.mtime = lap(t);
+    }
     if (!ret)
-        output_error("Couldn't write tags to: {}", track.path.string());
+        track.error = rsgain::format("Couldn't write tags to: {}", track.path.string());
     return ret;
 }
 
 bool tag_exists(const ScanJob::Track &track)
 {
+    if (track.cue_number)
+        return cue_gain_exists(track);
     switch(track.type) {
         case FileType::MP2:
         case FileType::MP3:
@@ -289,6 +308,59 @@ bool tag_exists(const ScanJob::Track &track)
     return false;
 }
 
+bool read_stored_loudness(ScanJob::Track &track, bool album)
+{
+    TagLib::PropertyMap properties;
+
+    // ASF attributes that TagLib doesn't know aren't in the property map
+    if (track.type == FileType::WMA) {
+        TagLib::ASF::File file(track.path.string().c_str(), false);
+        const TagLib::ASF::Tag *tag = file.tag();
+        if (!tag)
+            return false;
+        for (const RGTagsArray *strings : {&RG_STRING_UPPER, &RG_STRING_LOWER}) {
+            for (const TagLib::String &key : *strings) {
+                const TagLib::ASF::AttributeList attributes = tag->attribute(key);
+                if (!attributes.isEmpty())
+                    properties.insert(key.upper(), TagLib::StringList(attributes.front().toString()));
+            }
+        }
+    }
+    else {
+        TagLib::FileRef file(track.path.string().c_str(), false);
+        if (file.isNull())
+            return false;
+        properties = file.file()->properties();
+    }
+
+    // A value must be exactly as FORMAT_* wrote it, anything else fails the track rather
+    // than being read as a different number
+    bool invalid = false;
+    auto read = [&](RGTag rg_tag, std::string_view unit, double &value) {
+        auto it = properties.find(RG_STRING_UPPER[static_cast<size_t>(rg_tag)]);
+        if (it == properties.end() || it->second.isEmpty())
+            return false;
+        const std::string string = it->second.front().to8Bit(true);
+        size_t length = parse_number(string, value);
+        std::string_view rest = std::string_view(string).substr(length);
+        if (!length || !(rest.empty() || rest == unit)) {
+            invalid = true;
+            return false;
+        }
+        return true;
+    };
+
+    bool ret = read(RGTag::TRACK_LOUDNESS, " LUFS", track.result.track_loudness)
+        && read(RGTag::TRACK_PEAK, "", track.result.track_peak)
+        && (!album || read(RGTag::ALBUM_LOUDNESS, " LUFS", track.result.album_loudness));
+
+    // The ranges can't be recalculated either, so they're written back as they were
+    track.result.has_track_range = read(RGTag::TRACK_RANGE, " dB", track.result.track_range);
+    track.result.has_album_range = album && read(RGTag::ALBUM_RANGE, " dB", track.result.album_range);
+
+    return ret && !invalid;
+}
+
 template<typename T>
 static bool tag_exists_id3(const ScanJob::Track &track)
 {
@@ -382,15 +454,37 @@ static bool tag_exists_asf(const ScanJob::Track &track)
     tag->contains(RG_STRING_LOWER[static_cast<int>(RGTag::TRACK_GAIN)]);
 }
 
+// The measured loudness is kept so the gains can be recalculated without decoding.
+// Retagging needs the peaks too, so they're stored with it if no ReplayGain tags are written
+template<typename T>
+static void write_loudness_tags(const ScanResult &result, const Config &config, bool peaks, T&& write_tag)
+{
+    if (!config.store_loudness && config.tag_mode != 'r')
+        return;
+    write_tag(RGTag::TRACK_LOUDNESS, FORMAT_LOUDNESS(result.track_loudness));
+    if (peaks)
+        write_tag(RGTag::TRACK_PEAK, FORMAT_PEAK(result.track_peak));
+    if (config.do_album) {
+        write_tag(RGTag::ALBUM_LOUDNESS, FORMAT_LOUDNESS(result.album_loudness));
+        if (peaks)
+            write_tag(RGTag::ALBUM_PEAK, FORMAT_PEAK(result.album_peak));
+    }
+}
+
 template<typename T>
 static void write_rg_tags(const ScanResult &result, const Config &config, T&& write_tag)
 {
     write_tag(RGTag::TRACK_GAIN, FORMAT_GAIN(result.track_gain));
     write_tag(RGTag::TRACK_PEAK, FORMAT_PEAK(result.track_peak));
+    if (result.has_track_range)
+        write_tag(RGTag::TRACK_RANGE, FORMAT_GAIN(result.track_range));
     if (config.do_album) {
         write_tag(RGTag::ALBUM_GAIN, FORMAT_GAIN(result.album_gain));
         write_tag(RGTag::ALBUM_PEAK, FORMAT_PEAK(result.album_peak));
+        if (result.has_album_range)
+            write_tag(RGTag::ALBUM_RANGE, FORMAT_GAIN(result.album_range));
     }
+    write_loudness_tags(result, config, false, write_tag);
 }
 
 static bool tag_mp3(ScanJob::Track &track, const Config &config)
@@ -403,7 +497,7 @@ static bool tag_mp3(ScanJob::Track &track, const Config &config)
     if (id3v2version == ID3V2_KEEP)
         id3v2version = tag->isEmpty() ? 3: tag->header()->majorVersion();
     tag_clear(tag);
-    if (config.tag_mode == 'i')
+    if (WRITE_TAGS(config))
         tag_write(tag, track.result, config);
 
 #if TAGLIB_VERSION < 11200
@@ -423,7 +517,7 @@ static bool tag_flac(ScanJob::Track &track, const Config &config)
     if (!tag)
         return false;
     tag_clear<TagLib::FLAC::File>(tag);
-    if (config.tag_mode == 'i')
+    if (WRITE_TAGS(config))
         tag_write<TagLib::FLAC::File>(tag, track.result, config);
     return file.save();
 }
@@ -440,8 +534,7 @@ static bool tag_ogg(ScanJob::Track &track, const Config &config) {
         if (!tag)
             return false;
         tag_clear<T>(tag);
-        if (config.tag_mode == 'i' && (!std::is_same_v<T, TagLib::Ogg::Opus::File> ||
-            (config.opus_mode != 't' && config.opus_mode != 'a')))
+        if (WRITE_TAGS(config))
             tag_write<T>(tag, track.result, config);
 
         bool ret = file.save();
@@ -462,7 +555,7 @@ static bool tag_mp4(ScanJob::Track &track, const Config &config)
     if (!tag)
         return false;
     tag_clear(tag);
-    if (config.tag_mode == 'i')
+    if (WRITE_TAGS(config))
         tag_write(tag, track.result, config);
     
     return file.save();
@@ -476,7 +569,7 @@ static bool tag_apev2(ScanJob::Track &track, const Config &config)
     if (!tag)
         return false;
     tag_clear(tag);
-    if (config.tag_mode == 'i')
+    if (WRITE_TAGS(config))
         tag_write(tag, track.result, config);
     if constexpr(!std::is_same_v<T, TagLib::MPC::File>)
         return file.save();
@@ -495,7 +588,7 @@ static bool tag_wma(ScanJob::Track &track, const Config &config)
     if (!tag)
         return false;
     tag_clear(tag);
-    if (config.tag_mode == 'i')
+    if (WRITE_TAGS(config))
         tag_write(tag, track.result, config);
 
     return file.save();
@@ -516,7 +609,7 @@ static bool tag_riff(ScanJob::Track &track, const Config &config)
     if (id3v2version == ID3V2_KEEP)
         id3v2version = tag->isEmpty() ? 3: tag->header()->majorVersion();
     tag_clear(tag);
-    if (config.tag_mode == 'i')
+    if (WRITE_TAGS(config))
         tag_write(tag, track.result, config);
 
     if constexpr (std::is_same_v<T, TagLib::RIFF::WAV::File>)
@@ -619,8 +712,19 @@ static void tag_write(TagLib::Ogg::XiphComment *tag, const ScanResult &result, c
 {
     const RGTagsArray &RG_STRING = RG_STRING_UPPER;
 
+    // The gain goes in the Opus header, only the loudness is stored in tags
+    if (std::is_same_v<T, TagLib::Ogg::Opus::File> && (config.opus_mode == 't' || config.opus_mode == 'a')) {
+        write_loudness_tags(result,
+            config,
+            true,
+            [&](RGTag rg_tag, const TagLib::String &value) {
+                tag->addField(RG_STRING[static_cast<size_t>(rg_tag)], value);
+            }
+        );
+    }
+
     // Opus RFC 7845 tag
-    if (std::is_same_v<T, TagLib::Ogg::Opus::File> && (config.opus_mode == 'r' || config.opus_mode == 's')) {
+    else if (std::is_same_v<T, TagLib::Ogg::Opus::File> && (config.opus_mode == 'r' || config.opus_mode == 's')) {
         tag->addField(R128_STRING[static_cast<int>(R128Tag::TRACK_GAIN)], 
             rsgain::format("{}", GAIN_TO_Q78(result.track_gain))
         );
@@ -630,6 +734,13 @@ static void tag_write(TagLib::Ogg::XiphComment *tag, const ScanResult &result, c
                 rsgain::format("{}", GAIN_TO_Q78(result.album_gain))
             );
         }
+        write_loudness_tags(result,
+            config,
+            true,
+            [&](RGTag rg_tag, const TagLib::String &value) {
+                tag->addField(RG_STRING[static_cast<size_t>(rg_tag)], value);
+            }
+        );
     }
 
     // Default ReplayGain tag
@@ -36,5 +36,8 @@
 
 bool tag_track(ScanJob::Track &track, const Config &config);
 bool tag_exists(const ScanJob::Track &track);
+
+// Fill in the loudness and peak written with StoreLoudness, and the album loudness if album is set
+bool read_stored_loudness(ScanJob::Track &track, bool album);
 bool set_opus_header_gain(const char *path, int16_t gain);
 
@@ -0,0 +1,104 @@
+#include <mutex>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <filesystem>
+#include <stdio.h>
+
+#include "trace.hpp"
+#include "output.hpp"
+
+void Trace::start(const std::filesystem::path &file)
+{
+    epoch = std::chrono::steady_clock::now();
+    Trace::file = file;
+    set_thread_name("Main");
+}
+
+int64_t Trace::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+Trace::Buffer& Trace::buffer()
+{
+    thread_local Buffer *buffer = nullptr;
+    if (!buffer) {
+        std::scoped_lock lock(mutex);
+        buffers.emplace_back(std::make_unique<Buffer>());
+        buffer = buffers.back().get();
+        buffer->tid = (int) buffers.size();
+    }
+    return *buffer;
+}
+
+void Trace::set_thread_name(const std::string &name)
+{
+    if (enabled())
+        buffer().thread_name = name;
+}
+
+void Trace::record(const char *name, std::string &&detail, int64_t start, int64_t end)
+{
+    Buffer &b = buffer();
+    Event event = {name, std::move(detail), start, end - start};
+    if (!b.full && nb_events.fetch_add(1, std::memory_order_relaxed) < MAX_EVENTS) {
+        b.events.push_back(std::move(event));
+        return;
+    }
+
+    // Out of budget, overwrite the oldest event. A thread that started too late to get any is dropped
+    b.full = true;
+    if (b.events.empty())
+        return;
+    b.events[b.next] = std::move(event);
+    b.next = (b.next + 1) % b.events.size();
+}
+
+// Write all buffered events to the trace file. Must be called after all worker threads have finished.
+// Threads still hold pointers to their buffers, so they're kept until the process exits
+bool Trace::write()
+{
+    if (!enabled())
+        return true;
+    std::FILE *stream = fopen(file.string().c_str(), "wb");
+    file.clear();
+    if (!stream) {
+        output_error("Could not open trace file");
+        return false;
+    }
+
+    std::scoped_lock lock(mutex);
+    std::string block = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    auto out = std::back_inserter(block);
+    bool first = true;
+    for (const auto &b : buffers) {
+        if (!b->thread_name.empty()) {
+            rsgain::format_to(out, "{}{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"name\":{}}}}}",
+                first ? "" : ",\n",
+                b->tid,
+                json_string(b->thread_name)
+            );
+            first = false;
+        }
+        for (const Event &event : b->events) {
+            rsgain::format_to(out, "{}{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{},\"dur\":{}",
+                first ? "" : ",\n",
+                event.name,
+                b->tid,
+                event.start,
+                event.duration
+            );
+            if (!event.detail.empty())
+                rsgain::format_to(out, ",\"args\":{{\"path\":{}}}", json_string(event.detail));
+            block += '}';
+            first = false;
+        }
+        fwrite(block.data(), 1, block.size(), stream);
+        block.clear();
+    }
+    block += "\n]}\n";
+    fwrite(block.data(), 1, block.size(), stream);
+    fclose(stream);
+    return true;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <filesystem>
+
+// Records begin/end events per thread and exports them in the Chrome trace event
+// format, which can be loaded in chrome://tracing or ui.perfetto.dev
+class Trace {
+    public:
+        struct Event {
+            const char *name;
+            std::string detail;
+            int64_t start;
+            int64_t duration;
+        };
+
+        static void start(const std::filesystem::path &file);
+        static bool write();
+        static void set_thread_name(const std::string &name);
+        static inline bool enabled() { return !file.empty(); }
+        static int64_t now();
+        static void record(const char *name, std::string &&detail, int64_t start, int64_t end);
+
+    private:
+        // Each thread owns a buffer, so recording never contends on a lock. The buffers grow
+        // until all of them together hold MAX_EVENTS, then each one becomes a ring buffer
+        // that keeps its latest events. A buffer outlives its thread, which only keeps a
+        // pointer to it, so the buffers are never freed before the process exits
+        struct Buffer {
+            int tid;
+            std::string thread_name;
+            std::vector<Event> events;
+            size_t next = 0;
+            bool full = false;
+        };
+
+        static constexpr size_t MAX_EVENTS = 1 << 18;
+        inline static std::filesystem::path file;
+        inline static std::chrono::steady_clock::time_point epoch;
+        inline static std::mutex mutex;
+        inline static std::vector<std::unique_ptr<Buffer>> buffers;
+        inline static std::atomic<size_t> nb_events = 0;
+
+        static Buffer& buffer();
+};
+
+// Records an event from construction (or begin) until destruction (or end)
+class TraceScope {
+    private:
+        const char *name = nullptr;
+        const std::filesystem::path *path = nullptr;
+        int64_t start_time;
+
+    public:
+        TraceScope() {}
+        TraceScope(const char *name, const std::filesystem::path *path = nullptr) { begin(name, path); }
+        ~TraceScope() { end(); }
+        TraceScope(const TraceScope&) = delete;
+        TraceScope& operator=(const TraceScope&) = delete;
+
+        void begin(const char *name, const std::filesystem::path *path = nullptr)
+        {
+            end();
+            if (!Trace::enabled())
+                return;
+            this->name = name;
+            this->path = path;
+            start_time = Trace::now();
+        }
+
+        void end()
+        {
+            if (!name)
+                return;
+            Trace::record(name, path ? path->string() : std::string(), start_time, Trace::now());
+            name = nullptr;
+        }
+};